@@ -0,0 +1,404 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "aio.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#include "disk.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "utils.h"
+
+#define LOCAL_TRACE 0
+
+namespace {
+
+// Completions are posted back by the worker threads and picked up by the
+// thread driving the engine.
+class ThreadEngine : public IoEngine {
+  public:
+    ThreadEngine(const Disk &disk, size_t queue_depth)
+        : IoEngine(disk, queue_depth), pool_(std::min<size_t>(queue_depth, 64)) {}
+    ~ThreadEngine() override { pool_.Wait(); }
+
+    const char *name() const override { return "threads"; }
+
+  protected:
+    void Start(Request req) override {
+        pool_.Submit([this, req = std::move(req)]() mutable {
+            int err = disk_.read(req.offset, req.buf, req.len);
+            std::lock_guard guard(lock_);
+            done_.emplace_back(std::move(req), err);
+            cv_.notify_one();
+        });
+    }
+
+    void Reap(bool wait) override {
+        std::vector<std::pair<Request, int>> done;
+        {
+            std::unique_lock guard(lock_);
+            if (wait) {
+                cv_.wait(guard, [this]() { return !done_.empty(); });
+            }
+            done.swap(done_);
+        }
+        for (auto &[req, err] : done) {
+            Complete(req, err);
+        }
+    }
+
+  private:
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::vector<std::pair<Request, int>> done_;
+    ThreadPool pool_;
+};
+
+#ifdef __linux__
+
+// Requests queued before the backend is poked, when using io_uring
+const size_t uring_submit_batch = 16;
+
+// io_uring driven directly through its system calls and shared rings
+class UringEngine : public IoEngine {
+  public:
+    UringEngine(const Disk &disk, size_t queue_depth) : IoEngine(disk, queue_depth) {}
+    ~UringEngine() override;
+
+    int Init();
+
+    const char *name() const override { return "io_uring"; }
+
+  protected:
+    void Start(Request req) override;
+    void Flush() override;
+    void Reap(bool wait) override;
+
+  private:
+    struct Slot {
+        Request req;
+        struct iovec iov;
+    };
+
+    void Queue(uint32_t slot);
+
+    // Move whatever is on the completion queue onto completed_, without
+    // submitting or waiting. Returns the number of entries taken off it.
+    size_t ReapCompletions();
+    int Enter(unsigned to_submit, unsigned min_complete);
+
+    int ring_fd_ = -1;
+    void *sq_ring_ = MAP_FAILED;
+    size_t sq_ring_size_ = 0;
+    void *cq_ring_ = MAP_FAILED;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe *sqes_ = (io_uring_sqe *)MAP_FAILED;
+    size_t sqes_size_ = 0;
+
+    unsigned *sq_tail_ = nullptr;
+    unsigned *sq_mask_ = nullptr;
+    unsigned *sq_array_ = nullptr;
+    unsigned *cq_head_ = nullptr;
+    unsigned *cq_tail_ = nullptr;
+    unsigned *cq_mask_ = nullptr;
+    io_uring_cqe *cqes_ = nullptr;
+
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> free_;
+    unsigned unsubmitted_ = 0;
+};
+
+UringEngine::~UringEngine() {
+    // the kernel may still be writing into buffers we are about to give back
+    while (outstanding_ > 0) {
+        Reap(true);
+    }
+    if (sqes_ != MAP_FAILED) {
+        munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+    if (ring_fd_ >= 0) {
+        close(ring_fd_);
+    }
+}
+
+int UringEngine::Init() {
+    io_uring_params params{};
+    ring_fd_ = syscall(__NR_io_uring_setup, (unsigned)queue_depth_, &params);
+    if (ring_fd_ < 0) {
+        LTRACEF("io_uring_setup failed, errno %d\n", errno);
+        return -1;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+        return -1;
+    }
+    cq_ring_ = single_mmap ? sq_ring_
+                           : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+        return -1;
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe *)mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        return -1;
+    }
+
+    auto *sq = (uint8_t *)sq_ring_;
+    sq_tail_ = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask_ = (unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array_ = (unsigned *)(sq + params.sq_off.array);
+    auto *cq = (uint8_t *)cq_ring_;
+    cq_head_ = (unsigned *)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask_ = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // never have more requests outstanding than there are submission entries
+    slots_.resize(std::min<size_t>(queue_depth_, params.sq_entries));
+    for (uint32_t i = slots_.size(); i > 0; i--) {
+        free_.push_back(i - 1);
+    }
+
+    LTRACEF("io_uring with %u entries\n", params.sq_entries);
+
+    return 0;
+}
+
+int UringEngine::Enter(unsigned to_submit, unsigned min_complete) {
+    for (;;) {
+        int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete,
+                          min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (ret >= 0 || errno != EINTR) {
+            return ret;
+        }
+    }
+}
+
+void UringEngine::Queue(uint32_t slot) {
+    auto &s = slots_[slot];
+    s.iov = {s.req.buf, s.req.len};
+
+    const unsigned tail = *sq_tail_;
+    const unsigned index = tail & *sq_mask_;
+    auto *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = disk_.native_fd();
+    sqe->off = s.req.offset;
+    sqe->addr = (uint64_t)(uintptr_t)&s.iov;
+    sqe->len = 1;
+    sqe->user_data = slot;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+    if (++unsubmitted_ >= uring_submit_batch) {
+        Flush();
+    }
+}
+
+void UringEngine::Start(Request req) {
+    assert(!free_.empty());
+    const uint32_t slot = free_.back();
+    free_.pop_back();
+    slots_[slot].req = std::move(req);
+    Queue(slot);
+}
+
+void UringEngine::Flush() {
+    while (unsubmitted_ > 0) {
+        int ret = Enter(unsubmitted_, 0);
+        if (ret > 0) {
+            unsubmitted_ -= ret;
+            continue;
+        }
+        const int err = ret < 0 ? errno : EAGAIN;
+        if (err == EAGAIN || err == EBUSY) {
+            // the completion queue needs draining first, or the kernel is
+            // short of memory for the moment
+            if (ReapCompletions() == 0 && outstanding_ > unsubmitted_) {
+                Enter(0, 1);
+            }
+            continue;
+        }
+
+        // take back what the kernel has not seen and fail it
+        LTRACEF("io_uring_enter failed, errno %d\n", err);
+        unsigned tail = *sq_tail_;
+        for (; unsubmitted_ > 0; unsubmitted_--) {
+            tail--;
+            const uint32_t slot = sqes_[sq_array_[tail & *sq_mask_]].user_data;
+            Complete(slots_[slot].req, -err);
+            free_.push_back(slot);
+        }
+        __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    }
+}
+
+void UringEngine::Reap(bool wait) {
+    Flush();
+    if (ReapCompletions() == 0 && wait && outstanding_ > 0) {
+        Enter(0, 1);
+        ReapCompletions();
+    }
+}
+
+size_t UringEngine::ReapCompletions() {
+    size_t reaped = 0;
+    unsigned head = *cq_head_;
+    std::vector<uint32_t> requeue;
+    while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        const auto &cqe = cqes_[head & *cq_mask_];
+        const uint32_t slot = cqe.user_data;
+        const int res = cqe.res;
+        head++;
+        reaped++;
+
+        auto &req = slots_[slot].req;
+        if (res > 0 && (size_t)res < req.len) {
+            // short read, go back for the rest
+            req.offset += res;
+            req.buf += res;
+            req.len -= res;
+            requeue.push_back(slot);
+            continue;
+        }
+        Complete(req, res > 0 ? 0 : (res < 0 ? res : -1));
+        free_.push_back(slot);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+    for (auto slot : requeue) {
+        Queue(slot);
+    }
+    return reaped;
+}
+
+#endif // __linux__
+
+} // namespace
+
+std::unique_ptr<IoEngine> IoEngine::Create(const Disk &disk, size_t queue_depth,
+                                           Backend backend) {
+    queue_depth = std::clamp<size_t>(queue_depth, 1, 4096);
+
+#ifdef __linux__
+    // reads of a compressed image have to go through the disk to be decompressed
+    if (backend != Backend::THREADS && !disk.is_compressed()) {
+        auto uring = std::make_unique<UringEngine>(disk, queue_depth);
+        if (uring->Init() == 0) {
+            return uring;
+        }
+        if (backend == Backend::URING) {
+            fprintf(stderr, "io_uring not available, using threads\n");
+        }
+    }
+#else
+    if (backend == Backend::URING) {
+        fprintf(stderr, "io_uring not available, using threads\n");
+    }
+#endif
+
+    return std::make_unique<ThreadEngine>(disk, queue_depth);
+}
+
+IoEngine::~IoEngine() = default;
+
+void IoEngine::Submit(uint64_t offset, void *buf, size_t len, Callback done) {
+    // holes in a sparse image need no I/O at all
+    if (disk_.is_zero(offset, len)) {
+        memset(buf, 0, len);
+        completed_.emplace_back(std::move(done), 0);
+        return;
+    }
+
+    // O_DIRECT needs aligned requests, take the slow path through the disk's
+    // bounce buffer for anything else
+    if (disk_.is_direct() &&
+        (offset % disk_.alignment() || len % disk_.alignment() ||
+         (uintptr_t)buf % disk_.alignment())) {
+        completed_.emplace_back(std::move(done), disk_.read(offset, buf, len));
+        return;
+    }
+
+    while (outstanding_ >= queue_depth_) {
+        Reap(true);
+        RunCallbacks();
+    }
+
+    outstanding_++;
+    const uint64_t start = stats::enabled() ? stats::internal::Now() : 0;
+    Start({offset, (uint8_t *)buf, len, std::move(done), start});
+}
+
+void IoEngine::Poll() {
+    Flush();
+    Reap(false);
+    RunCallbacks();
+}
+
+void IoEngine::Drain() {
+    // callbacks may submit more reads, so loop until everything is quiet
+    WaitUntil([]() { return false; });
+}
+
+void IoEngine::WaitUntil(const std::function<bool()> &ready) {
+    for (;;) {
+        RunCallbacks();
+        if (ready() || outstanding_ == 0) {
+            break;
+        }
+        Reap(true);
+    }
+}
+
+void IoEngine::Complete(Request &req, int err) {
+    if (req.start) {
+        stats::internal::Record(stats::Op::ASYNC_READ, req.start, stats::internal::Now(),
+                                req.len, req.offset / 512);
+    }
+    outstanding_--;
+    completed_.emplace_back(std::move(req.done), err);
+}
+
+void IoEngine::RunCallbacks() {
+    while (!completed_.empty()) {
+        auto done = std::move(completed_);
+        completed_.clear();
+        for (auto &[callback, err] : done) {
+            callback(err);
+        }
+    }
+}
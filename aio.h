@@ -0,0 +1,83 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class Disk;
+
+// Asynchronous reads against a Disk, keeping up to queue_depth reads in
+// flight. Uses io_uring where the kernel allows it and otherwise a pool of
+// threads issuing pread.
+//
+// Completion callbacks always run on the thread driving the engine, from
+// inside Submit, Poll or Drain, so callers need no locking of their own. An
+// engine must only be driven by one thread at a time.
+class IoEngine {
+  public:
+    using Callback = std::function<void(int err)>;
+
+    enum class Backend {
+        AUTO,
+        URING,
+        THREADS,
+    };
+
+    static std::unique_ptr<IoEngine> Create(const Disk &disk, size_t queue_depth,
+                                            Backend backend = Backend::AUTO);
+    virtual ~IoEngine();
+
+    // Queue a read, first waiting for a slot if queue_depth reads are already
+    // outstanding. Queued reads are handed to the kernel in batches, at the
+    // latest by the next Poll or Drain.
+    void Submit(uint64_t offset, void *buf, size_t len, Callback done);
+
+    // Run the callbacks of any reads that have completed, without waiting
+    void Poll();
+
+    // Wait for every outstanding read and run its callback
+    void Drain();
+
+    // Run callbacks, waiting for more reads to complete, until ready returns
+    // true or nothing is left outstanding
+    void WaitUntil(const std::function<bool()> &ready);
+
+    virtual const char *name() const = 0;
+    size_t queue_depth() const { return queue_depth_; }
+    const Disk &disk() const { return disk_; }
+
+  protected:
+    IoEngine(const Disk &disk, size_t queue_depth) : disk_(disk), queue_depth_(queue_depth) {}
+
+    struct Request {
+        uint64_t offset;
+        uint8_t *buf;
+        size_t len;
+        Callback done;
+        uint64_t start; // for the instrumentation
+    };
+
+    // Backend hooks. Start hands a request to the backend, there is always a
+    // free slot when it is called. Reap moves completed requests onto
+    // completed_, waiting for at least one if wait is set.
+    virtual void Start(Request req) = 0;
+    virtual void Flush() {}
+    virtual void Reap(bool wait) = 0;
+
+    void Complete(Request &req, int err);
+
+    const Disk &disk_;
+    const size_t queue_depth_;
+    size_t outstanding_ = 0;
+    std::vector<std::pair<Callback, int>> completed_;
+
+  private:
+    void RunCallbacks();
+};
@@ -0,0 +1,343 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "alloc.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include "file.h"
+#include "filesystem.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+const uint32_t bits_per_block = 512 * 8;
+
+// Past this many pieces an allocation fails rather than fill up the header
+const uint32_t max_alloc_runs = 32;
+
+// Headers added to the index file at a time when it runs out
+const uint32_t index_grow_blocks = 1024;
+
+} // namespace
+
+int FileBitmap::Load(std::shared_ptr<File> file, uint32_t vbn, uint32_t bits) {
+    const uint32_t blocks = (bits + bits_per_block - 1) / bits_per_block;
+    std::vector<uint64_t> words((size_t)blocks * 512 / sizeof(uint64_t));
+    if (file->ReadVbns(vbn, blocks, words.data()) < 0) {
+        return -1;
+    }
+
+    file_ = std::move(file);
+    vbn_ = vbn;
+    bits_ = bits;
+    words_.swap(words);
+    dirty_.assign(blocks, false);
+    return 0;
+}
+
+int FileBitmap::Flush() {
+    // one write per run of changed blocks
+    for (uint32_t b = 0; b < dirty_.size();) {
+        if (!dirty_[b]) {
+            b++;
+            continue;
+        }
+        uint32_t n = 1;
+        while (b + n < dirty_.size() && dirty_[b + n]) {
+            n++;
+        }
+        if (file_->WriteVbns(vbn_ + b, n, (const uint8_t *)words_.data() + (size_t)b * 512) < 0) {
+            return -1;
+        }
+        std::fill(dirty_.begin() + b, dirty_.begin() + b + n, false);
+        b += n;
+    }
+    return 0;
+}
+
+void FileBitmap::Assign(uint32_t first, uint32_t count, bool value) {
+    assert(first + count <= bits_);
+    if (count == 0) {
+        return;
+    }
+    for (uint32_t b = first / bits_per_block; b <= (first + count - 1) / bits_per_block; b++) {
+        dirty_[b] = true;
+    }
+
+    uint32_t bit = first;
+    const uint32_t end = first + count;
+    while (bit < end) {
+        const uint32_t shift = bit % 64;
+        const uint32_t n = std::min(64 - shift, end - bit);
+        const uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << shift;
+        if (value) {
+            words_[bit / 64] |= mask;
+        } else {
+            words_[bit / 64] &= ~mask;
+        }
+        bit += n;
+    }
+}
+
+uint32_t FileBitmap::Find(uint32_t from, uint32_t limit, bool value) const {
+    if (from >= limit) {
+        return limit;
+    }
+
+    // whole words of the other value are skipped in one step
+    const uint64_t flip = value ? 0 : ~0ULL;
+    const uint32_t last = (limit - 1) / 64;
+    uint32_t w = from / 64;
+    uint64_t word = (words_[w] ^ flip) & (~0ULL << (from % 64));
+    while (word == 0) {
+        if (++w > last) {
+            return limit;
+        }
+        word = words_[w] ^ flip;
+    }
+    return std::min(w * 64 + (uint32_t)__builtin_ctzll(word), limit);
+}
+
+int ClusterAllocator::Load() {
+    auto bitmap = std::make_shared<File>(fs_);
+    if (bitmap->Open({reserved_files::BITMAP, reserved_files::BITMAP}) < 0) {
+        return -1;
+    }
+    cluster_ = fs_.cluster_factor();
+    if (cluster_ == 0) {
+        return -1;
+    }
+
+    // vbn 1 is the storage control block, the bitmap itself follows
+    const uint32_t clusters = (fs_.volume_blocks() + cluster_ - 1) / cluster_;
+    if (map_.Load(std::move(bitmap), 2, clusters) < 0) {
+        fprintf(stderr, "error reading the storage bitmap\n");
+        return -1;
+    }
+
+    free_ = 0;
+    for (uint32_t c = map_.Find(0, clusters, true); c < clusters;) {
+        const uint32_t end = map_.Find(c, clusters, false);
+        free_ += end - c;
+        c = map_.Find(end, clusters, true);
+    }
+
+    LTRACEF("%u of %u clusters free\n", free_, clusters);
+
+    return 0;
+}
+
+uint32_t ClusterAllocator::FindRun(uint32_t from, uint32_t limit, uint32_t want,
+                                   uint32_t *start) const {
+    uint32_t best = 0;
+    uint32_t pos = from;
+    while (pos < limit) {
+        const uint32_t s = map_.Find(pos, limit, true);
+        if (s >= limit) {
+            break;
+        }
+        // no need to look further than the end of the run we want
+        const uint32_t e = map_.Find(s, std::min<uint64_t>(limit, (uint64_t)s + want), false);
+        if (e - s > best) {
+            best = e - s;
+            *start = s;
+            if (best >= want) {
+                break;
+            }
+        }
+        pos = e;
+    }
+    return best;
+}
+
+void ClusterAllocator::Take(uint32_t cluster, uint32_t count) {
+    map_.Assign(cluster, count, false);
+    free_ -= count;
+    rotor_ = cluster + count;
+}
+
+int ClusterAllocator::AllocateContiguous(uint32_t blocks, LbnRun *run) {
+    const uint32_t want = (blocks + cluster_ - 1) / cluster_;
+    const uint32_t clusters = map_.bits();
+
+    uint32_t start = 0;
+    if (FindRun(rotor_, clusters, want, &start) < want &&
+        FindRun(0, rotor_, want, &start) < want) {
+        return -1;
+    }
+    Take(start, want);
+    *run = {start * cluster_, want * cluster_};
+    return 0;
+}
+
+int ClusterAllocator::Allocate(uint32_t blocks, std::vector<LbnRun> *runs) {
+    uint32_t want = (blocks + cluster_ - 1) / cluster_;
+    if (want == 0) {
+        return 0;
+    }
+    if (want > free_) {
+        fprintf(stderr, "volume full, %u clusters wanted and %u free\n", want, free_);
+        return -1;
+    }
+
+    LbnRun run;
+    if (AllocateContiguous(blocks, &run) == 0) {
+        runs->push_back(run);
+        return 0;
+    }
+
+    // no single run is big enough, piece it together from the largest ones
+    std::vector<LbnRun> pieces;
+    while (want > 0 && pieces.size() < max_alloc_runs) {
+        uint32_t start = 0;
+        const uint32_t n = FindRun(0, map_.bits(), want, &start);
+        if (n == 0) {
+            break;
+        }
+        Take(start, n);
+        pieces.push_back({start * cluster_, n * cluster_});
+        want -= n;
+    }
+    if (want > 0) {
+        fprintf(stderr, "free space too fragmented for %u blocks\n", blocks);
+        for (auto &p : pieces) {
+            Free(p);
+        }
+        return -1;
+    }
+
+    runs->insert(runs->end(), pieces.begin(), pieces.end());
+    return 0;
+}
+
+bool ClusterAllocator::Extend(uint32_t lbn, uint32_t blocks) {
+    if (lbn % cluster_) {
+        return false;
+    }
+    const uint32_t first = lbn / cluster_;
+    const uint32_t count = (blocks + cluster_ - 1) / cluster_;
+    if ((uint64_t)first + count > map_.bits() ||
+        map_.Find(first, first + count, false) != first + count) {
+        return false;
+    }
+    Take(first, count);
+    return true;
+}
+
+void ClusterAllocator::Free(const LbnRun &run) {
+    map_.Assign(run.lbn / cluster_, run.count / cluster_, true);
+    free_ += run.count / cluster_;
+}
+
+int FileNumberAllocator::Load() {
+    const auto &hb = fs_.home();
+    const uint32_t bits = std::min<uint32_t>(hb.maxfiles, hb.ibmapsize * bits_per_block);
+    if (map_.Load(fs_.index_file(), hb.ibmapvbn, bits) < 0) {
+        fprintf(stderr, "error reading the index file bitmap\n");
+        return -1;
+    }
+    return 0;
+}
+
+int FileNumberAllocator::Allocate(uint32_t count, std::vector<file_id> *ids) {
+    if (count == 0) {
+        return 0;
+    }
+
+    // bit n is file number n + 1
+    std::vector<uint32_t> nums;
+    uint32_t bit = rotor_;
+    for (uint32_t i = 0; i < count; i++) {
+        bit = map_.Find(bit, map_.bits(), false);
+        if (bit >= map_.bits()) {
+            fprintf(stderr, "no free file numbers, the volume holds at most %u files\n",
+                    map_.bits());
+            return -1;
+        }
+        nums.push_back(++bit);
+    }
+
+    auto index = fs_.index_file();
+    const uint32_t first_vbn = fs_.index_file_starting_vbn();
+    const uint32_t needed = first_vbn + nums.back();
+    if (needed > index->AllocatedBlocks() &&
+        GrowIndexFile(needed - index->AllocatedBlocks()) < 0) {
+        return -1;
+    }
+
+    // pick up the sequence numbers of whatever used the header blocks last,
+    // reading runs of consecutive numbers at a time
+    std::vector<Disk::Block> blocks;
+    for (size_t i = 0; i < nums.size();) {
+        size_t n = 1;
+        while (i + n < nums.size() && nums[i + n] == nums[i] + n) {
+            n++;
+        }
+        blocks.resize(n);
+        if (index->ReadVbns(first_vbn + nums[i], n, blocks.data()) < 0) {
+            return -1;
+        }
+        for (size_t j = 0; j < n; j++) {
+            const auto *fh = (const file_header *)blocks[j].buf.data();
+            const auto checksum = ((const uint16_t *)blocks[j].buf.data())[255];
+            uint16_t seq = 1;
+            if (fh->fid.file_num() == nums[i + j] &&
+                block_checksum(blocks[j].buf.data(), 255) == checksum) {
+                seq = std::max<uint16_t>(fh->fid.sequence_num + 1, 1);
+            }
+            ids->push_back(file_id(nums[i + j], seq, 0));
+            map_.Assign(nums[i + j] - 1, 1, true);
+        }
+        i += n;
+    }
+    rotor_ = nums.back();
+
+    return 0;
+}
+
+int FileNumberAllocator::GrowIndexFile(uint32_t blocks) {
+    auto index = fs_.index_file();
+    const auto &hb = fs_.home();
+
+    // grow by a good chunk at a time, but not past the last file number, and
+    // never into more than a quarter of the free space
+    const uint32_t c = fs_.cluster_factor();
+    const uint32_t allocated = index->AllocatedBlocks();
+    const uint32_t limit = fs_.index_file_starting_vbn() + map_.bits();
+    const uint32_t spare = (uint64_t)clusters_.free_clusters() * c / 4;
+    blocks = std::max(blocks, std::min({index_grow_blocks, limit - allocated, spare}));
+
+    std::vector<LbnRun> runs;
+    for (auto &e : index->extents()) {
+        runs.push_back({e.lbn, e.block_count});
+    }
+    auto &last = runs.back();
+    if (clusters_.Extend(last.lbn + last.count, blocks)) {
+        last.count += (blocks + c - 1) / c * c;
+    } else if (clusters_.Allocate(blocks, &runs) < 0) {
+        fprintf(stderr, "no room to grow the index file\n");
+        return -1;
+    }
+
+    LTRACEF("index file grows from %u to %u blocks\n", allocated, allocated + blocks);
+
+    if (index->SetExtents(runs) < 0 ||
+        index->SetEndOfFile((uint64_t)index->AllocatedBlocks() * 512) < 0) {
+        return -1;
+    }
+
+    // and keep the backup header the home block points at in step
+    return fs_.cache().Write(hb.altidxlbn, 1, index->header_block().buf.data(),
+                             BlockCache::Kind::HEADER);
+}
+
+} // namespace ods2
@@ -0,0 +1,107 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "layout.h"
+#include "ods2.h"
+
+namespace ods2 {
+
+class File;
+class Filesystem;
+
+// In memory copy of a bitmap stored in a file, kept as 64 bit words so runs
+// of set and clear bits can be skipped a word at a time. Changed blocks are
+// written back through the file on Flush.
+class FileBitmap {
+  public:
+    // bits of the bitmap start at vbn of file
+    int Load(std::shared_ptr<File> file, uint32_t vbn, uint32_t bits);
+    int Flush();
+
+    uint32_t bits() const { return bits_; }
+    bool test(uint32_t bit) const { return (words_[bit / 64] >> (bit % 64)) & 1; }
+    void Assign(uint32_t first, uint32_t count, bool value);
+
+    // First bit in [from, limit) with the given value, or limit if none
+    uint32_t Find(uint32_t from, uint32_t limit, bool value) const;
+
+  private:
+    std::shared_ptr<File> file_;
+    uint32_t vbn_ = 0;
+    uint32_t bits_ = 0;
+    std::vector<uint64_t> words_;
+    std::vector<bool> dirty_; // per block of the bitmap
+};
+
+// Allocates clusters from the storage bitmap in BITMAP.SYS, where a set bit
+// is a free cluster. Allocations take the first run big enough for the whole
+// request after the previous allocation, wrapping around the volume once, so
+// a stream of small files is laid down in order and each gets one extent.
+class ClusterAllocator {
+  public:
+    explicit ClusterAllocator(const Filesystem &fs) : fs_(fs) {}
+
+    int Load();
+
+    // Allocate enough clusters for blocks, in as few runs as possible
+    int Allocate(uint32_t blocks, std::vector<LbnRun> *runs);
+
+    // Allocate blocks in a single run, as directories need
+    int AllocateContiguous(uint32_t blocks, LbnRun *run);
+
+    // Grow in place a run that ends at lbn, if the clusters there are free
+    bool Extend(uint32_t lbn, uint32_t blocks);
+
+    void Free(const LbnRun &run);
+
+    int Flush() { return map_.Flush(); }
+
+    uint32_t free_clusters() const { return free_; }
+
+  private:
+    void Take(uint32_t cluster, uint32_t count);
+
+    // First run of at least want free clusters in [from, limit), or the
+    // largest one found if there is none that long. Returns its length.
+    uint32_t FindRun(uint32_t from, uint32_t limit, uint32_t want, uint32_t *start) const;
+
+    const Filesystem &fs_;
+    FileBitmap map_;
+    uint32_t cluster_ = 1;
+    uint32_t rotor_ = 0;
+    uint32_t free_ = 0;
+};
+
+// Allocates file numbers from the index file bitmap, where a set bit is a file
+// in use, growing the index file when a new number has no header block yet.
+class FileNumberAllocator {
+  public:
+    FileNumberAllocator(const Filesystem &fs, ClusterAllocator &clusters)
+        : fs_(fs), clusters_(clusters) {}
+
+    int Load();
+
+    // Allocate count file ids, lowest numbers first. The sequence number of
+    // each follows whatever the header block last held.
+    int Allocate(uint32_t count, std::vector<file_id> *ids);
+
+    int Flush() { return map_.Flush(); }
+
+  private:
+    int GrowIndexFile(uint32_t blocks);
+
+    const Filesystem &fs_;
+    ClusterAllocator &clusters_;
+    FileBitmap map_;
+    uint32_t rotor_ = 0;
+};
+
+} // namespace ods2
@@ -0,0 +1,273 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "batch.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "export.h"
+#include "extract.h"
+#include "filesystem.h"
+#include "iolimit.h"
+#include "manifest.h"
+#include "readcache.h"
+#include "threadpool.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+const double mib = 1024.0 * 1024.0;
+
+size_t ResidentBytes() {
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp) {
+        return 0;
+    }
+    unsigned long size, resident;
+    const int n = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+    return n == 2 ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+size_t PeakResidentBytes() {
+    struct rusage ru;
+    return getrusage(RUSAGE_SELF, &ru) == 0 ? (size_t)ru.ru_maxrss * 1024 : 0;
+}
+
+// The file name of each image, or of the first member of a volume set, with
+// a suffix on any repeats
+std::vector<std::string> OutputNames(const std::vector<std::string> &images) {
+    std::vector<std::string> names;
+    std::set<std::string> seen;
+    for (auto &image : images) {
+        const auto first = image.substr(0, image.find(','));
+        auto slash = first.rfind('/');
+        const auto base = slash == std::string::npos ? first : first.substr(slash + 1);
+        auto name = base;
+        for (int i = 2; !seen.insert(name).second; i++) {
+            name = base + "-" + std::to_string(i);
+        }
+        names.push_back(name);
+    }
+    return names;
+}
+
+class Batch {
+  public:
+    explicit Batch(const BatchOptions &options)
+        : options_(options), budget_(std::make_shared<CacheBudget>(options.cache_bytes)),
+          pool_(options.threads) {}
+
+    int Run(const std::vector<std::string> &images, BatchResult *result);
+
+  private:
+    int RunImage(const std::string &image, const std::string &name);
+    std::shared_ptr<IoLimiter> LimiterFor(uint64_t device);
+    uint64_t BytesRead();
+
+    const BatchOptions &options_;
+    std::shared_ptr<CacheBudget> budget_;
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::map<uint64_t, std::shared_ptr<IoLimiter>> limiters_; // by device
+    size_t running_ = 0;
+    size_t failed_ = 0;
+    std::vector<size_t> finished_; // drivers waiting to be joined
+
+    // last, so the workers are gone before anything they use
+    ThreadPool pool_;
+};
+
+std::shared_ptr<IoLimiter> Batch::LimiterFor(uint64_t device) {
+    std::lock_guard guard(lock_);
+    auto &limiter = limiters_[device];
+    if (!limiter) {
+        limiter = std::make_shared<IoLimiter>(options_.device_queue_depth);
+    }
+    return limiter;
+}
+
+uint64_t Batch::BytesRead() {
+    uint64_t total = 0;
+    for (auto &[device, limiter] : limiters_) {
+        total += limiter->bytes();
+    }
+    return total;
+}
+
+int Batch::RunImage(const std::string &image, const std::string &name) {
+    Filesystem fs;
+    fs.SetPool(&pool_);
+    if (fs.Mount(image, options_.io_mode) < 0) {
+        fprintf(stderr, "error mounting '%s'\n", image.c_str());
+        return -1;
+    }
+    fs.SetIoLimiters([this](const Disk &disk) { return LimiterFor(disk.device_id()); });
+    if (options_.cache_bytes) {
+        fs.EnableReadCache(options_.cache_bytes, budget_);
+    }
+
+    const auto base = options_.outdir + "/" + name;
+    int err = 0;
+    switch (options_.job) {
+    case BatchJob::CATALOG:
+    case BatchJob::HASH: {
+        const auto path = base + (options_.job == BatchJob::CATALOG ? ".jsonl" : ".manifest");
+        FILE *out = fopen(path.c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "error creating '%s'\n", path.c_str());
+            return -1;
+        }
+        if (options_.job == BatchJob::CATALOG) {
+            err = ExportVolume(fs, out, ExportOptions());
+        } else {
+            ManifestOptions manifest_options;
+            manifest_options.quiet = true;
+            manifest_options.pool = &pool_;
+            err = WriteManifest(fs, out, manifest_options);
+        }
+        if (fclose(out) != 0) {
+            err = -1;
+        }
+        break;
+    }
+    case BatchJob::EXTRACT: {
+        ExtractOptions extract_options;
+        extract_options.quiet = true;
+        extract_options.pool = &pool_;
+        err = ExtractVolume(fs, base, extract_options);
+        break;
+    }
+    }
+
+    if (err < 0) {
+        fprintf(stderr, "error processing '%s'\n", image.c_str());
+    }
+    return err;
+}
+
+int Batch::Run(const std::vector<std::string> &images, BatchResult *result) {
+    const auto start = std::chrono::steady_clock::now();
+
+    if (mkdir(options_.outdir.c_str(), 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "error creating directory '%s'\n", options_.outdir.c_str());
+        return -1;
+    }
+
+    const auto names = OutputNames(images);
+    std::vector<std::thread> drivers(images.size());
+    size_t next = 0;
+    size_t done = 0;
+    bool shrunk = false;
+    bool over_ceiling = false;
+
+    auto last_progress = start;
+    uint64_t last_bytes = 0;
+
+    std::unique_lock guard(lock_);
+    while (done < images.size()) {
+        for (auto i : finished_) {
+            drivers[i].join();
+            done++;
+        }
+        finished_.clear();
+
+        // the shared cache is the one thing that can give memory back, so it
+        // is halved each time the resident set goes over the ceiling, and
+        // grows back once there is room again
+        const size_t rss = ResidentBytes();
+        if (options_.max_rss_bytes && rss > options_.max_rss_bytes && !over_ceiling) {
+            budget_->set_limit(budget_->limit() / 2);
+            over_ceiling = true;
+            if (!shrunk) {
+                fprintf(stderr, "batch: resident set %.1f MiB over the ceiling, shrinking the "
+                                "block cache\n", rss / mib);
+                shrunk = true;
+            }
+        } else if (over_ceiling && rss < options_.max_rss_bytes / 4 * 3) {
+            budget_->set_limit(std::min(budget_->limit() * 2, options_.cache_bytes));
+            over_ceiling = false;
+        }
+
+        // start another image if there is room for it, always keeping one going
+        const bool memory_room = !options_.max_rss_bytes || running_ == 0 ||
+                                 rss < options_.max_rss_bytes / 4 * 3;
+        if (next < images.size() && running_ < std::max<size_t>(options_.max_images, 1) &&
+            memory_room) {
+            const size_t i = next++;
+            running_++;
+            drivers[i] = std::thread([this, i, &images, &names]() {
+                const int err = RunImage(images[i], names[i]);
+                std::lock_guard driver_guard(lock_);
+                if (err < 0) {
+                    failed_++;
+                }
+                running_--;
+                finished_.push_back(i);
+                cv_.notify_all();
+            });
+            continue;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (options_.progress_interval &&
+            now - last_progress >= std::chrono::seconds(options_.progress_interval)) {
+            const uint64_t bytes = BytesRead();
+            const std::chrono::duration<double> interval = now - last_progress;
+            fprintf(stderr,
+                    "batch: %zu/%zu images done, %zu running, %.1f MiB read (%.1f MiB/s), "
+                    "cache %.1f MiB, rss %.1f MiB\n",
+                    done, images.size(), running_, bytes / mib,
+                    (bytes - last_bytes) / mib / interval.count(), budget_->used() / mib,
+                    rss / mib);
+            last_progress = now;
+            last_bytes = bytes;
+        }
+
+        // wake up for finished images, and regularly to watch memory
+        if (finished_.empty()) {
+            cv_.wait_for(guard, std::chrono::milliseconds(250));
+        }
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    const uint64_t bytes = BytesRead();
+    const size_t peak = PeakResidentBytes();
+    fprintf(stderr,
+            "batch: %zu images, %zu failed, %.1f MiB read in %.3f seconds (%.1f MiB/s), "
+            "peak rss %.1f MiB\n",
+            images.size(), failed_, bytes / mib, elapsed.count(), bytes / mib / elapsed.count(),
+            peak / mib);
+
+    if (result) {
+        *result = {images.size(), failed_, bytes, peak};
+    }
+    return failed_ ? -1 : 0;
+}
+
+} // namespace
+
+int RunBatch(const std::vector<std::string> &images, const BatchOptions &options,
+             BatchResult *result) {
+    Batch batch(options);
+    return batch.Run(images, result);
+}
+
+} // namespace ods2
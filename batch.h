@@ -0,0 +1,61 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "disk.h"
+
+namespace ods2 {
+
+enum class BatchJob {
+    CATALOG, // <outdir>/<image>.jsonl, as written by export
+    HASH,    // <outdir>/<image>.manifest, as written by manifest
+    EXTRACT, // <outdir>/<image>/, as written by extract
+};
+
+struct BatchOptions {
+    BatchJob job = BatchJob::HASH;
+    std::string outdir = ".";
+    Disk::IoMode io_mode = Disk::IoMode::AUTO;
+
+    // Worker threads shared by every image, 0 picks the hardware concurrency
+    size_t threads = 0;
+
+    // Most images mounted at once
+    size_t max_images = 4;
+
+    // Most reads in flight against any one device, across all of its images
+    size_t device_queue_depth = 8;
+
+    // Block cache memory shared by every mounted image, 0 for none
+    size_t cache_bytes = 64 * 1024 * 1024;
+
+    // No new image is started while the resident set is above 3/4 of this,
+    // and going over it shrinks the shared block cache. 0 for no ceiling.
+    size_t max_rss_bytes = 0;
+
+    // Seconds between progress lines on stderr, 0 for none
+    unsigned progress_interval = 5;
+};
+
+struct BatchResult {
+    uint64_t images = 0;
+    uint64_t failed = 0;
+    uint64_t bytes_read = 0;
+    size_t peak_rss = 0;
+};
+
+// Run one job over every image in a single process. Up to max_images are
+// mounted at a time, each walked from a thread of its own, while the per file
+// work of all of them shares one pool. Fails if any image did.
+int RunBatch(const std::vector<std::string> &images, const BatchOptions &options,
+             BatchResult *result = nullptr);
+
+} // namespace ods2
@@ -0,0 +1,353 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+//
+// Benchmark driver behind `make bench`. Generates a fixed set of synthetic
+// volumes and times the main operations against each of them, printing the
+// results as JSON on stdout so runs from different commits can be compared.
+// Timings are taken with a warm page cache, after the image has just been
+// written, which keeps them repeatable from run to run.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "aio.h"
+#include "export.h"
+#include "extract.h"
+#include "filesystem.h"
+#include "volgen.h"
+#include "walk.h"
+
+namespace {
+
+struct BenchConfig {
+    const char *name;
+    ods2::VolumeParams params;
+};
+
+struct BenchOptions {
+    std::string workdir = "bench-images";
+    std::string filter;
+    std::string commit;
+    double scale = 1.0;
+    int reps = 5;
+    size_t threads = 0;
+    size_t queue_depth = 32; // for the *_async variants
+};
+
+// What a single timed run did, for throughput numbers
+struct RunResult {
+    uint64_t items = 0;
+    uint64_t bytes = 0;
+};
+
+std::vector<BenchConfig> Configs(double scale) {
+    auto files = [scale](uint32_t n) { return std::max<uint32_t>(1, n * scale); };
+
+    std::vector<BenchConfig> configs;
+    {
+        ods2::VolumeParams p;
+        p.files = files(2000);
+        p.depth = 0;
+        configs.push_back({"flat", p});
+    }
+    {
+        ods2::VolumeParams p;
+        p.files = files(10000);
+        p.fanout = 8;
+        p.depth = 2;
+        p.max_blocks = 32;
+        configs.push_back({"tree", p});
+    }
+    {
+        ods2::VolumeParams p;
+        p.files = files(6000);
+        p.versions = 6;
+        configs.push_back({"versions", p});
+    }
+    {
+        ods2::VolumeParams p;
+        p.files = files(2000);
+        p.min_blocks = 16;
+        p.max_blocks = 256;
+        p.extents = 8;
+        p.cluster = 4;
+        configs.push_back({"fragmented", p});
+    }
+    {
+        ods2::VolumeParams p;
+        p.files = files(32);
+        p.min_blocks = 2048;
+        p.max_blocks = 16384;
+        p.extents = 2;
+        p.depth = 1;
+        configs.push_back({"large", p});
+    }
+    return configs;
+}
+
+void PrintParams(const ods2::VolumeParams &p) {
+    printf("{\"files\":%u,\"fanout\":%u,\"depth\":%u,\"versions\":%u,\"min_blocks\":%u,"
+           "\"max_blocks\":%u,\"extents\":%u,\"cluster\":%u,\"seed\":%llu}",
+           p.files, p.fanout, p.depth, p.versions, p.min_blocks, p.max_blocks, p.extents,
+           p.cluster, (unsigned long long)p.seed);
+}
+
+bool first_result = true;
+
+// Run an operation reps times and print a JSON record of the timings
+void Time(const BenchOptions &options, const BenchConfig &config, const char *op,
+          const std::function<RunResult()> &fn) {
+    std::vector<double> ms;
+    RunResult result;
+    for (int i = 0; i < options.reps; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        result = fn();
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        ms.push_back(elapsed.count());
+    }
+    std::sort(ms.begin(), ms.end());
+    const double median = ms[ms.size() / 2];
+    double mean = 0;
+    for (auto m : ms) {
+        mean += m;
+    }
+    mean /= ms.size();
+
+    printf("%s    {\"volume\":\"%s\",\"op\":\"%s\",\"reps\":%d,\"min_ms\":%.3f,\"median_ms\":%.3f,"
+           "\"mean_ms\":%.3f,\"max_ms\":%.3f,\"items\":%llu,\"bytes\":%llu,"
+           "\"items_per_sec\":%.1f,\"mib_per_sec\":%.1f}",
+           first_result ? "" : ",\n", config.name, op, options.reps, ms.front(), median, mean,
+           ms.back(), (unsigned long long)result.items, (unsigned long long)result.bytes,
+           median > 0 ? result.items * 1000.0 / median : 0,
+           median > 0 ? result.bytes / (1024.0 * 1024.0) * 1000.0 / median : 0);
+    first_result = false;
+    fflush(stdout);
+
+    fprintf(stderr, "  %-12s %-14s median %10.3f ms  (%llu items)\n", config.name, op, median,
+            (unsigned long long)result.items);
+}
+
+int RunConfig(const BenchOptions &options, const BenchConfig &config) {
+    const auto image = options.workdir + "/" + config.name + ".img";
+    fprintf(stderr, "generating %s\n", image.c_str());
+    if (ods2::GenerateVolume(image, config.params) < 0) {
+        return -1;
+    }
+
+    // mount once before timing anything, so an image that does not mount
+    // fails the run instead of timing how fast the mount gives up
+    ods2::Filesystem fs;
+    if (fs.Mount(image) < 0) {
+        fprintf(stderr, "error mounting %s\n", image.c_str());
+        return -1;
+    }
+
+    Time(options, config, "mount", [&]() {
+        ods2::Filesystem mfs;
+        return mfs.Mount(image) < 0 ? RunResult{0, 0} : RunResult{1, 0};
+    });
+
+    auto io = IoEngine::Create(fs.disk(), options.queue_depth);
+
+    std::vector<std::string> specs;
+    Time(options, config, "walk", [&]() {
+        specs.clear();
+        ods2::WalkVolume(fs, [&](const std::string &spec, const ods2::DirEntry &,
+                                 const std::shared_ptr<ods2::File> &) { specs.push_back(spec); });
+        return RunResult{specs.size(), 0};
+    });
+    Time(options, config, "walk_async", [&]() {
+        uint64_t files = 0;
+        ods2::WalkVolume(
+            fs,
+            [&](const std::string &, const ods2::DirEntry &, const std::shared_ptr<ods2::File> &) {
+                files++;
+            },
+            io.get());
+        return RunResult{files, 0};
+    });
+
+    // look up an evenly spread sample of the files found by the walk
+    std::vector<std::string> sample;
+    const size_t stride = std::max<size_t>(1, specs.size() / 1000);
+    for (size_t i = 0; i < specs.size(); i += stride) {
+        sample.push_back(specs[i]);
+    }
+    Time(options, config, "lookup", [&]() {
+        uint64_t found = 0;
+        for (auto &spec : sample) {
+            found += ods2::LookupSpec(fs, spec) != nullptr;
+        }
+        return RunResult{found, 0};
+    });
+
+    // read every file a block at a time, as a naive copy loop would
+    Time(options, config, "read_vbn", [&]() {
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        ods2::WalkVolume(fs, [&](const std::string &, const ods2::DirEntry &,
+                                 const std::shared_ptr<ods2::File> &f) {
+            if (f->is_dir()) {
+                return;
+            }
+            Disk::Block block;
+            for (uint32_t vbn = 1; vbn <= f->size_blocks(); vbn++) {
+                if (f->ReadVbn(vbn, &block) < 0) {
+                    return;
+                }
+                bytes += 512;
+            }
+            files++;
+        });
+        return RunResult{files, bytes};
+    });
+
+    Time(options, config, "export", [&]() {
+        FILE *null = fopen("/dev/null", "w");
+        if (!null) {
+            return RunResult{0, 0};
+        }
+        ods2::ExportResult result;
+        ods2::ExportVolume(fs, null, {}, &result);
+        fclose(null);
+        return RunResult{result.records, result.bytes};
+    });
+
+    Time(options, config, "index_scan", [&]() {
+        uint64_t headers = 0;
+        ods2::ScanIndexFile(fs, [&](const std::shared_ptr<ods2::File> &) { headers++; });
+        return RunResult{headers, 0};
+    });
+    Time(options, config, "index_scan_async", [&]() {
+        uint64_t headers = 0;
+        ods2::ScanIndexFile(
+            fs, [&](const std::shared_ptr<ods2::File> &) { headers++; }, io.get());
+        return RunResult{headers, 0};
+    });
+
+    const auto outdir = options.workdir + "/" + config.name + ".extract";
+    Time(options, config, "extract", [&]() {
+        std::error_code ec;
+        std::filesystem::remove_all(outdir, ec);
+        ods2::ExtractOptions extract_options;
+        extract_options.threads = options.threads;
+        extract_options.quiet = true;
+        ods2::ExtractResult result;
+        ods2::ExtractVolume(fs, outdir, extract_options, &result);
+        return RunResult{result.files, result.bytes};
+    });
+    Time(options, config, "extract_async", [&]() {
+        std::error_code ec;
+        std::filesystem::remove_all(outdir, ec);
+        ods2::ExtractOptions extract_options;
+        extract_options.queue_depth = options.queue_depth;
+        extract_options.quiet = true;
+        ods2::ExtractResult result;
+        ods2::ExtractVolume(fs, outdir, extract_options, &result);
+        return RunResult{result.files, result.bytes};
+    });
+    std::error_code ec;
+    std::filesystem::remove_all(outdir, ec);
+
+    // overwrite every file in place with its own contents, through a writable
+    // mount, so the image is unchanged apart from revision dates
+    Time(options, config, "rewrite", [&]() {
+        ods2::Filesystem wfs;
+        if (wfs.Mount(image, Disk::IoMode::AUTO, true) < 0) {
+            return RunResult{0, 0};
+        }
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        ods2::WalkVolume(wfs, [&](const std::string &, const ods2::DirEntry &,
+                                  const std::shared_ptr<ods2::File> &f) {
+            if (f->is_dir()) {
+                return;
+            }
+            uint64_t pos = 0;
+            f->ReadContents(2048, [&](const uint8_t *data, size_t len) {
+                f->Write(pos, data, len);
+                pos += len;
+            });
+            files++;
+            bytes += pos;
+        });
+        wfs.Flush();
+        return RunResult{files, bytes};
+    });
+
+    return 0;
+}
+
+void usage() {
+    fprintf(stderr, "usage: files11-bench [--workdir dir] [--scale x] [--reps n] [-j threads]\n");
+    fprintf(stderr, "                     [--qd depth] [--filter name] [--commit id]\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--workdir" && has_value) {
+            options.workdir = argv[++i];
+        } else if (arg == "--scale" && has_value) {
+            options.scale = strtod(argv[++i], nullptr);
+        } else if (arg == "--reps" && has_value) {
+            options.reps = std::max(1, atoi(argv[++i]));
+        } else if (arg == "-j" && has_value) {
+            options.threads = strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--qd" && has_value) {
+            options.queue_depth = strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--filter" && has_value) {
+            options.filter = argv[++i];
+        } else if (arg == "--commit" && has_value) {
+            options.commit = argv[++i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(options.workdir, ec);
+    if (ec) {
+        fprintf(stderr, "error creating '%s'\n", options.workdir.c_str());
+        return 1;
+    }
+
+    printf("{\n  \"commit\":\"%s\",\n  \"scale\":%g,\n  \"volumes\":{", options.commit.c_str(),
+           options.scale);
+    const auto configs = Configs(options.scale);
+    bool first = true;
+    for (auto &c : configs) {
+        if (options.filter.empty() || options.filter == c.name) {
+            printf("%s\n    \"%s\":", first ? "" : ",", c.name);
+            PrintParams(c.params);
+            first = false;
+        }
+    }
+    printf("\n  },\n  \"results\":[\n");
+
+    int err = 0;
+    for (auto &c : configs) {
+        if (options.filter.empty() || options.filter == c.name) {
+            err |= RunConfig(options, c);
+        }
+    }
+
+    printf("\n  ]\n}\n");
+
+    return err ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "blockcache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "stats.h"
+#include "utils.h"
+
+#define LOCAL_TRACE 0
+
+namespace {
+
+// Largest single write issued while flushing
+const size_t flush_chunk_blocks = 2048;
+
+} // namespace
+
+BlockCache::BlockCache(Disk &disk, size_t max_dirty_blocks)
+    : disk_(disk), max_dirty_blocks_(max_dirty_blocks) {}
+
+BlockCache::~BlockCache() {
+    if (!dirty_.empty()) {
+        fprintf(stderr, "warning: discarding %zu dirty blocks\n", dirty_.size());
+    }
+}
+
+int BlockCache::Write(uint64_t lbn, uint32_t count, const void *buf, Kind kind) {
+    LTRACEF("lbn %#llx count %u kind %d\n", (unsigned long long)lbn, count, (int)kind);
+
+    size_t dirty;
+    size_t held;
+    {
+        std::lock_guard guard(lock_);
+        held = held_blocks_;
+        if (held) {
+            size_t added = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                added += !dirty_.count(lbn + i);
+            }
+            if (dirty_.size() + added > held) {
+                fprintf(stderr, "more than %zu blocks of pending writes\n", held);
+                return -1;
+            }
+        }
+        const auto *ptr = (const uint8_t *)buf;
+        for (uint32_t i = 0; i < count; i++) {
+            auto &e = dirty_[lbn + i];
+            memcpy(e.block.buf.data(), ptr + (size_t)i * 512, 512);
+            e.kind = kind;
+        }
+        dirty = dirty_.size();
+        generation_.fetch_add(1, std::memory_order_release);
+    }
+
+    return !held && dirty >= max_dirty_blocks_ ? Flush() : 0;
+}
+
+void BlockCache::Overlay(uint64_t lbn, uint32_t count, void *buf) const {
+    std::lock_guard guard(lock_);
+    auto *ptr = (uint8_t *)buf;
+    for (auto it = dirty_.lower_bound(lbn); it != dirty_.end() && it->first < lbn + count; ++it) {
+        memcpy(ptr + (it->first - lbn) * 512, it->second.block.buf.data(), 512);
+    }
+}
+
+int BlockCache::Flush() {
+    std::lock_guard guard(lock_);
+    if (dirty_.empty()) {
+        return 0;
+    }
+
+    stats::Scope probe(stats::Op::CACHE_FLUSH, dirty_.size());
+    probe.set_bytes(dirty_.size() * 512);
+
+    for (auto kind : {Kind::DATA, Kind::HEADER, Kind::HOME}) {
+        if (FlushKind(kind) < 0 || disk_.sync() < 0) {
+            fprintf(stderr, "error flushing the block cache\n");
+            return -1;
+        }
+    }
+    dirty_.clear();
+
+    return 0;
+}
+
+int BlockCache::FlushKind(Kind kind) {
+    // dirty_ is in lbn order, so gather runs of consecutive blocks
+    std::vector<uint8_t> buf;
+    uint64_t run_lbn = 0;
+    uint32_t run_count = 0;
+    auto write_run = [&]() -> int {
+        if (run_count == 0) {
+            return 0;
+        }
+        LTRACEF("writing lbn %#llx count %u\n", (unsigned long long)run_lbn, run_count);
+        int err = disk_.write_blocks(run_lbn, run_count, buf.data());
+        run_count = 0;
+        buf.clear();
+        return err;
+    };
+
+    for (auto &[lbn, e] : dirty_) {
+        if (e.kind != kind) {
+            continue;
+        }
+        if (run_count > 0 && (run_lbn + run_count != lbn || run_count == flush_chunk_blocks)) {
+            if (write_run() < 0) {
+                return -1;
+            }
+        }
+        if (run_count == 0) {
+            run_lbn = lbn;
+        }
+        buf.insert(buf.end(), e.block.buf.begin(), e.block.buf.end());
+        run_count++;
+    }
+
+    return write_run();
+}
+
+void BlockCache::Discard() {
+    std::lock_guard guard(lock_);
+    LTRACEF("discarding %zu blocks\n", dirty_.size());
+    dirty_.clear();
+    generation_.fetch_add(1, std::memory_order_release);
+}
+
+void BlockCache::Hold(size_t max_blocks) {
+    std::lock_guard guard(lock_);
+    held_blocks_ = std::max(max_blocks, dirty_.size());
+}
+
+void BlockCache::Release() {
+    std::lock_guard guard(lock_);
+    held_blocks_ = 0;
+}
+
+size_t BlockCache::dirty_blocks() const {
+    std::lock_guard guard(lock_);
+    return dirty_.size();
+}
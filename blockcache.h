@@ -0,0 +1,78 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+#include "disk.h"
+
+// Write-back cache in front of a writable Disk. Writes land in memory and
+// reach the disk on Flush, sorted by lbn with runs of adjacent dirty blocks
+// merged into single large writes. Reads overlay the dirty blocks on top of
+// what they read from the disk, so they always see pending writes.
+//
+// Each dirty block has a kind, and Flush writes them out one kind at a time
+// with a sync in between: file data first, then file headers, and the home
+// blocks last. A crash mid flush leaves the old metadata pointing at already
+// written data, never new metadata pointing at data that is not there yet.
+class BlockCache {
+  public:
+    enum class Kind : uint8_t {
+        DATA,
+        HEADER,
+        HOME,
+    };
+
+    // Flush on its own once this many blocks are dirty
+    explicit BlockCache(Disk &disk, size_t max_dirty_blocks = 16384);
+    ~BlockCache();
+
+    int Write(uint64_t lbn, uint32_t count, const void *buf, Kind kind = Kind::DATA);
+
+    // Copy any dirty blocks in the range over buf, which holds what was read
+    // from the disk
+    void Overlay(uint64_t lbn, uint32_t count, void *buf) const;
+
+    int Flush();
+
+    // Drop every dirty block without writing it, after an update that failed
+    // part way. Whatever an earlier Flush wrote stays written.
+    void Discard();
+
+    // Keep every write in memory until Release instead of flushing once the
+    // cache fills up, so an update that fails part way can still be dropped
+    // as a whole. A write that would take it past max_blocks fails instead.
+    void Hold(size_t max_blocks);
+    void Release();
+
+    size_t dirty_blocks() const;
+
+    // Bumped on every write, so readers can tell whether something they
+    // buffered may have been overwritten since
+    uint64_t generation() const { return generation_.load(std::memory_order_acquire); }
+
+  private:
+    BlockCache(const BlockCache &) = delete;
+    BlockCache &operator=(const BlockCache &) = delete;
+
+    struct Entry {
+        Disk::Block block;
+        Kind kind;
+    };
+
+    int FlushKind(Kind kind);
+
+    Disk &disk_;
+    const size_t max_dirty_blocks_;
+    mutable std::mutex lock_;
+    std::map<uint64_t, Entry> dirty_;
+    size_t held_blocks_ = 0; // most blocks to hold while held, 0 when not
+    std::atomic<uint64_t> generation_ = 0;
+};
@@ -0,0 +1,216 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "catalog.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <numeric>
+#include <unordered_map>
+
+#include "filesystem.h"
+#include "walk.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+// Copy into exactly sized storage. shrink_to_fit is only a request, and the
+// libstdc++ vector turns it down when built with -fno-exceptions, as this tree
+// is, since it cannot recover from a failed reallocation.
+template <typename... T>
+void shrink(T &...containers) {
+    ((T(containers.begin(), containers.end()).swap(containers)), ...);
+}
+
+template <typename T>
+size_t column_bytes(const std::vector<T> &v) {
+    return v.capacity() * sizeof(T);
+}
+
+} // namespace
+
+Catalog::Catalog() = default;
+Catalog::~Catalog() = default;
+
+int Catalog::Build(const Filesystem &fs) {
+    std::vector<file_id> backlinks;
+    std::unordered_map<std::string, uint32_t> interned;
+
+    auto add = [&](const std::shared_ptr<File> &f) {
+        const auto &fh = f->header();
+        const auto &fi = f->ident();
+
+        // NAME.EXT;VERSION, interning the name part shared between versions
+        auto full = fi.name();
+        auto semi = full.find(';');
+        auto name = full.substr(0, semi);
+        uint16_t version = semi == std::string::npos ? 0 : atoi(full.c_str() + semi + 1);
+        name.resize(std::min<size_t>(name.size(), UINT8_MAX));
+        auto [it, inserted] = interned.emplace(name, names_.size());
+        if (inserted) {
+            names_ += name;
+        }
+
+        file_num_.push_back(f->id().file_num());
+        seq_.push_back(f->id().sequence_num);
+        rvn_.push_back(f->id().rv_num);
+        // a backlink without a relative volume number is on the same volume
+        file_id backlink = fh.backlink;
+        if (backlink.rv_num == 0) {
+            backlink.rv_num = f->id().rv_num;
+        }
+        backlinks.push_back(backlink);
+        name_off_.push_back(it->second);
+        name_len_.push_back(name.size());
+        version_.push_back(version);
+        efblk_.push_back(fh.file_rec_attributes.efblk());
+        ffbyte_.push_back(fh.file_rec_attributes.ffbyte);
+        hiblk_.push_back(fh.file_rec_attributes.hiblk());
+        credate_.push_back(fi.credate);
+        revdate_.push_back(fi.revdate);
+        filechar_.push_back(fh.filechar);
+        owner_.push_back(fh.fileowner);
+        prot_.push_back(fh.fileprot);
+        extent_first_.push_back(extent_pool_.size());
+        extent_count_.push_back(f->extents().size());
+        for (auto &e : f->extents()) {
+            extent_pool_.push_back({e.lbn, e.block_count});
+        }
+    };
+
+    // every member of a bound volume set has an index file of its own, and the
+    // file numbers in them overlap, so rows are keyed by (rvn, file number)
+    const size_t members = fs.volume_count();
+    for (size_t rvn = 1; rvn <= members; rvn++) {
+        const Filesystem *vol = members > 1 ? fs.volume(rvn) : &fs;
+        if (int err = ScanIndexFile(*vol, add); err < 0) {
+            return err;
+        }
+    }
+
+    // resolve the backlinks to rows in a second pass, once every volume is in
+    size_t max_rvn = 0;
+    for (auto r : rvn_) {
+        max_rvn = std::max<size_t>(max_rvn, r);
+    }
+    std::vector<uint32_t> max_num(max_rvn + 1, 0);
+    for (uint32_t row = 0; row < size(); row++) {
+        max_num[rvn_[row]] = std::max(max_num[rvn_[row]], file_num_[row]);
+    }
+    row_of_num_.resize(max_rvn + 1);
+    for (size_t r = 0; r <= max_rvn; r++) {
+        row_of_num_[r].assign(max_num[r] + 1, npos);
+    }
+    for (uint32_t row = 0; row < size(); row++) {
+        row_of_num_[rvn_[row]][file_num_[row]] = row;
+    }
+    parent_.resize(size());
+    for (uint32_t row = 0; row < size(); row++) {
+        parent_[row] = Find(backlinks[row].file_num(), backlinks[row].rv_num);
+    }
+
+    // the row count is only known once the scan is done, so drop the slack
+    // left by growing the columns, up to half of each of them
+    shrink(file_num_, seq_, rvn_, parent_, name_off_, name_len_, version_, efblk_, ffbyte_, hiblk_,
+           credate_, revdate_, filechar_, owner_, prot_, extent_first_, extent_count_, names_,
+           extent_pool_);
+
+    LTRACEF("%zu rows, %zu name bytes, %zu extents\n", size(), names_.size(),
+            extent_pool_.size());
+
+    return 0;
+}
+
+std::string Catalog::Spec(uint32_t row) const {
+    // collect the directory names from the bottom up
+    std::vector<std::string_view> dirs;
+    // stop at the MFD of whichever volume the chain ends on
+    for (uint32_t p = parent_[row];
+         p != npos && file_num_[p] != (uint32_t)reserved_files::MFD && dirs.size() < 64;
+         p = parent_[p]) {
+        auto n = name(p);
+        dirs.push_back(n.substr(0, n.find('.')));
+    }
+
+    std::string spec = "[";
+    if (dirs.empty()) {
+        spec += "000000";
+    }
+    for (auto it = dirs.rbegin(); it != dirs.rend(); it++) {
+        if (it != dirs.rbegin()) {
+            spec += '.';
+        }
+        spec += *it;
+    }
+    spec += ']';
+    spec += name(row);
+    spec += ';';
+    spec += std::to_string(version(row));
+    return spec;
+}
+
+size_t Catalog::memory_bytes() const {
+    return column_bytes(file_num_) + column_bytes(seq_) + column_bytes(rvn_) +
+           column_bytes(parent_) + column_bytes(name_off_) + column_bytes(name_len_) +
+           column_bytes(version_) + column_bytes(efblk_) + column_bytes(ffbyte_) +
+           column_bytes(hiblk_) + column_bytes(credate_) + column_bytes(revdate_) +
+           column_bytes(filechar_) + column_bytes(owner_) + column_bytes(prot_) +
+           column_bytes(extent_first_) + column_bytes(extent_count_) + names_.capacity() +
+           column_bytes(extent_pool_) +
+           std::accumulate(row_of_num_.begin(), row_of_num_.end(), size_t(0),
+                           [](size_t n, const auto &v) { return n + column_bytes(v); });
+}
+
+void PrintCatalogSummary(const Catalog &catalog, size_t top) {
+    const uint32_t rows = catalog.size();
+
+    // aggregate a few columns in single passes
+    uint64_t total_bytes = 0;
+    uint64_t alloc_blocks = 0;
+    uint32_t dirs = 0;
+    std::vector<uint64_t> dir_bytes(rows);
+    for (uint32_t row = 0; row < rows; row++) {
+        total_bytes += catalog.size_bytes(row);
+        alloc_blocks += catalog.alloc_blocks(row);
+        dirs += catalog.is_dir(row);
+        if (catalog.parent(row) != Catalog::npos) {
+            dir_bytes[catalog.parent(row)] += catalog.size_bytes(row);
+        }
+    }
+
+    printf("%u files (%u directories), %.1f MiB used, %.1f MiB allocated\n", rows, dirs,
+           total_bytes / (1024.0 * 1024.0), alloc_blocks / 2048.0);
+    printf("catalog memory %zu bytes, %.1f bytes per file\n", catalog.memory_bytes(),
+           rows ? (double)catalog.memory_bytes() / rows : 0.0);
+
+    std::vector<uint32_t> order(rows);
+    std::iota(order.begin(), order.end(), 0);
+
+    top = std::min<size_t>(top, rows);
+    std::partial_sort(order.begin(), order.begin() + top, order.end(),
+                      [&](uint32_t a, uint32_t b) {
+                          return catalog.size_bytes(a) > catalog.size_bytes(b);
+                      });
+    printf("largest files:\n");
+    for (size_t i = 0; i < top; i++) {
+        printf("\t%12llu %s\n", (unsigned long long)catalog.size_bytes(order[i]),
+               catalog.Spec(order[i]).c_str());
+    }
+
+    std::iota(order.begin(), order.end(), 0);
+    std::partial_sort(order.begin(), order.begin() + top, order.end(),
+                      [&](uint32_t a, uint32_t b) { return dir_bytes[a] > dir_bytes[b]; });
+    printf("largest directories:\n");
+    for (size_t i = 0; i < top && dir_bytes[order[i]] > 0; i++) {
+        printf("\t%12llu %s\n", (unsigned long long)dir_bytes[order[i]],
+               catalog.Spec(order[i]).c_str());
+    }
+}
+
+} // namespace ods2
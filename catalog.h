@@ -0,0 +1,115 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ods2.h"
+
+namespace ods2 {
+
+class Filesystem;
+
+// Compact, column oriented copy of the metadata of every file on a volume, or
+// on every member of a bound volume set.
+//
+// Each file is a row index into a set of parallel arrays, costing 60 bytes per
+// file plus its share of the interned name pool and the extent pool, so the
+// catalog of a million file volume fits in tens of megabytes. Scans over a
+// single column (sizes, dates, characteristics) touch only that column.
+class Catalog {
+  public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    // An extent in the shared pool, the vbn is implied by the extents before it
+    struct Extent {
+        uint32_t lbn;
+        uint32_t count;
+    };
+
+    Catalog();
+    ~Catalog();
+
+    // Populate from the headers in the index file of each volume in the set
+    int Build(const Filesystem &fs);
+
+    size_t size() const { return file_num_.size(); }
+
+    // Row of a file number on relative volume rvn, 0 on a volume of its own,
+    // or npos
+    uint32_t Find(uint32_t file_num, uint16_t rvn = 0) const {
+        if (rvn >= row_of_num_.size() || file_num >= row_of_num_[rvn].size()) {
+            return npos;
+        }
+        return row_of_num_[rvn][file_num];
+    }
+
+    // Full [DIR.SUBDIR]NAME.EXT;VERSION spec rebuilt from the parent rows
+    std::string Spec(uint32_t row) const;
+
+    // The columns
+    file_id fid(uint32_t row) const { return file_id(file_num_[row], seq_[row], rvn_[row]); }
+    uint32_t file_num(uint32_t row) const { return file_num_[row]; }
+    uint32_t parent(uint32_t row) const { return parent_[row]; }
+    std::string_view name(uint32_t row) const {
+        return std::string_view(names_).substr(name_off_[row], name_len_[row]);
+    }
+    uint16_t version(uint32_t row) const { return version_[row]; }
+    uint32_t efblk(uint32_t row) const { return efblk_[row]; }
+    uint16_t ffbyte(uint32_t row) const { return ffbyte_[row]; }
+    uint32_t alloc_blocks(uint32_t row) const { return hiblk_[row]; }
+    uint64_t size_bytes(uint32_t row) const {
+        return efblk_[row] ? (uint64_t)(efblk_[row] - 1) * 512 + ffbyte_[row] : 0;
+    }
+    uint64_t credate(uint32_t row) const { return credate_[row]; }
+    uint64_t revdate(uint32_t row) const { return revdate_[row]; }
+    uint32_t filechar(uint32_t row) const { return filechar_[row]; }
+    bool is_dir(uint32_t row) const { return filechar_[row] & file_char_directory; }
+    uint32_t owner(uint32_t row) const { return owner_[row]; }
+    uint16_t protection(uint32_t row) const { return prot_[row]; }
+    std::vector<Extent> extents(uint32_t row) const {
+        auto first = extent_pool_.begin() + extent_first_[row];
+        return std::vector<Extent>(first, first + extent_count_[row]);
+    }
+
+    // Bytes held by the columns and pools
+    size_t memory_bytes() const;
+
+  private:
+    Catalog(const Catalog &) = delete;
+    Catalog &operator=(const Catalog &) = delete;
+
+    std::vector<uint32_t> file_num_;
+    std::vector<uint16_t> seq_;
+    std::vector<uint8_t> rvn_;
+    std::vector<uint32_t> parent_; // row of the backlinked directory, or npos
+    std::vector<uint32_t> name_off_;
+    std::vector<uint8_t> name_len_;
+    std::vector<uint16_t> version_;
+    std::vector<uint32_t> efblk_;
+    std::vector<uint16_t> ffbyte_;
+    std::vector<uint32_t> hiblk_;
+    std::vector<uint64_t> credate_;
+    std::vector<uint64_t> revdate_;
+    std::vector<uint32_t> filechar_;
+    std::vector<uint32_t> owner_;
+    std::vector<uint16_t> prot_;
+    std::vector<uint32_t> extent_first_;
+    std::vector<uint16_t> extent_count_;
+
+    std::string names_;              // interned NAME.EXT strings, without versions
+    std::vector<Extent> extent_pool_;
+    std::vector<std::vector<uint32_t>> row_of_num_; // by rvn, then file number
+};
+
+// Print a summary of a volume from its catalog: totals, the largest files and
+// the directories holding the most data.
+void PrintCatalogSummary(const Catalog &catalog, size_t top);
+
+} // namespace ods2
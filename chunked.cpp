@@ -0,0 +1,588 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "chunked.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "hash.h"
+#include "lz.h"
+#include "stats.h"
+
+#define LOCAL_TRACE 0
+
+namespace {
+
+const char chunked_magic[8] = {'F', '1', '1', 'C', 'H', 'N', 'K', '1'};
+
+// Everything in the container is little endian, like the volume itself
+struct ChunkedHeader {
+    char magic[8];
+    uint32_t chunk_bytes;
+    uint32_t flags; // none defined yet
+    uint64_t image_bytes;
+    uint64_t index_offset;
+};
+static_assert(sizeof(ChunkedHeader) == 32);
+
+struct ChunkedIndexEntry {
+    uint64_t offset;
+    uint32_t stored;
+    uint8_t kind;
+    uint8_t reserved[3];
+    uint64_t hash;
+};
+static_assert(sizeof(ChunkedIndexEntry) == 24);
+
+const size_t max_chunk_bytes = 16 * 1024 * 1024;
+
+// How far ahead of a sequential reader chunks are decompressed, in jobs of at
+// least this much at a time
+const size_t prefetch_bytes = 1024 * 1024;
+const size_t prefetch_job_bytes = 64 * 1024;
+
+// Threads decompressing for an image that was not given a pool to share
+const size_t max_own_threads = 4;
+
+bool AllZero(const uint8_t *p, size_t len) {
+    return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+int WriteAll(int fd, const void *buf, size_t len, uint64_t offset) {
+    const auto *ptr = (const uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, ptr, len, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        ptr += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int ReadHeader(const ChunkedImage::RawRead &read, uint64_t file_bytes, ChunkedHeader *header,
+               uint64_t *count) {
+    if (file_bytes < sizeof(*header) || read(0, header, sizeof(*header)) < 0 ||
+        !ChunkedImage::IsChunked(header, sizeof(*header))) {
+        fprintf(stderr, "not a compressed image\n");
+        return -1;
+    }
+    if (header->chunk_bytes == 0 || header->chunk_bytes % 512 ||
+        header->chunk_bytes > max_chunk_bytes || header->flags != 0) {
+        fprintf(stderr, "unsupported compressed image, chunk size %u flags %#x\n",
+                header->chunk_bytes, header->flags);
+        return -1;
+    }
+
+    *count = (header->image_bytes + header->chunk_bytes - 1) / header->chunk_bytes;
+    if (header->index_offset < sizeof(*header) || header->index_offset > file_bytes ||
+        *count > (file_bytes - header->index_offset) / sizeof(ChunkedIndexEntry)) {
+        fprintf(stderr, "compressed image index is out of bounds\n");
+        return -1;
+    }
+    return 0;
+}
+
+bool ValidEntry(const ChunkedHeader &header, const ChunkedIndexEntry &e, size_t len) {
+    bool ok = e.offset >= sizeof(header) && e.offset <= header.index_offset &&
+              e.stored <= header.index_offset - e.offset;
+    switch (e.kind) {
+    case ChunkedImage::KIND_ZERO:
+        return ok && e.stored == 0;
+    case ChunkedImage::KIND_RAW:
+        return ok && e.stored == len;
+    case ChunkedImage::KIND_LZ:
+        return ok && e.stored <= LzBound(len);
+    default:
+        return false;
+    }
+}
+
+// Read a stored chunk back and check it
+int Decode(const ChunkedImage::RawRead &read, uint64_t chunk, const ChunkedIndexEntry &e,
+           uint8_t *data, size_t len) {
+    int err = 0;
+    if (e.kind == ChunkedImage::KIND_RAW) {
+        err = read(e.offset, data, len);
+    } else {
+        thread_local std::vector<uint8_t> stored;
+        stored.resize(e.stored);
+        err = read(e.offset, stored.data(), stored.size());
+        if (err == 0 && LzDecompress(stored.data(), stored.size(), data, len) < 0) {
+            fprintf(stderr, "corrupt compressed chunk %" PRIu64 "\n", chunk);
+            err = -1;
+        }
+    }
+    if (err == 0 && Hash64::Hash(data, len) != e.hash) {
+        fprintf(stderr, "checksum mismatch in chunk %" PRIu64 "\n", chunk);
+        err = -1;
+    }
+    return err;
+}
+
+} // namespace
+
+bool ChunkedImage::IsChunked(const void *head, size_t len) {
+    return len >= sizeof(chunked_magic) && memcmp(head, chunked_magic, sizeof(chunked_magic)) == 0;
+}
+
+ChunkedImage::~ChunkedImage() {
+    // jobs already running finish, the ones still queued see it closed
+    std::unique_lock guard(jobs_->lock);
+    jobs_->closed = true;
+    jobs_->idle_cv.wait(guard, [this]() { return jobs_->running == 0; });
+}
+
+int ChunkedImage::Open(RawRead read, uint64_t file_bytes, ThreadPool *pool, size_t cache_bytes) {
+    ChunkedHeader header;
+    uint64_t count;
+    if (ReadHeader(read, file_bytes, &header, &count) < 0) {
+        return -1;
+    }
+
+    std::vector<ChunkedIndexEntry> raw(count);
+    if (count && read(header.index_offset, raw.data(), count * sizeof(raw[0])) < 0) {
+        fprintf(stderr, "error reading compressed image index\n");
+        return -1;
+    }
+
+    read_ = std::move(read);
+    image_bytes_ = header.image_bytes;
+    chunk_bytes_ = header.chunk_bytes;
+    index_.resize(count);
+    for (uint64_t i = 0; i < count; i++) {
+        const auto &e = raw[i];
+        if (!ValidEntry(header, e, ChunkLength(i))) {
+            fprintf(stderr, "bad index entry for chunk %" PRIu64 "\n", i);
+            return -1;
+        }
+        index_[i] = {e.offset, e.stored, (Kind)e.kind, e.hash};
+    }
+
+    capacity_chunks_ = std::max<size_t>(cache_bytes / chunk_bytes_, 4);
+    if (!pool) {
+        own_pool_ = std::make_unique<ThreadPool>(
+            std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), max_own_threads));
+        pool = own_pool_.get();
+    }
+    pool_ = pool;
+
+    LTRACEF("%" PRIu64 " chunks of %zu bytes, image %" PRIu64 " bytes\n", count, chunk_bytes_,
+            image_bytes_);
+
+    return 0;
+}
+
+int ChunkedImage::ReadOnce(const RawRead &read, uint64_t file_bytes, uint64_t offset, void *buf,
+                           size_t len) {
+    ChunkedHeader header;
+    uint64_t count;
+    if (ReadHeader(read, file_bytes, &header, &count) < 0) {
+        return -1;
+    }
+    if (offset + len > header.image_bytes || offset + len < offset) {
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    const uint64_t chunk_bytes = header.chunk_bytes;
+    const uint64_t first = offset / chunk_bytes;
+    const uint64_t last = (offset + len - 1) / chunk_bytes;
+    std::vector<ChunkedIndexEntry> raw(last - first + 1);
+    if (read(header.index_offset + first * sizeof(raw[0]), raw.data(),
+             raw.size() * sizeof(raw[0])) < 0) {
+        fprintf(stderr, "error reading compressed image index\n");
+        return -1;
+    }
+
+    auto *ptr = (uint8_t *)buf;
+    std::vector<uint8_t> data;
+    for (uint64_t c = first; c <= last; c++) {
+        const auto &e = raw[c - first];
+        const size_t length = std::min<uint64_t>(chunk_bytes, header.image_bytes - c * chunk_bytes);
+        if (!ValidEntry(header, e, length)) {
+            fprintf(stderr, "bad index entry for chunk %" PRIu64 "\n", c);
+            return -1;
+        }
+        const uint64_t c_start = c * chunk_bytes;
+        const size_t skip = offset > c_start ? offset - c_start : 0;
+        const size_t n = std::min<uint64_t>(length - skip, offset + len - c_start - skip);
+        if (e.kind == KIND_ZERO) {
+            memset(ptr, 0, n);
+        } else {
+            data.resize(length);
+            if (Decode(read, c, e, data.data(), length) < 0) {
+                return -1;
+            }
+            memcpy(ptr, data.data() + skip, n);
+        }
+        ptr += n;
+    }
+    return 0;
+}
+
+size_t ChunkedImage::ChunkLength(uint64_t chunk) const {
+    return std::min<uint64_t>(chunk_bytes_, image_bytes_ - chunk * chunk_bytes_);
+}
+
+std::shared_ptr<ChunkedImage::Slot> ChunkedImage::Acquire(uint64_t chunk, bool *claimed) {
+    // with the lock held
+    auto it = map_.find(chunk);
+    if (it != map_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        *claimed = false;
+        return it->second->second;
+    }
+
+    auto slot = std::make_shared<Slot>();
+    lru_.emplace_front(chunk, slot);
+    map_[chunk] = lru_.begin();
+    *claimed = true;
+
+    // readers still holding an evicted chunk keep it alive until they are done
+    while (lru_.size() > capacity_chunks_) {
+        map_.erase(lru_.back().first);
+        lru_.pop_back();
+    }
+    return slot;
+}
+
+void ChunkedImage::TryLoad(uint64_t chunk, const std::shared_ptr<Slot> &slot) {
+    {
+        std::lock_guard guard(lock_);
+        if (slot->loading) {
+            return;
+        }
+        slot->loading = true;
+    }
+    Load(chunk, slot);
+}
+
+void ChunkedImage::Load(uint64_t chunk, const std::shared_ptr<Slot> &slot) {
+    const auto &e = index_[chunk];
+    const size_t len = ChunkLength(chunk);
+
+    stats::Scope probe(stats::Op::CHUNK_DECOMPRESS, chunk);
+    probe.set_bytes(len);
+
+    std::vector<uint8_t> data(len);
+    const ChunkedIndexEntry entry = {e.offset, e.stored, e.kind, {}, e.hash};
+    const int err = Decode(read_, chunk, entry, data.data(), len);
+
+    std::lock_guard guard(lock_);
+    slot->data = std::move(data);
+    slot->err = err;
+    slot->ready = true;
+    if (err < 0) {
+        // let the next reader try again
+        auto it = map_.find(chunk);
+        if (it != map_.end() && it->second->second == slot) {
+            lru_.erase(it->second);
+            map_.erase(it);
+        }
+    }
+    ready_cv_.notify_all();
+}
+
+void ChunkedImage::Submit(std::function<void()> job) {
+    pool_->Submit([jobs = jobs_, job = std::move(job)]() {
+        {
+            std::lock_guard guard(jobs->lock);
+            if (jobs->closed) {
+                return;
+            }
+            jobs->running++;
+        }
+        job();
+        std::lock_guard guard(jobs->lock);
+        if (--jobs->running == 0) {
+            jobs->idle_cv.notify_all();
+        }
+    });
+}
+
+int ChunkedImage::Wait(const std::shared_ptr<Slot> &slot) {
+    std::unique_lock guard(lock_);
+    ready_cv_.wait(guard, [&slot]() { return slot->ready; });
+    return slot->err;
+}
+
+void ChunkedImage::Prefetch(uint64_t first, uint64_t last) {
+    // with the lock held
+    const bool continues = stream_last_ != UINT64_MAX &&
+                           (first == stream_last_ || first == stream_last_ + 1);
+    stream_length_ = continues ? stream_length_ + 1 : 0;
+    stream_last_ = last;
+    if (!continues) {
+        prefetched_ = 0;
+    }
+    if (stream_length_ < 2) {
+        return;
+    }
+
+    const uint64_t window = std::min(prefetch_bytes / chunk_bytes_, capacity_chunks_ / 4);
+    const uint64_t end = std::min<uint64_t>(last + 1 + window, index_.size());
+    const size_t per_job = std::max<size_t>(prefetch_job_bytes / chunk_bytes_, 1);
+    std::vector<std::pair<uint64_t, std::shared_ptr<Slot>>> job;
+    auto submit = [&]() {
+        if (!job.empty()) {
+            stats::Add(stats::Count::CHUNK_PREFETCH, job.size());
+            Submit([this, job = std::move(job)]() {
+                for (auto &[c, slot] : job) {
+                    TryLoad(c, slot);
+                }
+            });
+            job.clear();
+        }
+    };
+    for (uint64_t c = std::max(last + 1, prefetched_); c < end; c++) {
+        if (index_[c].kind == KIND_ZERO || map_.count(c)) {
+            continue;
+        }
+        bool claimed;
+        job.emplace_back(c, Acquire(c, &claimed));
+        if (job.size() == per_job) {
+            submit();
+        }
+    }
+    submit();
+    prefetched_ = std::max(prefetched_, end);
+}
+
+int ChunkedImage::Read(uint64_t offset, void *buf, size_t len) {
+    if (offset + len > image_bytes_ || offset + len < offset) {
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    const uint64_t first = offset / chunk_bytes_;
+    const uint64_t last = (offset + len - 1) / chunk_bytes_;
+
+    // find or claim every chunk up front, so the ones missing can all be
+    // decompressed at once
+    std::vector<std::shared_ptr<Slot>> slots(last - first + 1);
+    std::vector<uint64_t> claimed_chunks;
+    {
+        std::lock_guard guard(lock_);
+        for (uint64_t c = first; c <= last; c++) {
+            if (index_[c].kind == KIND_ZERO) {
+                continue;
+            }
+            bool claimed;
+            slots[c - first] = Acquire(c, &claimed);
+            if (claimed) {
+                claimed_chunks.push_back(c);
+            }
+        }
+        Prefetch(first, last);
+    }
+    stats::Add(stats::Count::CHUNK_CACHE_MISS, claimed_chunks.size());
+    const size_t stored = std::count_if(slots.begin(), slots.end(), [](auto &s) { return s; });
+    stats::Add(stats::Count::CHUNK_CACHE_HIT, stored - claimed_chunks.size());
+
+    // hand all but one of the misses to the pool, then load here whatever
+    // the pool has not got to yet, starting with that one
+    for (size_t i = 1; i < claimed_chunks.size(); i++) {
+        const uint64_t c = claimed_chunks[i];
+        auto slot = slots[c - first];
+        Submit([this, c, slot]() { TryLoad(c, slot); });
+    }
+
+    auto *ptr = (uint8_t *)buf;
+    int err = 0;
+    for (uint64_t c = first; c <= last; c++) {
+        const uint64_t c_start = c * chunk_bytes_;
+        const size_t skip = offset > c_start ? offset - c_start : 0;
+        const size_t n = std::min<uint64_t>(ChunkLength(c) - skip, offset + len - c_start - skip);
+        auto &slot = slots[c - first];
+        if (slot) {
+            TryLoad(c, slot);
+        }
+        if (!slot) {
+            memset(ptr, 0, n);
+        } else if (Wait(slot) < 0) {
+            err = -1;
+        } else {
+            memcpy(ptr, slot->data.data() + skip, n);
+        }
+        ptr += n;
+    }
+    return err;
+}
+
+int CompressImage(const Disk &disk, const std::string &path, const CompressOptions &options,
+                  CompressResult *result) {
+    const size_t chunk_bytes = options.chunk_bytes;
+    if (chunk_bytes == 0 || chunk_bytes % 512 || chunk_bytes > max_chunk_bytes) {
+        fprintf(stderr, "chunk size must be a multiple of 512 up to %zu\n", max_chunk_bytes);
+        return -1;
+    }
+
+    *result = {};
+    result->image_bytes = disk.size();
+    const uint64_t count = (disk.size() + chunk_bytes - 1) / chunk_bytes;
+    result->chunks = count;
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "error creating '%s'\n", path.c_str());
+        return -1;
+    }
+
+    ThreadPool pool(options.threads);
+    const size_t batch = pool.size() * 4;
+
+    struct Work {
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> packed;
+        ChunkedIndexEntry entry;
+        int err;
+    };
+    std::vector<Work> work(batch);
+    std::vector<ChunkedIndexEntry> index(count);
+
+    // compress a batch at a time, writing each out in order once it is done
+    uint64_t pos = sizeof(ChunkedHeader);
+    int err = 0;
+    for (uint64_t base = 0; base < count && err == 0; base += batch) {
+        const size_t n = std::min<uint64_t>(batch, count - base);
+        TaskGroup group(pool);
+        for (size_t i = 0; i < n; i++) {
+            group.Submit([&, i]() {
+                auto &w = work[i];
+                const uint64_t offset = (base + i) * chunk_bytes;
+                const size_t len = std::min<uint64_t>(chunk_bytes, disk.size() - offset);
+                w.entry = {};
+                w.entry.kind = ChunkedImage::KIND_ZERO;
+                w.err = 0;
+                if (disk.is_zero(offset, len)) {
+                    return;
+                }
+                w.data.resize(len);
+                w.err = disk.read(offset, w.data.data(), len);
+                if (w.err < 0 || AllZero(w.data.data(), len)) {
+                    return;
+                }
+                w.entry.hash = Hash64::Hash(w.data.data(), len);
+
+                // keep the chunk as it is if compressing does not save anything
+                w.packed.resize(LzBound(len));
+                const size_t packed = LzCompress(w.data.data(), len, w.packed.data(), len - 1);
+                if (packed == 0) {
+                    w.entry.kind = ChunkedImage::KIND_RAW;
+                    w.entry.stored = len;
+                } else {
+                    w.entry.kind = ChunkedImage::KIND_LZ;
+                    w.entry.stored = packed;
+                }
+            });
+        }
+        group.Wait();
+
+        for (size_t i = 0; i < n && err == 0; i++) {
+            auto &w = work[i];
+            if (w.err < 0) {
+                fprintf(stderr, "error reading chunk %" PRIu64 "\n", base + i);
+                err = -1;
+                break;
+            }
+            w.entry.offset = pos;
+            if (w.entry.kind != ChunkedImage::KIND_ZERO) {
+                const auto &src = w.entry.kind == ChunkedImage::KIND_RAW ? w.data : w.packed;
+                err = WriteAll(fd, src.data(), w.entry.stored, pos);
+                pos += w.entry.stored;
+            }
+            result->zero_chunks += w.entry.kind == ChunkedImage::KIND_ZERO;
+            result->raw_chunks += w.entry.kind == ChunkedImage::KIND_RAW;
+            index[base + i] = w.entry;
+        }
+    }
+
+    ChunkedHeader header{};
+    memcpy(header.magic, chunked_magic, sizeof(header.magic));
+    header.chunk_bytes = chunk_bytes;
+    header.image_bytes = disk.size();
+    header.index_offset = pos;
+    if (err == 0) {
+        err = WriteAll(fd, index.data(), index.size() * sizeof(index[0]), pos);
+    }
+    if (err == 0) {
+        err = WriteAll(fd, &header, sizeof(header), 0);
+    }
+    if (err == 0 && fsync(fd) < 0) {
+        err = -1;
+    }
+    close(fd);
+    if (err < 0) {
+        fprintf(stderr, "error writing '%s'\n", path.c_str());
+        return -1;
+    }
+
+    result->stored_bytes = pos + index.size() * sizeof(index[0]);
+    return 0;
+}
+
+int ExpandImage(const Disk &disk, const std::string &path, size_t threads) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, disk.size()) < 0) {
+        fprintf(stderr, "error creating '%s'\n", path.c_str());
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    // each piece covers several chunks of a compressed image, which the disk
+    // decompresses in parallel on its own
+    const uint64_t piece = 1024 * 1024;
+    ThreadPool pool(threads);
+    std::atomic<int> err = 0;
+    for (uint64_t offset = 0; offset < disk.size(); offset += piece) {
+        const size_t len = std::min<uint64_t>(piece, disk.size() - offset);
+        if (disk.is_zero(offset, len)) {
+            continue;
+        }
+        pool.Submit([&, offset, len]() {
+            std::vector<uint8_t> buf(len);
+            if (disk.read(offset, buf.data(), len) < 0 ||
+                WriteAll(fd, buf.data(), len, offset) < 0) {
+                err = -1;
+            }
+        });
+    }
+    pool.Wait();
+    close(fd);
+    if (err < 0) {
+        fprintf(stderr, "error writing '%s'\n", path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+void PrintCompressResult(FILE *out, const CompressResult &r) {
+    auto mib = [](uint64_t bytes) { return bytes / (1024.0 * 1024.0); };
+    const double percent = r.image_bytes ? r.stored_bytes * 100.0 / r.image_bytes : 0;
+
+    fprintf(out, "image              %12llu bytes %10.1f MiB\n",
+            (unsigned long long)r.image_bytes, mib(r.image_bytes));
+    fprintf(out, "compressed         %12llu bytes %10.1f MiB %5.1f%%\n",
+            (unsigned long long)r.stored_bytes, mib(r.stored_bytes), percent);
+    fprintf(out, "chunks             %12llu, %llu zero, %llu stored as they are\n",
+            (unsigned long long)r.chunks, (unsigned long long)r.zero_chunks,
+            (unsigned long long)r.raw_chunks);
+}
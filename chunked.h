@@ -0,0 +1,166 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "threadpool.h"
+#include "utils.h"
+
+class Disk;
+
+// Compressed disk images that can still be read at random. The image is cut
+// into fixed size chunks that are each compressed on their own, and an index
+// at the end of the container gives where every chunk is stored.
+//
+//   header   magic "F11CHNK1", chunk size, image size, offset of the index
+//   chunks   in order, all zero chunks taking no space at all
+//   index    one entry per chunk: offset, stored size, kind, xxh64 of the data
+//
+// Reading decompresses only the chunks a read covers, several at once when it
+// covers more than one, and keeps the most recent of them in memory. Once the
+// reads look sequential the chunks after them are decompressed ahead of time
+// on a pool, shared with the rest of the program when one is passed in.
+class ChunkedImage {
+  public:
+    // Small enough that a random read of a few blocks does not decompress
+    // much more than it needs, at a cost of a point or two of compression
+    static constexpr size_t default_chunk_bytes = 16 * 1024;
+
+    // How each chunk is stored
+    enum Kind : uint8_t {
+        KIND_ZERO, // not at all
+        KIND_RAW,  // as it is, when compressing did not make it any smaller
+        KIND_LZ,
+    };
+
+    // Reads from the underlying container file
+    using RawRead = std::function<int(uint64_t offset, void *buf, size_t len)>;
+
+    ChunkedImage() = default;
+    ~ChunkedImage();
+
+    // Whether the start of a file looks like a container
+    static bool IsChunked(const void *head, size_t len);
+
+    // Decompresses on the given pool, or on a small one of its own when there
+    // is none. A shared pool must be kept until the last read.
+    int Open(RawRead read, uint64_t file_bytes, ThreadPool *pool = nullptr,
+             size_t cache_bytes = 64 * 1024 * 1024);
+
+    // Read from a container without opening it, decompressing only the chunks
+    // covered and keeping nothing around
+    static int ReadOnce(const RawRead &read, uint64_t file_bytes, uint64_t offset, void *buf,
+                        size_t len);
+
+    // Thread safe
+    int Read(uint64_t offset, void *buf, size_t len);
+
+    uint64_t image_bytes() const { return image_bytes_; }
+    size_t chunk_bytes() const { return chunk_bytes_; }
+    uint64_t chunk_count() const { return index_.size(); }
+    bool is_zero_chunk(uint64_t chunk) const { return index_[chunk].kind == KIND_ZERO; }
+
+  private:
+    DISALLOW_COPY_ASSIGN_AND_MOVE(ChunkedImage);
+
+    struct IndexEntry {
+        uint64_t offset;
+        uint32_t stored;
+        Kind kind;
+        uint64_t hash;
+    };
+
+    // A decompressed chunk, filled in by whichever thread gets to it first
+    struct Slot {
+        std::vector<uint8_t> data;
+        bool loading = false;
+        bool ready = false;
+        int err = 0;
+    };
+
+    // Jobs queued on the pool, which may still be sitting there after the
+    // image is gone when the pool is shared
+    struct Jobs {
+        std::mutex lock;
+        std::condition_variable idle_cv;
+        size_t running = 0;
+        bool closed = false;
+    };
+
+    // Look up a chunk, creating an empty slot that must then be loaded if
+    // there was none
+    std::shared_ptr<Slot> Acquire(uint64_t chunk, bool *claimed);
+
+    // Load a slot unless another thread already started on it. Readers load
+    // every slot they need that is still only queued before waiting on it, so
+    // they never wait on jobs stuck behind others on a busy pool.
+    void TryLoad(uint64_t chunk, const std::shared_ptr<Slot> &slot);
+    void Load(uint64_t chunk, const std::shared_ptr<Slot> &slot);
+    int Wait(const std::shared_ptr<Slot> &slot);
+
+    // Queue a job on the pool that is dropped if the image closes first
+    void Submit(std::function<void()> job);
+
+    // Queue up the chunks following a read that continues the previous one
+    void Prefetch(uint64_t first, uint64_t last);
+
+    size_t ChunkLength(uint64_t chunk) const;
+
+    RawRead read_;
+    uint64_t image_bytes_ = 0;
+    size_t chunk_bytes_ = 0;
+    std::vector<IndexEntry> index_;
+
+    std::mutex lock_;
+    std::condition_variable ready_cv_;
+    std::list<std::pair<uint64_t, std::shared_ptr<Slot>>> lru_; // most recently used first
+    std::unordered_map<uint64_t, decltype(lru_)::iterator> map_;
+    size_t capacity_chunks_ = 0;
+    uint64_t stream_last_ = UINT64_MAX; // last chunk of the previous read
+    size_t stream_length_ = 0;          // reads in a row that continued the one before
+    uint64_t prefetched_ = 0;           // chunk after the last one queued ahead
+
+    std::unique_ptr<ThreadPool> own_pool_;
+    ThreadPool *pool_ = nullptr;
+    std::shared_ptr<Jobs> jobs_ = std::make_shared<Jobs>();
+};
+
+struct CompressOptions {
+    // Worker threads, 0 picks the hardware concurrency
+    size_t threads = 0;
+
+    // A multiple of 512
+    size_t chunk_bytes = ChunkedImage::default_chunk_bytes;
+};
+
+struct CompressResult {
+    uint64_t image_bytes = 0;
+    uint64_t stored_bytes = 0; // the whole container, header and index included
+    uint64_t chunks = 0;
+    uint64_t zero_chunks = 0;
+    uint64_t raw_chunks = 0; // did not get any smaller
+};
+
+// Write a container holding everything in a disk, compressing batches of
+// chunks in parallel
+int CompressImage(const Disk &disk, const std::string &path, const CompressOptions &options,
+                  CompressResult *result);
+
+// Write a disk out in full, leaving holes wherever it is known to be zero
+int ExpandImage(const Disk &disk, const std::string &path, size_t threads);
+
+void PrintCompressResult(FILE *out, const CompressResult &result);
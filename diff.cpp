@@ -0,0 +1,231 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "diff.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+#include "filesystem.h"
+#include "hash.h"
+#include "threadpool.h"
+#include "walk.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+// Size of each read while hashing file contents
+const uint32_t hash_chunk_blocks = 2048;
+
+struct DiffFile {
+    std::string spec;
+    file_id fid;
+    std::shared_ptr<File> file;
+};
+
+struct DiffPair {
+    const DiffFile *a;
+    const DiffFile *b;
+
+    enum class State {
+        IDENTICAL,
+        CANDIDATE,
+        MODIFIED,
+        METADATA,
+        ERROR,
+    } state;
+};
+
+// File ids by volume, number and sequence, as file numbers are only unique
+// within a member of a volume set
+uint64_t FidKey(const file_id &id) {
+    return (uint64_t)id.rv_num << 48 | (uint64_t)id.file_num() << 16 | id.sequence_num;
+}
+
+std::vector<DiffFile> CollectFiles(const Filesystem &fs) {
+    std::vector<DiffFile> files;
+    WalkVolume(fs, [&](const std::string &spec, const DirEntry &, const std::shared_ptr<File> &f) {
+        // the opened file carries the volume the entry resolved to
+        files.push_back({spec, f->id(), f});
+    });
+    return files;
+}
+
+bool SameMetadata(const File &a, const File &b) {
+    return a.size_bytes() == b.size_bytes() && a.ident().revdate == b.ident().revdate &&
+           a.header().filechar == b.header().filechar && a.extents() == b.extents();
+}
+
+int HashFile(const File &f, uint64_t *hash, std::atomic<uint64_t> &bytes_read) {
+    Hash64 h;
+    int err = f.ReadContents(hash_chunk_blocks, [&](const uint8_t *data, size_t len) {
+        h.Update(data, len);
+        bytes_read += len;
+    });
+    if (err < 0) {
+        return err;
+    }
+
+    *hash = h.Final();
+    return 0;
+}
+
+} // namespace
+
+int DiffVolumes(const Filesystem &a, const Filesystem &b, const DiffOptions &options) {
+    const auto start = std::chrono::steady_clock::now();
+
+    const auto files_a = CollectFiles(a);
+    const auto files_b = CollectFiles(b);
+
+    std::unordered_map<std::string, size_t> b_by_spec;
+    // a file entered in more than one directory shows up under each of them,
+    // all with the same file id, so keep every one of them
+    std::unordered_map<uint64_t, std::vector<size_t>> b_by_fid;
+    for (size_t i = 0; i < files_b.size(); i++) {
+        b_by_spec.emplace(files_b[i].spec, i);
+        b_by_fid[FidKey(files_b[i].fid)].push_back(i);
+    }
+
+    // pair up by path, then what is left by file id
+    std::vector<bool> b_matched(files_b.size());
+    std::vector<DiffPair> pairs;
+    std::vector<const DiffFile *> deleted;
+    std::vector<const DiffFile *> unmatched_a;
+    for (auto &fa : files_a) {
+        auto it = b_by_spec.find(fa.spec);
+        if (it != b_by_spec.end()) {
+            b_matched[it->second] = true;
+            pairs.push_back({&fa, &files_b[it->second], DiffPair::State::CANDIDATE});
+        } else {
+            unmatched_a.push_back(&fa);
+        }
+    }
+    for (auto *fa : unmatched_a) {
+        // pair with the first entry of the file that is not yet taken
+        auto it = b_by_fid.find(FidKey(fa->fid));
+        size_t match = files_b.size();
+        if (it != b_by_fid.end()) {
+            for (auto i : it->second) {
+                if (!b_matched[i]) {
+                    match = i;
+                    break;
+                }
+            }
+        }
+        if (match < files_b.size()) {
+            b_matched[match] = true;
+            pairs.push_back({fa, &files_b[match], DiffPair::State::CANDIDATE});
+        } else {
+            deleted.push_back(fa);
+        }
+    }
+
+    // cheap checks against the headers, leaving only the real candidates
+    std::vector<DiffPair *> candidates;
+    for (auto &p : pairs) {
+        const auto &fa = *p.a->file;
+        const auto &fb = *p.b->file;
+        if (fa.is_dir() != fb.is_dir()) {
+            // a directory on one side and a file on the other
+            p.state = DiffPair::State::MODIFIED;
+        } else if (fa.is_dir()) {
+            // directory contents are compared through the entries themselves
+            p.state = fa.header().filechar == fb.header().filechar ? DiffPair::State::IDENTICAL
+                                                                   : DiffPair::State::METADATA;
+        } else if (fa.size_bytes() != fb.size_bytes()) {
+            p.state = DiffPair::State::MODIFIED;
+        } else if (SameMetadata(fa, fb)) {
+            p.state = DiffPair::State::IDENTICAL;
+        } else {
+            candidates.push_back(&p);
+        }
+    }
+
+    LTRACEF("%zu pairs, %zu candidates\n", pairs.size(), candidates.size());
+
+    // hash the candidates, largest first so a big file does not start last
+    std::sort(candidates.begin(), candidates.end(), [](const DiffPair *x, const DiffPair *y) {
+        return x->a->file->size_bytes() > y->a->file->size_bytes();
+    });
+    std::atomic<uint64_t> bytes_read = 0;
+    {
+        ThreadPool pool(options.threads);
+        for (auto *p : candidates) {
+            pool.Submit([p, &bytes_read]() {
+                uint64_t ha, hb;
+                if (HashFile(*p->a->file, &ha, bytes_read) < 0 ||
+                    HashFile(*p->b->file, &hb, bytes_read) < 0) {
+                    p->state = DiffPair::State::ERROR;
+                    return;
+                }
+                p->state = ha == hb ? DiffPair::State::METADATA : DiffPair::State::MODIFIED;
+            });
+        }
+        pool.Wait();
+    }
+
+    // build the report, sorted by path
+    std::vector<std::pair<std::string, std::string>> report;
+    size_t changed = 0;
+    for (auto &p : pairs) {
+        const bool renamed = p.a->spec != p.b->spec;
+        std::string code;
+        switch (p.state) {
+        case DiffPair::State::IDENTICAL:
+        case DiffPair::State::CANDIDATE:
+            code = renamed ? "R" : (options.verbose ? "=" : "");
+            break;
+        case DiffPair::State::METADATA:
+            code = renamed ? "R" : "m";
+            break;
+        case DiffPair::State::MODIFIED:
+            code = renamed ? "RM" : "M";
+            break;
+        case DiffPair::State::ERROR:
+            code = "?";
+            break;
+        }
+        if (code.empty()) {
+            continue;
+        }
+        if (code != "=") {
+            changed++;
+        }
+        report.emplace_back(p.a->spec, code + " " + p.a->spec +
+                                           (renamed ? " -> " + p.b->spec : std::string()));
+    }
+    for (auto *fa : deleted) {
+        report.emplace_back(fa->spec, "D " + fa->spec);
+    }
+    size_t added = 0;
+    for (size_t i = 0; i < files_b.size(); i++) {
+        if (!b_matched[i]) {
+            report.emplace_back(files_b[i].spec, "A " + files_b[i].spec);
+            added++;
+        }
+    }
+    std::sort(report.begin(), report.end());
+    for (auto &r : report) {
+        printf("%s\n", r.second.c_str());
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fprintf(stderr,
+            "%zu files in a, %zu in b: %zu paired, %zu hashed (%.1f MiB read), %zu deleted, "
+            "%zu added, %zu changed in %.3f seconds\n",
+            files_a.size(), files_b.size(), pairs.size(), candidates.size(),
+            bytes_read / (1024.0 * 1024.0), deleted.size(), added, changed, elapsed.count());
+
+    return 0;
+}
+
+} // namespace ods2
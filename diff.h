@@ -0,0 +1,34 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstddef>
+
+namespace ods2 {
+
+class Filesystem;
+
+struct DiffOptions {
+    size_t threads = 0;   // hashing threads, 0 picks the hardware concurrency
+    bool verbose = false; // also list the files that are unchanged
+};
+
+// Compare two mounted volumes, typically dated snapshots of the same volume,
+// and print one line per difference:
+//   A spec            added in b
+//   D spec            deleted from a
+//   M spec            contents changed, or a file became a directory or back
+//   m spec            header changed, contents identical
+//   R spec -> spec    renamed, same file id (RM if the contents changed too)
+//
+// Files are paired by path first and then by file id and sequence number.
+// Pairs whose size, revision date, file characteristics and extent map all
+// match are assumed to be identical without reading them; the rest are
+// hashed in parallel. Directories are only compared by their characteristics,
+// their contents showing up as the entries that differ.
+int DiffVolumes(const Filesystem &a, const Filesystem &b, const DiffOptions &options);
+
+} // namespace ods2
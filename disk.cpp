@@ -5,31 +5,566 @@
 // https://opensource.org/licenses/MIT
 #include "disk.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#else
+#include <sys/disk.h>
+#endif
+
+#include "chunked.h"
+#include "iolimit.h"
+#include "readcache.h"
+#include "stats.h"
+#include "utils.h"
+
+#define LOCAL_TRACE 0
+
+namespace {
+
+// Largest single read issued when going through the bounce buffer
+const size_t direct_chunk_size = 1024 * 1024;
+
+struct FreeDeleter {
+    void operator()(void *p) const { free(p); }
+};
+
+// Aligned bounce buffer for O_DIRECT reads into unaligned memory, one per
+// thread so concurrent readers do not need to lock.
+uint8_t *BounceBuffer(size_t alignment) {
+    thread_local std::unique_ptr<uint8_t, FreeDeleter> buffer;
+    thread_local size_t buffer_alignment;
+    if (!buffer || buffer_alignment < alignment) {
+        void *p;
+        if (posix_memalign(&p, std::max<size_t>(alignment, 4096), direct_chunk_size) != 0) {
+            return nullptr;
+        }
+        buffer.reset((uint8_t *)p);
+        buffer_alignment = alignment;
+    }
+    return buffer.get();
+}
+
+} // namespace
 
 Disk::Disk() = default;
 
 Disk::~Disk() {
-    if (fp) {
-        fclose(fp);
+    // finish any decompression still going on in the background first
+    chunked_.reset();
+    if (fd >= 0) {
+        close(fd);
     }
 }
 
-int Disk::open(const std::string &str) {
-    fp = fopen(str.c_str(), "rb");
-    if (!fp) {
+int Disk::open(const std::string &str, IoMode mode, bool writable) {
+    struct stat st;
+    if (stat(str.c_str(), &st) < 0) {
+        fprintf(stderr, "error opening file\n");
+        return -1;
+    }
+    is_device_ = S_ISBLK(st.st_mode);
+    device_id_ = is_device_ ? st.st_rdev : st.st_dev;
+
+#ifdef __linux__
+    bool want_direct = mode == IoMode::DIRECT || (mode == IoMode::AUTO && is_device_);
+    if (want_direct) {
+        fd = ::open(str.c_str(), (writable ? O_RDWR : O_RDONLY) | O_DIRECT);
+        if (fd < 0) {
+            // tmpfs and some other file systems refuse O_DIRECT
+            if (mode == IoMode::DIRECT) {
+                fprintf(stderr, "O_DIRECT not supported for '%s', using buffered reads\n",
+                        str.c_str());
+            }
+            want_direct = false;
+        }
+    }
+#else
+    // no O_DIRECT, everything goes through the buffer cache
+    const bool want_direct = false;
+    if (mode == IoMode::DIRECT) {
+        fprintf(stderr, "O_DIRECT not supported for '%s', using buffered reads\n", str.c_str());
+    }
+#endif
+    if (fd < 0) {
+        fd = ::open(str.c_str(), writable ? O_RDWR : O_RDONLY);
+    }
+    if (fd < 0) {
         fprintf(stderr, "error opening file\n");
         return -1;
     }
+    direct_ = want_direct;
+    writable_ = writable;
+
+    if (is_device_) {
+#ifdef __linux__
+        if (ioctl(fd, BLKGETSIZE64, &size_) < 0) {
+            fprintf(stderr, "error getting size of device '%s'\n", str.c_str());
+            return -1;
+        }
+        int sector_size;
+        if (ioctl(fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0) {
+            alignment_ = sector_size;
+        }
+#else
+        uint32_t sector_size;
+        uint64_t sectors;
+        if (ioctl(fd, DKIOCGETBLOCKSIZE, &sector_size) < 0 ||
+            ioctl(fd, DKIOCGETBLOCKCOUNT, &sectors) < 0) {
+            fprintf(stderr, "error getting size of device '%s'\n", str.c_str());
+            return -1;
+        }
+        size_ = sectors * sector_size;
+        alignment_ = sector_size;
+#endif
+    } else {
+        size_ = st.st_size;
+        // the logical block size of the underlying device is not exposed for
+        // regular files, but a page is always sufficient
+        alignment_ = 4096;
+    }
+
+    // a compressed image reads as the image it holds
+    char magic[8];
+    if (size_ >= sizeof(magic) && read_raw(0, magic, sizeof(magic)) == 0 &&
+        ChunkedImage::IsChunked(magic, sizeof(magic))) {
+        if (writable) {
+            fprintf(stderr, "compressed image '%s' cannot be written\n", str.c_str());
+            return -1;
+        }
+        chunked_ = std::make_unique<ChunkedImage>();
+        auto raw = [this](uint64_t offset, void *buf, size_t len) {
+            return read_raw(offset, buf, len);
+        };
+        if (chunked_->Open(raw, size_, pool_) < 0) {
+            fprintf(stderr, "error opening compressed image '%s'\n", str.c_str());
+            return -1;
+        }
+        size_ = chunked_->image_bytes();
+        map_chunks();
+    } else if (!is_device_) {
+        map_holes();
+    }
+
+    LTRACEF("opened '%s': size %#llx, device %d, direct %d, alignment %zu, sparse %d\n",
+            str.c_str(), (unsigned long long)size_, is_device_, direct_, alignment_, sparse_);
 
     return 0;
 }
 
+int Disk::PeekBlock(const std::string &str, size_t blocknum, Block *block) {
+    int fd = ::open(str.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "error opening file\n");
+        return -1;
+    }
+    // the size of a device too
+    const off_t file_bytes = lseek(fd, 0, SEEK_END);
+
+    auto raw = [fd](uint64_t offset, void *buf, size_t len) {
+        auto *ptr = (uint8_t *)buf;
+        while (len > 0) {
+            ssize_t err = pread(fd, ptr, len, offset);
+            if (err <= 0) {
+                return -1;
+            }
+            ptr += err;
+            offset += err;
+            len -= err;
+        }
+        return 0;
+    };
+
+    char magic[8];
+    int err = -1;
+    if (file_bytes >= (off_t)sizeof(magic) && raw(0, magic, sizeof(magic)) == 0) {
+        if (ChunkedImage::IsChunked(magic, sizeof(magic))) {
+            err = ChunkedImage::ReadOnce(raw, file_bytes, blocknum * 512, block->buf.data(),
+                                         block->buf.size());
+        } else {
+            err = raw(blocknum * 512, block->buf.data(), block->buf.size());
+        }
+    }
+    close(fd);
+    return err;
+}
+
+void Disk::map_holes() {
+    data_.clear();
+    sparse_ = false;
+
+    off_t pos = 0;
+    while ((uint64_t)pos < size_) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno != ENXIO) {
+                // no hole support, treat it all as data
+                data_.clear();
+                return;
+            }
+            break; // nothing but a hole to the end
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            hole = size_;
+        }
+        data_.push_back({(uint64_t)data, std::min<uint64_t>(hole, size_)});
+        pos = hole;
+    }
+
+    sparse_ = !(data_.size() == 1 && data_[0].start == 0 && data_[0].end == size_);
+    if (!sparse_) {
+        data_.clear();
+    }
+
+    LTRACEF("%zu data regions, %llu of %llu bytes\n", data_.size(),
+            (unsigned long long)data_bytes(), (unsigned long long)size_);
+}
+
+void Disk::map_chunks() {
+    data_.clear();
+
+    // every chunk that was not all zero is data
+    const uint64_t chunk_bytes = chunked_->chunk_bytes();
+    for (uint64_t c = 0; c < chunked_->chunk_count(); c++) {
+        if (chunked_->is_zero_chunk(c)) {
+            continue;
+        }
+        const uint64_t start = c * chunk_bytes;
+        const uint64_t end = std::min(start + chunk_bytes, size_);
+        if (!data_.empty() && data_.back().end == start) {
+            data_.back().end = end;
+        } else {
+            data_.push_back({start, end});
+        }
+    }
+
+    sparse_ = !(data_.size() == 1 && data_[0].start == 0 && data_[0].end == size_);
+    if (!sparse_) {
+        data_.clear();
+    }
+}
+
+bool Disk::is_zero(uint64_t offset, uint64_t len) const {
+    if (!sparse_) {
+        return false;
+    }
+    // first data region that ends after offset
+    auto it = std::partition_point(data_.begin(), data_.end(),
+                                   [offset](const Range &r) { return r.end <= offset; });
+    return it == data_.end() || it->start >= offset + len;
+}
+
+uint64_t Disk::data_bytes() const {
+    if (!sparse_) {
+        return size_;
+    }
+    uint64_t total = 0;
+    for (auto &r : data_) {
+        total += r.end - r.start;
+    }
+    return total;
+}
+
 int Disk::read(size_t offset, void *buf, size_t len) const {
-    fseek(fp, offset, SEEK_SET);
-    size_t err = fread(buf, 1, len, fp);
-    if (err != len) {
+    if (cache_ && len <= ReadCache::max_cached_read) {
+        return read_cached(offset, buf, len);
+    }
+    return read_uncached(offset, buf, len);
+}
+
+void Disk::EnableReadCache(size_t capacity, std::shared_ptr<CacheBudget> budget) {
+    cache_ = std::make_unique<ReadCache>(capacity, std::move(budget));
+}
+
+int Disk::read_cached(size_t offset, void *buf, size_t len) const {
+    if (offset + len > size_) {
+        return -1;
+    }
+
+    const size_t chunk_bytes = ReadCache::chunk_bytes;
+    const uint64_t end = offset + len;
+    auto *ptr = (uint8_t *)buf;
+    std::vector<uint8_t> tmp;
+    while (offset < end) {
+        const uint64_t chunk = offset / chunk_bytes;
+        const size_t skip = offset - chunk * chunk_bytes;
+        const size_t n = std::min<uint64_t>(chunk_bytes - skip, end - offset);
+        if (cache_->Lookup(chunk, skip, ptr, n)) {
+            stats::Add(stats::Count::READ_CACHE_HIT, 1);
+            ptr += n;
+            offset += n;
+            continue;
+        }
+
+        // read the whole run of missing chunks at once, but only widen it
+        // to the partly covered chunks at either end if they missed before
+        uint64_t last = chunk + 1;
+        while (last * chunk_bytes < end && !cache_->Contains(last)) {
+            last++;
+        }
+        const uint64_t run_end = std::min<uint64_t>(last * chunk_bytes, size_);
+        const bool whole_first = cache_->Admit(chunk);
+        const uint64_t start = whole_first ? chunk * chunk_bytes : offset;
+        uint64_t stop = std::min(end, run_end);
+        if (stop < run_end && (last - 1 == chunk ? whole_first : cache_->Admit(last - 1))) {
+            stop = run_end;
+        }
+        tmp.resize(stop - start);
+        if (read_uncached(start, tmp.data(), tmp.size()) < 0) {
+            return -1;
+        }
+        stats::Add(stats::Count::READ_CACHE_MISS, last - chunk);
+
+        // keep every chunk the read covered completely
+        for (uint64_t c = chunk; c < last; c++) {
+            const uint64_t c_start = c * chunk_bytes;
+            const uint64_t c_end = std::min<uint64_t>(c_start + chunk_bytes, size_);
+            if (c_start >= start && c_end <= stop) {
+                cache_->Insert(c, tmp.data() + (c_start - start), c_end - c_start);
+            }
+        }
+
+        const size_t copy = std::min(end, stop) - offset;
+        memcpy(ptr, tmp.data() + (offset - start), copy);
+        ptr += copy;
+        offset += copy;
+    }
+    return 0;
+}
+
+int Disk::read_uncached(size_t offset, void *buf, size_t len) const {
+    if (limiter_) {
+        limiter_->Acquire();
+    }
+    int err = read_device(offset, buf, len);
+    if (limiter_) {
+        limiter_->Release(len);
+    }
+    return err;
+}
+
+int Disk::read_device(size_t offset, void *buf, size_t len) const {
+    stats::Scope probe(stats::Op::DISK_READ, offset / 512);
+    probe.set_bytes(len);
+
+    if (chunked_) {
+        return chunked_->Read(offset, buf, len);
+    }
+    if (!sparse_) {
+        return read_raw(offset, buf, len);
+    }
+
+    if (offset + len > size_) {
         return -1;
     }
+
+    // zero fill the holes and only read the data regions
+    auto *ptr = (uint8_t *)buf;
+    auto it = std::partition_point(data_.begin(), data_.end(),
+                                   [offset](const Range &r) { return r.end <= offset; });
+    while (len > 0) {
+        if (it == data_.end() || it->start >= offset + len) {
+            memset(ptr, 0, len);
+            break;
+        }
+        if (it->start > offset) {
+            const size_t gap = it->start - offset;
+            memset(ptr, 0, gap);
+            ptr += gap;
+            offset += gap;
+            len -= gap;
+        }
+        const size_t n = std::min<uint64_t>(len, it->end - offset);
+        if (read_raw(offset, ptr, n) < 0) {
+            return -1;
+        }
+        ptr += n;
+        offset += n;
+        len -= n;
+        ++it;
+    }
+    return 0;
+}
+
+int Disk::read_raw(size_t offset, void *buf, size_t len) const {
+    if (direct_) {
+        return read_direct(offset, buf, len);
+    }
+
+    auto *ptr = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t err = pread(fd, ptr, len, offset);
+        if (err <= 0) {
+            return -1;
+        }
+        ptr += err;
+        offset += err;
+        len -= err;
+    }
     return 0;
 }
+
+int Disk::read_direct(size_t offset, void *buf, size_t len) const {
+    auto *ptr = (uint8_t *)buf;
+
+    // read straight into the caller's buffer if everything lines up
+    if (offset % alignment_ == 0 && len % alignment_ == 0 && (uintptr_t)ptr % alignment_ == 0) {
+        while (len > 0) {
+            ssize_t err = pread(fd, ptr, len, offset);
+            if (err <= 0) {
+                return -1;
+            }
+            ptr += err;
+            offset += err;
+            len -= err;
+        }
+        return 0;
+    }
+
+    // otherwise go through an aligned bounce buffer, a chunk at a time
+    uint8_t *bounce = BounceBuffer(alignment_);
+    if (!bounce) {
+        return -1;
+    }
+    while (len > 0) {
+        const size_t aligned_offset = ROUNDDOWN(offset, alignment_);
+        const size_t skip = offset - aligned_offset;
+        const size_t aligned_len =
+            std::min(ROUNDUP(skip + len, alignment_), direct_chunk_size);
+
+        // the last chunk of the device may come up short of the rounded length
+        ssize_t err = pread(fd, bounce, aligned_len, aligned_offset);
+        if (err <= (ssize_t)skip) {
+            return -1;
+        }
+        const size_t n = std::min(len, (size_t)err - skip);
+        memcpy(ptr, bounce + skip, n);
+        ptr += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int Disk::write(size_t offset, const void *buf, size_t len) {
+    assert(writable_);
+
+    stats::Scope probe(stats::Op::DISK_WRITE, offset / 512);
+    probe.set_bytes(len);
+
+    if (offset + len > size_) {
+        fprintf(stderr, "write past the end of the disk at offset %#zx\n", offset);
+        return -1;
+    }
+
+    int err = 0;
+    if (direct_) {
+        err = write_direct(offset, buf, len);
+    } else {
+        const auto *ptr = (const uint8_t *)buf;
+        size_t pos = offset;
+        size_t remaining = len;
+        while (remaining > 0) {
+            ssize_t n = pwrite(fd, ptr, remaining, pos);
+            if (n <= 0) {
+                err = -1;
+                break;
+            }
+            ptr += n;
+            pos += n;
+            remaining -= n;
+        }
+    }
+
+    // whatever was written is data now, even if it was a hole before
+    if (err == 0 && sparse_) {
+        mark_data(offset, len);
+    }
+    if (cache_) {
+        cache_->Invalidate(offset, len);
+    }
+    return err;
+}
+
+int Disk::write_direct(size_t offset, const void *buf, size_t len) {
+    const auto *ptr = (const uint8_t *)buf;
+
+    if (offset % alignment_ == 0 && len % alignment_ == 0 && (uintptr_t)ptr % alignment_ == 0) {
+        while (len > 0) {
+            ssize_t err = pwrite(fd, ptr, len, offset);
+            if (err <= 0) {
+                return -1;
+            }
+            ptr += err;
+            offset += err;
+            len -= err;
+        }
+        return 0;
+    }
+
+    // read-modify-write partial sectors through the bounce buffer
+    uint8_t *bounce = BounceBuffer(alignment_);
+    if (!bounce) {
+        return -1;
+    }
+    while (len > 0) {
+        const size_t aligned_offset = ROUNDDOWN(offset, alignment_);
+        const size_t skip = offset - aligned_offset;
+        const size_t aligned_len =
+            std::min(ROUNDUP(skip + len, alignment_), direct_chunk_size);
+        const size_t n = std::min(len, aligned_len - skip);
+        if (aligned_offset + aligned_len > size_) {
+            fprintf(stderr, "unaligned direct write at the end of the disk\n");
+            return -1;
+        }
+
+        if ((skip != 0 || n != aligned_len) &&
+            pread(fd, bounce, aligned_len, aligned_offset) != (ssize_t)aligned_len) {
+            return -1;
+        }
+        memcpy(bounce + skip, ptr, n);
+        if (pwrite(fd, bounce, aligned_len, aligned_offset) != (ssize_t)aligned_len) {
+            return -1;
+        }
+        ptr += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void Disk::mark_data(uint64_t offset, uint64_t len) {
+    Range r{offset, offset + len};
+
+    // merge with every region it overlaps or touches
+    auto first = std::partition_point(data_.begin(), data_.end(),
+                                      [&r](const Range &d) { return d.end < r.start; });
+    auto last = first;
+    while (last != data_.end() && last->start <= r.end) {
+        r.start = std::min(r.start, last->start);
+        r.end = std::max(r.end, last->end);
+        ++last;
+    }
+    first = data_.erase(first, last);
+    data_.insert(first, r);
+}
+
+int Disk::sync() {
+#ifdef __linux__
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
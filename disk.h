@@ -7,7 +7,15 @@
 #include <array>
 #include <cstdint>
 #include <cstdio>
+#include <memory>
 #include <string>
+#include <vector>
+
+class CacheBudget;
+class ChunkedImage;
+class IoLimiter;
+class ReadCache;
+class ThreadPool;
 
 class Disk {
   public:
@@ -19,14 +27,119 @@ class Disk {
         std::array<uint8_t, 512> buf;
     };
 
-    int open(const std::string &str);
+    // How reads reach the underlying file or device. AUTO bypasses the page
+    // cache with O_DIRECT for block devices and uses buffered reads for image
+    // files. DIRECT forces O_DIRECT, falling back to buffered reads if the
+    // file system does not support it. O_DIRECT is Linux only, elsewhere
+    // reads are always buffered.
+    enum class IoMode {
+        AUTO,
+        BUFFERED,
+        DIRECT,
+    };
+
+    int open(const std::string &str, IoMode mode = IoMode::AUTO, bool writable = false);
 
+    // Read one block of an image, compressed or not, without opening it as a
+    // disk. Only the chunk holding it is decompressed.
+    static int PeekBlock(const std::string &str, size_t blocknum, Block *block);
+
+    // Reads are positional and do not share any file position state, so they
+    // may be issued from multiple threads at once.
     int read(size_t offset, void *buf, size_t len) const;
 
     int read_block(size_t blocknum, Block *block) const {
         return read(blocknum * 512, block->buf.data(), block->buf.size());
     }
 
+    int read_blocks(size_t blocknum, size_t count, void *buf) const {
+        return read(blocknum * 512, buf, count * 512);
+    }
+
+    // Sparse images. The data regions of an image file are found with
+    // SEEK_DATA/SEEK_HOLE when it is opened, or from the index of a compressed
+    // image. Anything outside of them is known to be zero, and reads fill it
+    // in from memory without any I/O.
+    bool is_zero(uint64_t offset, uint64_t len) const;
+    bool is_sparse() const { return sparse_; }
+    uint64_t data_bytes() const;
+
+    // Writes overwrite blocks within the existing size of the image. They
+    // must not race with reads of the same range, or with any read of a
+    // sparse image, whose hole map they update.
+    int write(size_t offset, const void *buf, size_t len);
+
+    int write_blocks(size_t blocknum, size_t count, const void *buf) {
+        return write(blocknum * 512, buf, count * 512);
+    }
+
+    // Keep up to capacity bytes of what is read in memory, shared by every
+    // reader, with writes dropping whatever they overlap. With a budget the
+    // cache also stays within the memory left over by any other caches
+    // sharing it. Reads issued through an IoEngine go around it. Must be set
+    // up before any concurrent use.
+    void EnableReadCache(size_t capacity, std::shared_ptr<CacheBudget> budget = nullptr);
+    const ReadCache *read_cache() const { return cache_.get(); }
+
+    // Wait for a slot on a limiter shared with the other disks on the same
+    // device before every read, except those issued through an IoEngine.
+    // Must be set up before any concurrent use.
+    void SetIoLimiter(std::shared_ptr<IoLimiter> limiter) { limiter_ = std::move(limiter); }
+
+    // Decompress a compressed image on a pool shared with other work rather
+    // than a small one of its own. Must be set before open, and the pool kept
+    // until the last read.
+    void SetPool(ThreadPool *pool) { pool_ = pool; }
+
+    // Identifies the device holding the image, or the device itself
+    uint64_t device_id() const { return device_id_; }
+
+    // Wait for completed writes to reach stable storage
+    int sync();
+
+    uint64_t size() const { return size_; }
+    bool is_writable() const { return writable_; }
+    bool is_device() const { return is_device_; }
+    bool is_direct() const { return direct_; }
+
+    // A compressed image, opened read only, whose contents are what size()
+    // and every read refer to
+    bool is_compressed() const { return chunked_ != nullptr; }
+    size_t alignment() const { return alignment_; }
+
+    // For engines that issue their own reads against the underlying file,
+    // which cannot be used on a compressed image
+    int native_fd() const { return fd; }
+
   private:
-    FILE *fp = nullptr;
+    void map_holes();
+    void map_chunks();
+    int read_cached(size_t offset, void *buf, size_t len) const;
+    int read_uncached(size_t offset, void *buf, size_t len) const;
+    int read_device(size_t offset, void *buf, size_t len) const;
+    int read_raw(size_t offset, void *buf, size_t len) const;
+    int read_direct(size_t offset, void *buf, size_t len) const;
+    int write_direct(size_t offset, const void *buf, size_t len);
+    void mark_data(uint64_t offset, uint64_t len);
+
+    int fd = -1;
+    uint64_t size_ = 0;
+    bool is_device_ = false;
+    bool direct_ = false;
+    bool writable_ = false;
+    size_t alignment_ = 512; // required alignment of offsets, lengths and buffers with O_DIRECT
+
+    // sorted, non overlapping data regions, only filled in when the image has holes
+    struct Range {
+        uint64_t start;
+        uint64_t end;
+    };
+    std::vector<Range> data_;
+    bool sparse_ = false;
+
+    uint64_t device_id_ = 0;
+    ThreadPool *pool_ = nullptr;
+    std::unique_ptr<ChunkedImage> chunked_;
+    std::unique_ptr<ReadCache> cache_;
+    std::shared_ptr<IoLimiter> limiter_;
 };
@@ -0,0 +1,249 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "export.h"
+
+#include <string_view>
+
+#include "aio.h"
+#include "filesystem.h"
+#include "outbuf.h"
+#include "walk.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+// Days from 17-Nov-1858, where VMS time starts, to 1-Jan-1970
+const int64_t vms_epoch_days_before_unix = 40587;
+
+const struct {
+    uint32_t bit;
+    const char *name;
+} filechar_names[] = {
+    {file_char_nobackup, "NOBACKUP"},   {file_char_writeback, "WRITEBACK"},
+    {file_char_readcheck, "READCHECK"}, {file_char_writecheck, "WRITECHECK"},
+    {file_char_contigb, "CONTIGB"},     {file_char_locked, "LOCKED"},
+    {file_char_contig, "CONTIG"},       {file_char_badacl, "BADACL"},
+    {file_char_spool, "SPOOL"},         {file_char_directory, "DIRECTORY"},
+    {file_char_badblock, "BADBLOCK"},   {file_char_markdel, "MARKDEL"},
+    {file_char_nocharge, "NOCHARGE"},   {file_char_erase, "ERASE"},
+};
+
+} // namespace
+
+void PutVmsTime(OutputBuffer &out, uint64_t t) {
+    const uint64_t secs = t / 10000000;
+    const uint32_t hundredths = t % 10000000 / 100000;
+    const uint32_t sod = secs % 86400;
+
+    // civil date from a count of days since 1970, after Howard Hinnant
+    const int64_t z = (int64_t)(secs / 86400) - vms_epoch_days_before_unix + 719468;
+    const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    const uint32_t doe = z - era * 146097;
+    const uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const uint32_t mp = (5 * doy + 2) / 153;
+    const uint32_t day = doy - (153 * mp + 2) / 5 + 1;
+    const uint32_t month = mp < 10 ? mp + 3 : mp - 9;
+    const int64_t year = yoe + era * 400 + (month <= 2);
+
+    out.PutUint(year, 4);
+    out.Put('-');
+    out.PutUint(month, 2);
+    out.Put('-');
+    out.PutUint(day, 2);
+    out.Put('T');
+    out.PutUint(sod / 3600, 2);
+    out.Put(':');
+    out.PutUint(sod / 60 % 60, 2);
+    out.Put(':');
+    out.PutUint(sod % 60, 2);
+    out.Put('.');
+    out.PutUint(hundredths, 2);
+    out.Put('Z');
+}
+
+void PutUic(OutputBuffer &out, uint32_t owner) {
+    out.Put('[');
+    out.PutOctal(owner >> 16);
+    out.Put(',');
+    out.PutOctal(owner & 0xffff);
+    out.Put(']');
+}
+
+void PutProtection(OutputBuffer &out, uint16_t prot) {
+    static const char categories[] = "SOGW";
+    static const char access[] = "RWED";
+    for (int c = 0; c < 4; c++) {
+        if (c > 0) {
+            out.Put(',');
+        }
+        out.Put(categories[c]);
+        out.Put(':');
+        for (int a = 0; a < 4; a++) {
+            if (!((prot >> (c * 4 + a)) & 1)) {
+                out.Put(access[a]);
+            }
+        }
+    }
+}
+
+void PutFlags(OutputBuffer &out, uint32_t filechar, bool json) {
+    bool first = true;
+    for (auto &f : filechar_names) {
+        if (filechar & f.bit) {
+            if (!first) {
+                out.Put(json ? ',' : ' ');
+            }
+            if (json) {
+                out.Put('"');
+            }
+            out.Put(f.name);
+            if (json) {
+                out.Put('"');
+            }
+            first = false;
+        }
+    }
+}
+
+void PutFid(OutputBuffer &out, const file_id &fid) {
+    out.PutUint(fid.file_num());
+    out.Put(',');
+    out.PutUint(fid.sequence_num);
+    out.Put(',');
+    out.PutUint(fid.rv_num);
+}
+
+namespace {
+
+const char csv_header[] = "spec,fid,dir,blocks,allocated,bytes,efblk,ffbyte,created,revised,"
+                          "expires,backup,revision,filechar,flags,owner,protection\n";
+
+void PutCsvRecord(OutputBuffer &out, std::string_view spec, const File &f) {
+    const auto &fh = f.header();
+    const auto &fi = f.ident();
+    const auto &fat = fh.file_rec_attributes;
+
+    out.PutCsvField(spec);
+    out.Put(",\"");
+    PutFid(out, f.id());
+    out.Put("\",");
+    out.Put(f.is_dir() ? "1," : "0,");
+    out.PutUint(f.size_blocks());
+    out.Put(',');
+    out.PutUint(fat.hiblk());
+    out.Put(',');
+    out.PutUint(f.size_bytes());
+    out.Put(',');
+    out.PutUint(fat.efblk());
+    out.Put(',');
+    out.PutUint(fat.ffbyte);
+    for (const uint64_t date : {fi.credate, fi.revdate, fi.expdate, fi.bakdate}) {
+        out.Put(',');
+        if (date) {
+            PutVmsTime(out, date);
+        }
+    }
+    out.Put(',');
+    out.PutUint(fi.revision);
+    out.Put(',');
+    out.PutUint(fh.filechar);
+    out.Put(',');
+    PutFlags(out, fh.filechar, false);
+    out.Put(",\"");
+    PutUic(out, fh.fileowner);
+    out.Put("\",\"");
+    PutProtection(out, fh.fileprot);
+    out.Put("\"\n");
+}
+
+} // namespace
+
+void PutJsonRecord(OutputBuffer &out, std::string_view spec, const File &f) {
+    static const char *const date_keys[] = {",\"created\":", ",\"revised\":", ",\"expires\":",
+                                            ",\"backup\":"};
+
+    const auto &fh = f.header();
+    const auto &fi = f.ident();
+    const auto &fat = fh.file_rec_attributes;
+
+    out.Put("{\"spec\":");
+    out.PutJsonString(spec);
+    out.Put(",\"fid\":\"");
+    PutFid(out, f.id());
+    out.Put(f.is_dir() ? "\",\"dir\":true,\"blocks\":" : "\",\"dir\":false,\"blocks\":");
+    out.PutUint(f.size_blocks());
+    out.Put(",\"allocated\":");
+    out.PutUint(fat.hiblk());
+    out.Put(",\"bytes\":");
+    out.PutUint(f.size_bytes());
+    out.Put(",\"efblk\":");
+    out.PutUint(fat.efblk());
+    out.Put(",\"ffbyte\":");
+    out.PutUint(fat.ffbyte);
+    const uint64_t dates[] = {fi.credate, fi.revdate, fi.expdate, fi.bakdate};
+    for (int i = 0; i < 4; i++) {
+        out.Put(date_keys[i]);
+        if (dates[i]) {
+            out.Put('"');
+            PutVmsTime(out, dates[i]);
+            out.Put('"');
+        } else {
+            out.Put("null");
+        }
+    }
+    out.Put(",\"revision\":");
+    out.PutUint(fi.revision);
+    out.Put(",\"filechar\":");
+    out.PutUint(fh.filechar);
+    out.Put(",\"flags\":[");
+    PutFlags(out, fh.filechar, true);
+    out.Put("],\"owner\":\"");
+    PutUic(out, fh.fileowner);
+    out.Put("\",\"protection\":\"");
+    PutProtection(out, fh.fileprot);
+    out.Put("\"}\n");
+}
+
+int ExportVolume(const Filesystem &fs, FILE *out, const ExportOptions &options,
+                 ExportResult *result) {
+    std::unique_ptr<IoEngine> io;
+    if (options.queue_depth > 0) {
+        io = IoEngine::Create(fs.disk(), options.queue_depth);
+    }
+
+    OutputBuffer buf(out);
+    const bool csv = options.format == ExportFormat::CSV;
+    if (csv) {
+        buf.Put(csv_header);
+    }
+
+    uint64_t records = 0;
+    int err = WalkVolume(fs, [&](const std::string &spec, const DirEntry &,
+                                 const std::shared_ptr<File> &f) {
+        if (csv) {
+            PutCsvRecord(buf, spec, *f);
+        } else {
+            PutJsonRecord(buf, spec, *f);
+        }
+        records++;
+    }, io.get());
+
+    if (buf.Flush() < 0) {
+        fprintf(stderr, "error writing export\n");
+        err = -1;
+    }
+    if (result) {
+        *result = {records, buf.bytes()};
+    }
+
+    return err;
+}
+
+} // namespace ods2
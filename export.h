@@ -0,0 +1,63 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+
+class OutputBuffer;
+
+namespace ods2 {
+
+class File;
+class Filesystem;
+struct file_id;
+
+enum class ExportFormat {
+    JSONL, // one JSON object per line
+    CSV,   // with a header row
+};
+
+struct ExportOptions {
+    ExportFormat format = ExportFormat::JSONL;
+
+    // With a queue depth, read the headers of each directory's entries
+    // through an IoEngine with this many reads in flight
+    size_t queue_depth = 0;
+};
+
+struct ExportResult {
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+};
+
+// Stream one record for every directory entry on the volume, directories
+// included, in walk order:
+//   spec, fid, dir, blocks, allocated, bytes, efblk, ffbyte, created, revised,
+//   expires, backup, revision, filechar, flags, owner, protection
+// Dates are ISO-8601 UTC to the hundredth of a second, and missing when zero.
+// Records are formatted into a fixed buffer as they are found, so memory use
+// does not grow with the size of the volume.
+int ExportVolume(const Filesystem &fs, FILE *out, const ExportOptions &options,
+                 ExportResult *result = nullptr);
+
+// Append the JSON Lines record for one file, as written by ExportVolume
+void PutJsonRecord(OutputBuffer &out, std::string_view spec, const File &f);
+
+// The fields of a record, for other listings:
+//   2001-01-01T00:00:00.00Z from 100ns units since the VMS epoch
+void PutVmsTime(OutputBuffer &out, uint64_t t);
+//   [group,member] in octal
+void PutUic(OutputBuffer &out, uint32_t owner);
+//   S:RWED,O:RWED,G:RE,W: where each set bit of a category denies an access
+void PutProtection(OutputBuffer &out, uint16_t prot);
+//   names of the characteristics, as JSON strings or space separated
+void PutFlags(OutputBuffer &out, uint32_t filechar, bool json);
+void PutFid(OutputBuffer &out, const file_id &fid);
+
+} // namespace ods2
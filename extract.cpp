@@ -0,0 +1,293 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "extract.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "aio.h"
+#include "filesystem.h"
+#include "threadpool.h"
+#include "walk.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+// Size of each read while copying file contents
+const uint32_t copy_chunk_blocks = 2048;
+
+// The header is opened again by whoever copies the file, rather than every
+// File from the walk being kept alive until the end
+struct Job {
+    std::string path;
+    file_id fid;
+};
+
+// A name from the image as one component of a host path. Names come straight
+// off the disk, so a crafted image could otherwise climb out of the output
+// directory with a slash or a .. of its own.
+std::string HostComponent(std::string name) {
+    for (auto &c : name) {
+        if (c == '/' || c == '\0') {
+            c = '_';
+        }
+    }
+    if (name.empty() || name == "." || name == "..") {
+        name = "_" + name;
+    }
+    return name;
+}
+
+// [A.B]NAME.EXT;1 -> A/B/NAME.EXT;1, with [000000] at the top of the tree,
+// and a directory, [A]B.DIR;1, -> A/B, split at dots the same way as the
+// specs of the files in it
+std::string HostPath(const std::string &spec, bool dir = false) {
+    const auto close = spec.find(']');
+    auto dirs = spec.substr(1, close - 1);
+    auto name = spec.substr(close + 1);
+    if (dir) {
+        dirs = dirs == "000000" ? DirStem(name) : dirs + "." + DirStem(name);
+        name.clear();
+    }
+
+    std::string path;
+    if (dirs != "000000") {
+        for (size_t pos = 0; pos <= dirs.size();) {
+            const size_t dot = std::min(dirs.find('.', pos), dirs.size());
+            path += (path.empty() ? "" : "/") + HostComponent(dirs.substr(pos, dot - pos));
+            pos = dot + 1;
+        }
+    }
+    if (dir) {
+        return path;
+    }
+    return path.empty() ? HostComponent(name) : path + "/" + HostComponent(name);
+}
+
+int MakeDirs(const std::string &path) {
+    for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        mkdir(path.substr(0, pos).c_str(), 0755);
+    }
+    if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "error creating directory '%s'\n", path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int ExtractFile(const File &f, const std::string &path, uint64_t *bytes) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "error creating '%s'\n", path.c_str());
+        return -1;
+    }
+
+    // chunks that are holes in a sparse image are left as holes in the output
+    int err = 0;
+    const uint64_t size = f.size_bytes();
+    const uint32_t blocks = f.size_blocks();
+    std::vector<uint8_t> buf((size_t)copy_chunk_blocks * 512);
+    for (uint32_t vbn = 1; vbn <= blocks && err == 0; vbn += copy_chunk_blocks) {
+        const uint32_t n = std::min(copy_chunk_blocks, blocks - vbn + 1);
+        const uint64_t offset = (uint64_t)(vbn - 1) * 512;
+        const size_t len = std::min<uint64_t>(size - offset, (uint64_t)n * 512);
+        if (!f.IsZero(vbn, n)) {
+            if (f.ReadVbns(vbn, n, buf.data()) < 0 ||
+                pwrite(fd, buf.data(), len, offset) != (ssize_t)len) {
+                err = -1;
+            }
+        }
+        *bytes += len;
+    }
+    if (err == 0 && ftruncate(fd, size) < 0) {
+        err = -1;
+    }
+    close(fd);
+
+    if (err < 0) {
+        fprintf(stderr, "error extracting '%s'\n", path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+// Copy every file from this thread, keeping up to the engine's queue depth
+// chunk reads in flight across all of them and writing each chunk out at its
+// own offset as it lands.
+void ExtractAsync(const Filesystem &fs, const std::vector<Job> &jobs, IoEngine &io,
+                  uint64_t *bytes, uint64_t *errors) {
+    struct Output {
+        std::string path;
+        int fd;
+        uint64_t size;
+        uint32_t chunks;
+        bool failed = false;
+    };
+    auto finish_chunk = [errors](Output &out) {
+        if (--out.chunks == 0) {
+            if (ftruncate(out.fd, out.size) < 0) {
+                out.failed = true;
+            }
+            close(out.fd);
+            if (out.failed) {
+                fprintf(stderr, "error extracting '%s'\n", out.path.c_str());
+                (*errors)++;
+            }
+        }
+    };
+
+    for (auto &job : jobs) {
+        // the reads queued below do not refer back to the file, so it can go
+        // once they are
+        File f(fs);
+        if (f.Open(job.fid) < 0) {
+            fprintf(stderr, "error opening '%s'\n", job.path.c_str());
+            (*errors)++;
+            continue;
+        }
+        int fd = open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "error creating '%s'\n", job.path.c_str());
+            (*errors)++;
+            continue;
+        }
+        const uint64_t size = f.size_bytes();
+        const uint32_t blocks = f.size_blocks();
+        if (blocks == 0) {
+            close(fd);
+            continue;
+        }
+
+        const uint32_t chunks = (blocks + copy_chunk_blocks - 1) / copy_chunk_blocks;
+        auto out = std::make_shared<Output>(job.path, fd, size, chunks);
+        for (uint32_t vbn = 1; vbn <= blocks; vbn += copy_chunk_blocks) {
+            const uint32_t n = std::min(copy_chunk_blocks, blocks - vbn + 1);
+            const uint64_t offset = (uint64_t)(vbn - 1) * 512;
+            const size_t len = std::min<uint64_t>(size - offset, (uint64_t)n * 512);
+
+            // holes in a sparse image stay holes in the output
+            if (f.IsZero(vbn, n)) {
+                *bytes += len;
+                finish_chunk(*out);
+                continue;
+            }
+
+            // page aligned so reads can go straight into it with O_DIRECT
+            void *p;
+            if (posix_memalign(&p, 4096, (size_t)n * 512) != 0) {
+                out->failed = true;
+                finish_chunk(*out);
+                continue;
+            }
+            std::shared_ptr<uint8_t> buf((uint8_t *)p, free);
+
+            auto done = [out, buf, offset, len, bytes, &finish_chunk](int err) {
+                if (err < 0 || pwrite(out->fd, buf.get(), len, offset) != (ssize_t)len) {
+                    out->failed = true;
+                }
+                *bytes += len;
+                finish_chunk(*out);
+            };
+            if (f.ReadVbnsAsync(io, vbn, n, buf.get(), std::move(done)) < 0) {
+                out->failed = true;
+                finish_chunk(*out);
+            }
+        }
+    }
+
+    io.Drain();
+}
+
+} // namespace
+
+int ExtractVolume(const Filesystem &fs, const std::string &outdir, const ExtractOptions &options,
+                  ExtractResult *result) {
+    const auto start = std::chrono::steady_clock::now();
+
+    if (MakeDirs(outdir) < 0) {
+        return -1;
+    }
+
+    // an engine reads a single disk, so on a volume set it queues the reads
+    // from relative volume 1 and the runs on the other members are read as
+    // they are reached
+    std::unique_ptr<IoEngine> io;
+    if (options.queue_depth > 0) {
+        io = IoEngine::Create(fs.disk(), options.queue_depth);
+    }
+
+    // create the directory tree up front, collecting the files to copy
+    std::vector<Job> jobs;
+    int err = WalkVolume(fs, [&](const std::string &spec, const DirEntry &e,
+                                 const std::shared_ptr<File> &f) {
+        if (!f->is_dir()) {
+            jobs.push_back({outdir + "/" + HostPath(spec), f->id()});
+        } else if (e.fid.file_num() != (uint32_t)reserved_files::MFD) {
+            MakeDirs(outdir + "/" + HostPath(spec, true));
+        }
+    }, io.get());
+    if (err < 0) {
+        return err;
+    }
+
+    LTRACEF("extracting %zu files\n", jobs.size());
+
+    std::atomic<uint64_t> bytes = 0;
+    std::atomic<uint64_t> errors = 0;
+    if (io) {
+        uint64_t b = 0;
+        uint64_t e = 0;
+        ExtractAsync(fs, jobs, *io, &b, &e);
+        bytes = b;
+        errors = e;
+    } else {
+        std::unique_ptr<ThreadPool> own_pool;
+        if (!options.pool) {
+            own_pool = std::make_unique<ThreadPool>(options.threads);
+        }
+        TaskGroup group(options.pool ? *options.pool : *own_pool);
+        for (auto &job : jobs) {
+            group.Submit([&fs, &job, &bytes, &errors]() {
+                File f(fs);
+                if (f.Open(job.fid) < 0) {
+                    fprintf(stderr, "error opening '%s'\n", job.path.c_str());
+                    errors++;
+                    return;
+                }
+                uint64_t n = 0;
+                if (ExtractFile(f, job.path, &n) < 0) {
+                    errors++;
+                }
+                bytes += n;
+            });
+        }
+        group.Wait();
+    }
+
+    if (result) {
+        *result = {jobs.size(), bytes, errors};
+    }
+    if (!options.quiet) {
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fprintf(stderr, "extracted %zu files, %.1f MiB in %.3f seconds\n", jobs.size(),
+                bytes / (1024.0 * 1024.0), elapsed.count());
+    }
+
+    return errors ? -1 : 0;
+}
+
+} // namespace ods2
@@ -0,0 +1,41 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class ThreadPool;
+
+namespace ods2 {
+
+class Filesystem;
+
+struct ExtractOptions {
+    size_t threads = 0; // 0 picks the hardware concurrency
+    bool quiet = false; // skip the summary line
+
+    // Copy on this shared pool instead of one of its own
+    ThreadPool *pool = nullptr;
+
+    // With a queue depth, copy from a single thread through an IoEngine,
+    // keeping up to this many reads in flight instead of one per thread
+    size_t queue_depth = 0;
+};
+
+struct ExtractResult {
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+};
+
+// Copy every file on the volume into a directory tree on the host, one host
+// directory per ODS-2 directory. Files keep their version, as NAME.EXT;VERSION.
+int ExtractVolume(const Filesystem &fs, const std::string &outdir, const ExtractOptions &options,
+                  ExtractResult *result = nullptr);
+
+} // namespace ods2
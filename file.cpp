@@ -5,18 +5,34 @@
 // https://opensource.org/licenses/MIT
 #include "file.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstring>
 
 #include "disk.h"
 #include "filesystem.h"
+#include "stats.h"
+#include "threadpool.h"
 #include "utils.h"
 
 #define LOCAL_TRACE 0
 
 namespace ods2 {
 
+namespace {
+
+// Readahead window bounds, in blocks. The window starts at the minimum on the
+// first sequential read and doubles on each refill. Directories and the index
+// file stay open in the header caches for a long time, so theirs is kept small.
+const uint32_t readahead_min_blocks = 8;
+const uint32_t readahead_max_blocks = 512;
+const uint32_t readahead_metadata_max_blocks = 32;
+
+} // namespace
+
 File::File(const Filesystem &fs) : fs_(fs) {}
-File::~File() = default;
+File::~File() { RetireReadahead(); }
 
 // Open a file based on the id
 int File::Open(ods2::file_id id) {
@@ -25,10 +41,18 @@ int File::Open(ods2::file_id id) {
     // read the file record out of the index file
     LTRACEF("Opening file %s from index file\n", id.id_str().c_str());
 
-    const auto index_file = fs_.index_file();
+    vol_ = fs_.volume(id.rv_num);
+    if (!vol_) {
+        fprintf(stderr, "file %s is on relative volume %u, which is not mounted\n",
+                id.id_str().c_str(), id.rv_num);
+        return -1;
+    }
+
+    const auto index_file = vol_->index_file();
     assert(index_file);
 
-    if (index_file->ReadVbn(id.file_num() + fs_.index_file_starting_vbn(), &file_rec_block_) < 0) {
+    if (index_file->ReadVbn(id.file_num() + vol_->index_file_starting_vbn(), &file_rec_block_) <
+        0) {
         fprintf(stderr, "error reading file record\n");
         return -1;
     }
@@ -49,6 +73,13 @@ int File::Open(ods2::file_id id, const Disk::Block &s) {
 
     LTRACEF("Opening file %s from raw disk sector\n", id.id_str().c_str());
 
+    vol_ = fs_.volume(id.rv_num);
+    if (!vol_) {
+        fprintf(stderr, "file %s is on relative volume %u, which is not mounted\n",
+                id.id_str().c_str(), id.rv_num);
+        return -1;
+    }
+
     // make a copy of the disk sector
     file_rec_block_ = s;
 
@@ -63,6 +94,7 @@ int File::Open(ods2::file_id id, const Disk::Block &s) {
 }
 
 int File::ParseFileHeader(ods2::file_id id) {
+    stats::Scope probe(stats::Op::HEADER_PARSE, id.file_num());
 
     // TODO: validate file header
     fhdr_ = (const ods2::file_header *)file_rec_block_.buf.data();
@@ -70,10 +102,16 @@ int File::ParseFileHeader(ods2::file_id id) {
         fhdr_->dump();
     }
 
-    // Make sure the file number and sequence num match
-    if (fhdr_->fid != id) {
+    // Make sure the file number and sequence num match. A header refers to
+    // itself with a relative volume number of 0, while references to it from
+    // elsewhere in a set carry the number of its volume.
+    const auto &fid = fhdr_->fid;
+    if (fid.file_num() != id.file_num() || fid.sequence_num != id.sequence_num ||
+        (fid.rv_num != 0 && fid.rv_num != vol_->rvn())) {
         return -1;
     }
+    id_ = fid;
+    id_.rv_num = vol_->rvn();
 
     fident_ = (const ods2::file_ident *)(file_rec_block_.buf.data() + fhdr_->id_offset * 2);
     if (LOCAL_TRACE) {
@@ -82,13 +120,59 @@ int File::ParseFileHeader(ods2::file_id id) {
 
     // Read in the map
     assert(extents_.size() == 0);
-    const uint16_t *map_area =
-        (uint16_t *)(file_rec_block_.buf.data() + fhdr_->map_area_offset * 2);
-
-    // walk the map list
     LTRACEF("parsing extent list:\n");
     uint32_t vbn = 1;
-    const uint16_t *map_area_stop = map_area + fhdr_->map_inuse;
+    ParseMapArea(file_rec_block_, *vol_, &vbn);
+
+    // Then follow the chain of extension headers, each mapping the blocks that
+    // come next on its own volume. A relative volume number of 0 in the link
+    // is the volume of the header holding it.
+    const Filesystem *vol = vol_;
+    file_id ext = fhdr_->ext_fid;
+    for (uint16_t seg = 1; ext.file_num() != 0; seg++) {
+        vol = vol->volume(ext.rv_num);
+        if (!vol) {
+            fprintf(stderr, "extension header %s is on a volume that is not mounted\n",
+                    ext.id_str().c_str());
+            return -1;
+        }
+
+        // the index file is still being opened when it has extension headers
+        // of its own, and is read through what is mapped so far
+        Disk::Block block;
+        const uint32_t header_vbn = ext.file_num() + vol->index_file_starting_vbn();
+        if (vol == vol_ && id_.file_num() == (uint32_t)reserved_files::INDEX) {
+            uint32_t lbn;
+            if (LbnOf(header_vbn, &lbn) < 0 || vol->disk().read_block(lbn, &block) < 0) {
+                return -1;
+            }
+        } else if (vol->index_file()->ReadVbn(header_vbn, &block) < 0) {
+            return -1;
+        }
+
+        // the segment numbers also keep a damaged chain from looping
+        const auto *xh = (const file_header *)block.buf.data();
+        if (xh->fid.file_num() != ext.file_num() || xh->fid.sequence_num != ext.sequence_num ||
+            xh->seg_num != seg) {
+            fprintf(stderr, "bad extension header %s\n", ext.id_str().c_str());
+            return -1;
+        }
+        LTRACEF("extension header %s on rvn %u\n", ext.id_str().c_str(), vol->rvn());
+        ParseMapArea(block, *vol, &vbn);
+        ext = xh->ext_fid;
+    }
+
+    LTRACEF_NOFILE("\ttotal vbns %#x\n", vbn - 1);
+
+    return 0;
+}
+
+void File::ParseMapArea(const Disk::Block &block, const Filesystem &vol, uint32_t *vbn) {
+    const auto *fh = (const ods2::file_header *)block.buf.data();
+    const uint16_t *map_area = (uint16_t *)(block.buf.data() + fh->map_area_offset * 2);
+
+    // walk the map list
+    const uint16_t *map_area_stop = map_area + fh->map_inuse;
     while (map_area != map_area_stop) {
         LTRACEF_LEVEL(2, "%#x %#x %#x %#x\n", map_area[0], map_area[1], map_area[2], map_area[3]);
         uint32_t lbn;
@@ -120,19 +204,15 @@ int File::ParseFileHeader(ods2::file_id id) {
         block_count++;
 
         LTRACEF_NOFILE("\tformat %u: cluster %#x vbn %#x lbn %#x (offset %#x), count %#x\n", format,
-                       vbn / fs_.cluster_factor(), vbn, lbn, lbn * 512, block_count);
-        extents_.push_back({vbn, lbn, block_count});
+                       *vbn / vol.cluster_factor(), *vbn, lbn, lbn * 512, block_count);
+        extents_.push_back({*vbn, lbn, block_count, vol.rvn()});
 
-        assert((block_count % fs_.cluster_factor()) == 0);
+        assert((block_count % vol.cluster_factor()) == 0);
 
         // accumulate vbn
-        vbn += block_count;
+        *vbn += block_count;
         map_area += format + 1;
     }
-
-    LTRACEF_NOFILE("\ttotal vbns %#x\n", vbn - 1);
-
-    return 0;
 }
 
 std::string File::name() const {
@@ -140,28 +220,485 @@ std::string File::name() const {
     return fident_->name();
 }
 
+const Filesystem &File::VolumeOf(const extent &e) const { return *fs_.volume(e.rvn); }
+
+const File::extent *File::FindExtent(uint32_t vbn) const {
+    stats::Scope probe(stats::Op::VBN_TRANSLATE, vbn);
+
+    for (const auto &extent : extents_) {
+        if (vbn >= extent.vbn && vbn < extent.vbn + extent.block_count) {
+            return &extent;
+        }
+    }
+    return nullptr;
+}
+
 int File::ReadVbn(const uint32_t vbn, Disk::Block *block) const {
     assert(vbn > 0);
 
     LTRACEF("vbn %#x\n", vbn);
 
-    // translate vbn to lbn
-    uint32_t lbn = UINT32_MAX;
-    for (const auto &extent : extents_) {
-        if (vbn >= extent.vbn && vbn < extent.vbn + extent.block_count) {
-            // found it here
-            lbn = extent.lbn + vbn - extent.vbn;
-            break;
+    uint32_t count;
+    uint64_t generation;
+    {
+        std::lock_guard guard(readahead_lock_);
+        auto &ra = readahead_;
+
+        // anything buffered may be stale once something has been written
+        generation = fs_.writable() ? fs_.cache().generation() : 0;
+        if (ra.generation != generation) {
+            RetireReadahead();
         }
+
+        if (vbn >= ra.start_vbn && vbn - ra.start_vbn < ra.blocks.size()) {
+            const uint32_t i = vbn - ra.start_vbn;
+            *block = ra.blocks[i];
+            if (!ra.used[i]) {
+                ra.used[i] = true;
+                ra.used_count++;
+            }
+            ra.next_vbn = vbn + 1;
+
+            // nothing follows the last block of the file
+            if (i + 1 == ra.blocks.size() && vbn >= PrefetchLimit(vbn)) {
+                RetireReadahead();
+            }
+            return 0;
+        }
+
+        // a miss either continues a sequential run, starts one from the top
+        // of the file, or is random
+        const uint32_t max_window =
+            (id_.file_num() == (uint32_t)reserved_files::INDEX ||
+             (fhdr_->filechar & file_char_directory))
+                ? readahead_metadata_max_blocks
+                : readahead_max_blocks;
+        if (vbn == ra.next_vbn) {
+            ra.window = std::clamp(ra.window * 2, readahead_min_blocks, max_window);
+        } else if (vbn == 1) {
+            ra.window = readahead_min_blocks;
+        } else {
+            ra.window = 0;
+        }
+        ra.next_vbn = vbn + 1;
+
+        // a run that has ended or never started has no use for what is
+        // buffered, so it goes now rather than staying with the File
+        RetireReadahead();
+        count = std::min(ra.window, PrefetchLimit(vbn) - vbn + 1);
+    }
+
+    // The refill is an ordinary synchronous read of the whole window, not a
+    // prefetch running alongside the caller. It is done outside the lock and
+    // into a buffer of its own, so readers of other blocks, such as the many
+    // threads opening headers through the index file, are not held up by it.
+    if (count > 1) {
+        stats::Scope probe(stats::Op::READAHEAD, vbn);
+        std::vector<Disk::Block> blocks(count);
+        if (ReadVbns(vbn, count, blocks.data()) == 0) {
+            probe.set_bytes((uint64_t)count * 512);
+            *block = blocks[0];
+
+            std::lock_guard guard(readahead_lock_);
+            auto &ra = readahead_;
+            RetireReadahead();
+            ra.blocks.swap(blocks);
+            ra.start_vbn = vbn;
+            ra.used.assign(count, false);
+            ra.used[0] = true;
+            ra.used_count = 1;
+            ra.generation = generation;
+            return 0;
+        }
+
+        // fall back to just the block asked for
+        std::lock_guard guard(readahead_lock_);
+        readahead_.window = 0;
     }
-    if (lbn == UINT32_MAX) {
+
+    // translate vbn to lbn
+    const auto *extent = FindExtent(vbn);
+    if (!extent) {
         fprintf(stderr, "failed looking up lbn from vbn\n");
         return -1;
     }
+    const uint32_t lbn = extent->lbn + vbn - extent->vbn;
 
     LTRACEF("translated vbn %#x to lbn %#x (offset %#lx)\n", vbn, lbn, (unsigned long)lbn * 512);
 
-    return fs_.disk().read_block(lbn, block);
+    const auto &vol = VolumeOf(*extent);
+    if (vol.disk().read_block(lbn, block) < 0) {
+        return -1;
+    }
+    if (vol.writable()) {
+        vol.cache().Overlay(lbn, 1, block);
+    }
+    return 0;
+}
+
+uint32_t File::PrefetchLimit(uint32_t vbn) const {
+    // nothing past the end of the allocation, nor past the end of file unless
+    // the caller is already reading there
+    return std::max(vbn, std::min(AllocatedBlocks(), std::max(size_blocks(), vbn)));
+}
+
+uint32_t File::AllocatedBlocks() const {
+    uint32_t allocated = 0;
+    for (auto &e : extents_) {
+        allocated = std::max(allocated, e.vbn + e.block_count - 1);
+    }
+    return allocated;
+}
+
+void File::RetireReadahead() const {
+    auto &ra = readahead_;
+    if (!ra.blocks.empty()) {
+        stats::Add(stats::Count::READAHEAD_USED, ra.used_count);
+        stats::Add(stats::Count::READAHEAD_WASTED, ra.blocks.size() - ra.used_count);
+    }
+    ra.blocks.clear();
+    ra.used.clear();
+    ra.used_count = 0;
+}
+
+int File::MapRuns(uint32_t vbn, uint32_t count, const RunCallback &run) const {
+    assert(vbn > 0);
+
+    const Filesystem *run_vol = nullptr;
+    uint32_t run_lbn = 0;
+    uint32_t run_count = 0;
+    while (count > 0) {
+        const auto *extent = FindExtent(vbn);
+        if (!extent) {
+            fprintf(stderr, "failed looking up lbn from vbn\n");
+            return -1;
+        }
+        const auto &vol = VolumeOf(*extent);
+        const uint32_t lbn = extent->lbn + vbn - extent->vbn;
+        const uint32_t n = std::min(count, extent->vbn + extent->block_count - vbn);
+
+        // merge with the previous extent if it ends where this one starts
+        if (run_count > 0 && run_vol == &vol && run_lbn + run_count == lbn) {
+            run_count += n;
+        } else {
+            if (run_count > 0 && run(*run_vol, run_lbn, run_count) < 0) {
+                return -1;
+            }
+            run_vol = &vol;
+            run_lbn = lbn;
+            run_count = n;
+        }
+        vbn += n;
+        count -= n;
+    }
+
+    return run_count > 0 ? run(*run_vol, run_lbn, run_count) : 0;
+}
+
+int File::ReadVbns(uint32_t vbn, uint32_t count, void *buf) const {
+    LTRACEF("vbn %#x count %#x\n", vbn, count);
+
+    auto read = [](const Filesystem &vol, uint32_t lbn, uint32_t n, uint8_t *ptr) -> int {
+        LTRACEF("reading lbn %#x count %#x\n", lbn, n);
+        if (vol.disk().read_blocks(lbn, n, ptr) < 0) {
+            return -1;
+        }
+        if (vol.writable()) {
+            vol.cache().Overlay(lbn, n, ptr);
+        }
+        return 0;
+    };
+
+    auto *ptr = (uint8_t *)buf;
+    if (!fs_.set_pool()) {
+        return MapRuns(vbn, count, [&](const Filesystem &vol, uint32_t lbn, uint32_t n) -> int {
+            if (read(vol, lbn, n, ptr) < 0) {
+                return -1;
+            }
+            ptr += (size_t)n * 512;
+            return 0;
+        });
+    }
+
+    // On a volume set, gather the runs by member first
+    struct Run {
+        uint32_t lbn;
+        uint32_t n;
+        uint8_t *ptr;
+    };
+    std::vector<std::pair<const Filesystem *, std::vector<Run>>> members;
+    if (MapRuns(vbn, count, [&](const Filesystem &vol, uint32_t lbn, uint32_t n) {
+            auto it = std::find_if(members.begin(), members.end(),
+                                   [&vol](auto &m) { return m.first == &vol; });
+            if (it == members.end()) {
+                members.emplace_back(&vol, std::vector<Run>());
+                it = members.end() - 1;
+            }
+            it->second.push_back({lbn, n, ptr});
+            ptr += (size_t)n * 512;
+            return 0;
+        }) < 0) {
+        return -1;
+    }
+
+    // then read every member but the first from the pool, while this thread
+    // reads the first
+    std::atomic<int> err = 0;
+    auto read_member = [&](const std::pair<const Filesystem *, std::vector<Run>> &m) {
+        for (auto &r : m.second) {
+            if (read(*m.first, r.lbn, r.n, r.ptr) < 0) {
+                err = -1;
+                return;
+            }
+        }
+    };
+    if (members.size() > 1) {
+        stats::Add(stats::Count::VOLSET_SPLIT_READ, 1);
+        TaskGroup group(*fs_.set_pool());
+        for (size_t i = 1; i < members.size(); i++) {
+            group.Submit([&, i]() { read_member(members[i]); });
+        }
+        read_member(members[0]);
+    } else if (!members.empty()) {
+        read_member(members[0]);
+    }
+    return err;
+}
+
+int File::WriteVbns(uint32_t vbn, uint32_t count, const void *buf) {
+    LTRACEF("vbn %#x count %#x\n", vbn, count);
+
+    if (!fs_.writable()) {
+        fprintf(stderr, "volume is not mounted for writing\n");
+        return -1;
+    }
+
+    const auto *ptr = (const uint8_t *)buf;
+    return MapRuns(vbn, count, [&](const Filesystem &vol, uint32_t lbn, uint32_t n) -> int {
+        if (vol.cache().Write(lbn, n, ptr) < 0) {
+            return -1;
+        }
+        ptr += (size_t)n * 512;
+        return 0;
+    });
+}
+
+int File::Write(uint64_t offset, const void *buf, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    const uint64_t end = offset + len;
+    if (end > (uint64_t)AllocatedBlocks() * 512) {
+        fprintf(stderr, "write past the allocated blocks of '%s'\n", name().c_str());
+        return -1;
+    }
+
+    const uint32_t first_vbn = offset / 512 + 1;
+    const uint32_t blocks = (end + 511) / 512 - offset / 512;
+    if (offset % 512 == 0 && len % 512 == 0) {
+        if (WriteVbns(first_vbn, blocks, buf) < 0) {
+            return -1;
+        }
+    } else {
+        // fill in the untouched parts of the first and last blocks
+        std::vector<uint8_t> tmp((size_t)blocks * 512);
+        if (offset % 512 && ReadVbn(first_vbn, (Disk::Block *)tmp.data()) < 0) {
+            return -1;
+        }
+        if (end % 512 && (blocks > 1 || offset % 512 == 0) &&
+            ReadVbn(first_vbn + blocks - 1, (Disk::Block *)(tmp.data() + tmp.size() - 512)) < 0) {
+            return -1;
+        }
+        memcpy(tmp.data() + offset % 512, buf, len);
+        if (WriteVbns(first_vbn, blocks, tmp.data()) < 0) {
+            return -1;
+        }
+    }
+
+    if (end > size_bytes()) {
+        return SetEndOfFile(end);
+    }
+    if (!modified_) {
+        MarkModified();
+        return WriteHeader();
+    }
+    return 0;
+}
+
+int File::SetEndOfFile(uint64_t bytes) {
+    if (bytes > (uint64_t)AllocatedBlocks() * 512) {
+        fprintf(stderr, "end of file past the allocated blocks of '%s'\n", name().c_str());
+        return -1;
+    }
+
+    auto &fat = ((file_header *)file_rec_block_.buf.data())->file_rec_attributes;
+    fat.set_efblk(bytes / 512 + 1);
+    fat.ffbyte = bytes % 512;
+    MarkModified();
+
+    return WriteHeader();
+}
+
+int File::SetExtents(const std::vector<LbnRun> &runs) {
+    if (!fs_.writable()) {
+        fprintf(stderr, "volume is not mounted for writing\n");
+        return -1;
+    }
+    if (fhdr_->ext_fid.file_num() != 0) {
+        fprintf(stderr, "cannot remap '%s', which has extension headers\n", name().c_str());
+        return -1;
+    }
+    if (SetHeaderMap(&file_rec_block_, runs) < 0) {
+        fprintf(stderr, "too many extents for the header of '%s'\n", name().c_str());
+        return -1;
+    }
+    for (size_t i = 1; i < runs.size(); i++) {
+        if (runs[i].lbn != runs[i - 1].lbn + runs[i - 1].count) {
+            ((file_header *)file_rec_block_.buf.data())->filechar &= ~file_char_contig;
+            break;
+        }
+    }
+
+    // reparse the map, which nothing buffered from the old one survives
+    {
+        std::lock_guard guard(readahead_lock_);
+        RetireReadahead();
+    }
+    extents_.clear();
+    if (ParseFileHeader(id_) < 0) {
+        return -1;
+    }
+    MarkModified();
+
+    return WriteHeader();
+}
+
+int File::LbnOf(uint32_t vbn, uint32_t *lbn) const {
+    return MapRuns(vbn, 1, [lbn](const Filesystem &, uint32_t l, uint32_t) {
+        *lbn = l;
+        return 0;
+    });
+}
+
+void File::MarkModified() {
+    if (modified_) {
+        return;
+    }
+    auto *fh = (file_header *)file_rec_block_.buf.data();
+    auto *fi = (file_ident *)(file_rec_block_.buf.data() + fh->id_offset * 2);
+    fi->revision++;
+    fi->revdate = vms_time_now();
+    modified_ = true;
+}
+
+int File::WriteHeader() {
+    set_block_checksum(file_rec_block_.buf.data());
+
+    // find where the header lives in the index file
+    const uint32_t vbn = id().file_num() + vol_->index_file_starting_vbn();
+    uint32_t lbn = 0;
+    if (vol_->index_file()->LbnOf(vbn, &lbn) < 0) {
+        return -1;
+    }
+
+    return vol_->cache().Write(lbn, 1, file_rec_block_.buf.data(), BlockCache::Kind::HEADER);
+}
+
+int File::ReadVbnsAsync(IoEngine &io, uint32_t vbn, uint32_t count, void *buf,
+                        IoEngine::Callback done) const {
+    LTRACEF("vbn %#x count %#x\n", vbn, count);
+
+    // translate everything up front so a bad vbn fails before anything is queued
+    struct Run {
+        const Filesystem *vol;
+        uint32_t lbn;
+        uint32_t n;
+        uint8_t *ptr;
+    };
+    std::vector<Run> runs;
+    auto *ptr = (uint8_t *)buf;
+    if (MapRuns(vbn, count, [&](const Filesystem &vol, uint32_t lbn, uint32_t n) {
+            runs.push_back({&vol, lbn, n, ptr});
+            ptr += (size_t)n * 512;
+            return 0;
+        }) < 0) {
+        return -1;
+    }
+
+    // the engine reads a single disk, so runs on the other members of a volume
+    // set are read here and now
+    size_t queued = 0;
+    for (auto &r : runs) {
+        if (&r.vol->disk() == &io.disk()) {
+            queued++;
+            continue;
+        }
+        if (r.vol->disk().read_blocks(r.lbn, r.n, r.ptr) < 0) {
+            return -1;
+        }
+        if (r.vol->writable()) {
+            r.vol->cache().Overlay(r.lbn, r.n, r.ptr);
+        }
+    }
+    if (queued == 0) {
+        done(0);
+        return 0;
+    }
+
+    struct State {
+        size_t remaining;
+        int err = 0;
+        IoEngine::Callback done;
+    };
+    auto state = std::make_shared<State>(queued, 0, std::move(done));
+
+    for (auto &r : runs) {
+        if (&r.vol->disk() != &io.disk()) {
+            continue;
+        }
+        io.Submit((uint64_t)r.lbn * 512, r.ptr, (size_t)r.n * 512, [state, r](int err) {
+            if (err == 0 && r.vol->writable()) {
+                r.vol->cache().Overlay(r.lbn, r.n, r.ptr);
+            }
+            if (err < 0) {
+                state->err = err;
+            }
+            if (--state->remaining == 0) {
+                state->done(state->err);
+            }
+        });
+    }
+
+    return 0;
+}
+
+bool File::IsZero(uint32_t vbn, uint32_t count) const {
+    // pending writes may have filled in a hole
+    if ((!fs_.disk().is_sparse() && !fs_.set_pool()) || fs_.writable()) {
+        return false;
+    }
+    return MapRuns(vbn, count, [&](const Filesystem &vol, uint32_t lbn, uint32_t n) {
+               return vol.disk().is_zero((uint64_t)lbn * 512, (uint64_t)n * 512) ? 0 : -1;
+           }) == 0;
+}
+
+int File::ReadContents(uint32_t chunk_blocks,
+                       const std::function<void(const uint8_t *data, size_t len)> &callback) const {
+    std::vector<uint8_t> buf((size_t)chunk_blocks * 512);
+
+    uint64_t remaining = size_bytes();
+    const uint32_t blocks = size_blocks();
+    for (uint32_t vbn = 1; vbn <= blocks; vbn += chunk_blocks) {
+        const uint32_t n = std::min(chunk_blocks, blocks - vbn + 1);
+        if (ReadVbns(vbn, n, buf.data()) < 0) {
+            return -1;
+        }
+        const size_t len = std::min<uint64_t>(remaining, (uint64_t)n * 512);
+        callback(buf.data(), len);
+        remaining -= len;
+    }
+
+    return 0;
 }
 
 std::tuple<int, DirEntryList> File::ReadDirEntries() const {
@@ -178,6 +715,8 @@ std::tuple<int, DirEntryList> File::ReadDirEntries() const {
             return {-1, {}};
         }
 
+        stats::Scope probe(stats::Op::DIR_PARSE, vbn);
+
         uintptr_t dir_pointer = (uintptr_t)block.buf.data();
         auto *dh = (const ods2::dir_header *)dir_pointer;
 
@@ -204,8 +743,12 @@ std::tuple<int, DirEntryList> File::ReadDirEntries() const {
                 LTRACEF_NOFILE("\tmax version %u, fid %s\n", dvfid->version,
                                dvfid->id.id_str().c_str());
 
-                entries.push_back(
-                    {std::string((const char *)namebuf.data()), dvfid->version, dvfid->id});
+                // 0 is the volume the directory itself is on
+                auto fid = dvfid->id;
+                if (fid.rv_num == 0) {
+                    fid.rv_num = vol_->rvn();
+                }
+                entries.push_back({std::string((const char *)namebuf.data()), dvfid->version, fid});
 
                 dvfid++;
             }
@@ -220,6 +763,8 @@ std::tuple<int, DirEntryList> File::ReadDirEntries() const {
 
 namespace {
 DirEntry *FindInDirEntryList(DirEntryList &list, const std::string &name) {
+    stats::Scope probe(stats::Op::DIR_LOOKUP, list.size());
+
     for (auto &e : list) {
         // First match should be the highest version since they're sorted
         // highest version first in the directory.
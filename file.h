@@ -7,11 +7,15 @@
 
 #include <cassert>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "aio.h"
 #include "disk.h"
+#include "layout.h"
 #include "ods2.h"
 #include "utils.h"
 
@@ -41,13 +45,62 @@ class File {
     // Used to bootstrap the INDEXF.SYS file
     int Open(ods2::file_id id, const Disk::Block &s);
 
+    // Read a single block. Runs of reads that each continue where the last one
+    // left off are detected and served from a readahead window that doubles
+    // with every refill.
     int ReadVbn(uint32_t vbn, Disk::Block *block) const;
 
+    // Read count blocks starting at vbn into buf, issuing one disk read per
+    // physically contiguous run instead of one per block. On a volume set the
+    // runs on each member are read in parallel with those on the others.
+    int ReadVbns(uint32_t vbn, uint32_t count, void *buf) const;
+
+    // Queue the same reads as ReadVbns on an engine, calling done once they
+    // have all completed. Fails without queueing anything if the range is not
+    // mapped. Runs on another member of a volume set than the one the engine
+    // reads are read synchronously before returning, and if nothing is left
+    // to queue, including when count is 0, done is called before returning.
+    int ReadVbnsAsync(IoEngine &io, uint32_t vbn, uint32_t count, void *buf,
+                      IoEngine::Callback done) const;
+
+    // Overwrite count blocks in place starting at vbn, through the block cache
+    // of a writable mount. The blocks must already be allocated to the file.
+    int WriteVbns(uint32_t vbn, uint32_t count, const void *buf);
+
+    // Overwrite len bytes at offset. Writing past the end of file moves it
+    // forward, as long as the write stays within the allocated blocks. The
+    // first write bumps the revision count and date in the header, which is
+    // rewritten with a fresh checksum whenever it changes.
+    int Write(uint64_t offset, const void *buf, size_t len);
+
+    // Move the end of file, which must stay within the allocated blocks
+    int SetEndOfFile(uint64_t bytes);
+
+    // Replace the map of the file with runs, for when its blocks have been
+    // moved or more have been allocated. The caller owns the clusters.
+    int SetExtents(const std::vector<LbnRun> &runs);
+
+    // Translate a single vbn
+    int LbnOf(uint32_t vbn, uint32_t *lbn) const;
+
+    // Blocks mapped by the extents, past the end of file or not
+    uint32_t AllocatedBlocks() const;
+
+    // True if every block in the range is backed by a hole in a sparse image
+    bool IsZero(uint32_t vbn, uint32_t count) const;
+
+    // Read the logical contents of the file front to back in chunks of up to
+    // chunk_blocks, passing each chunk trimmed to the size of the file.
+    int ReadContents(uint32_t chunk_blocks,
+                     const std::function<void(const uint8_t *data, size_t len)> &callback) const;
+
     std::unique_ptr<File> OpenFileInDir(const std::string &name) const;
 
+    // The file id, with the relative volume number of the volume holding the
+    // header filled in
     ods2::file_id id() const {
         assert(opened_);
-        return *id_;
+        return id_;
     }
 
     std::string name() const;
@@ -58,16 +111,67 @@ class File {
 
     std::tuple<int, DirEntryList> ReadDirEntries() const;
 
-  private:
+    // Extents of files on a volume set map blocks of the member they came
+    // from, by relative volume number
     struct extent {
         uint32_t vbn;
         uint32_t lbn;
         uint32_t block_count;
+        uint16_t rvn;
+
+        bool operator==(const extent &) const = default;
     };
 
+    const std::vector<extent> &extents() const { return extents_; }
+
+    const ods2::file_header &header() const {
+        assert(opened_);
+        return *fhdr_;
+    }
+    const ods2::file_ident &ident() const {
+        assert(opened_);
+        return *fident_;
+    }
+    const Disk::Block &header_block() const {
+        assert(opened_);
+        return file_rec_block_;
+    }
+
+    // Logical size of the file from the end of file block and first free byte
+    uint64_t size_bytes() const {
+        assert(opened_);
+        const auto &fat = fhdr_->file_rec_attributes;
+        return fat.efblk() ? (uint64_t)(fat.efblk() - 1) * 512 + fat.ffbyte : 0;
+    }
+    uint32_t size_blocks() const { return (size_bytes() + 511) / 512; }
+
+  private:
     int ParseFileHeader(ods2::file_id id);
 
+    // Append the retrieval pointers of a primary or extension header on vol
+    void ParseMapArea(const Disk::Block &block, const Filesystem &vol, uint32_t *vbn);
+
+    const extent *FindExtent(uint32_t vbn) const;
+    const Filesystem &VolumeOf(const extent &e) const;
+
+    // Call run for each physically contiguous run of lbns backing the range,
+    // with the volume holding them
+    using RunCallback =
+        std::function<int(const Filesystem &vol, uint32_t lbn, uint32_t count)>;
+    int MapRuns(uint32_t vbn, uint32_t count, const RunCallback &run) const;
+
+    // Last vbn worth prefetching when reading from vbn
+    uint32_t PrefetchLimit(uint32_t vbn) const;
+    void RetireReadahead() const;
+
+    // Bump the revision count and date, once per open
+    void MarkModified();
+
+    // Put the modified header back through the block cache
+    int WriteHeader();
+
     const Filesystem &fs_;
+    const Filesystem *vol_ = nullptr; // the volume holding the primary header
     bool opened_ = false;
 
     Disk::Block file_rec_block_{}; // a copy of the primary file record block
@@ -75,10 +179,29 @@ class File {
     // Pointers into the file record block above
     const ods2::file_header *fhdr_{};
     const ods2::file_ident *fident_{};
-    const ods2::file_id *id_{};
+    ods2::file_id id_{};
 
     // list of all the extents of the file
     std::vector<extent> extents_{};
+
+    bool modified_ = false; // revision already bumped by a write
+
+    // Sequential access state for ReadVbn. Refills go through ReadVbns, so
+    // they follow the extent map across lbn gaps instead of running off the
+    // end of an extent, and are clamped to the end of the file. The lock only
+    // covers the state, never a read, and the window is dropped as soon as a
+    // sequential run ends.
+    struct Readahead {
+        uint32_t next_vbn = 1; // where a sequential reader goes next
+        uint32_t window = 0;   // blocks read on the next refill, 0 when random
+        uint32_t start_vbn = 0;
+        std::vector<Disk::Block> blocks;
+        std::vector<bool> used;
+        uint32_t used_count = 0;
+        uint64_t generation = 0; // of the block cache when filled
+    };
+    mutable std::mutex readahead_lock_;
+    mutable Readahead readahead_;
 };
 
 inline void dump_directory(std::shared_ptr<ods2::File> dir) {
@@ -5,11 +5,15 @@
 // https://opensource.org/licenses/MIT
 #include "filesystem.h"
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cstring>
 #include <vector>
 
 #include "file.h"
+#include "readcache.h"
+#include "threadpool.h"
 #include "utils.h"
 
 #define LOCAL_TRACE 0
@@ -17,17 +21,40 @@
 namespace ods2 {
 
 Filesystem::Filesystem() = default;
-Filesystem::~Filesystem() = default;
+Filesystem::~Filesystem() {
+    if (cache_) {
+        Flush();
+    }
+}
 
-int Filesystem::Mount(const std::string &diskfile) {
+int Filesystem::Mount(const std::string &diskfile, Disk::IoMode mode, bool writable) {
     if (mounted_) {
         return -1;
     }
 
-    if (disk_.open(diskfile) < 0) {
+    if (diskfile.find(',') != std::string::npos) {
+        if (writable) {
+            fprintf(stderr, "volume sets can only be mounted read only\n");
+            return -1;
+        }
+        std::vector<std::string> images;
+        size_t start = 0;
+        for (size_t comma; (comma = diskfile.find(',', start)) != std::string::npos;
+             start = comma + 1) {
+            images.push_back(diskfile.substr(start, comma - start));
+        }
+        images.push_back(diskfile.substr(start));
+        return MountSet(images, mode);
+    }
+
+    disk_.SetPool(disk_pool_);
+    if (disk_.open(diskfile, mode, writable) < 0) {
         fprintf(stderr, "Failed to open file\n");
         return -1;
     }
+    if (writable) {
+        cache_ = std::make_unique<BlockCache>(disk_);
+    }
 
     // read in the first home block from LBN 1
     // TODO: properly scan for it, it's not always on LBN 1
@@ -72,6 +99,207 @@ int Filesystem::Mount(const std::string &diskfile) {
         fprintf(stderr, "MFD file is not a directory\n");
         return -1;
     }
+
+    return 0;
+}
+
+int Filesystem::MountSet(const std::vector<std::string> &images, Disk::IoMode mode) {
+    if (mounted_ || images.empty()) {
+        return -1;
+    }
+
+    // order the members by the relative volume numbers in their home blocks
+    std::vector<std::string> by_rvn(images.size() + 1);
+    for (auto &image : images) {
+        Disk::Block block;
+        if (Disk::PeekBlock(image, 1, &block) < 0) {
+            fprintf(stderr, "error reading the home block of '%s'\n", image.c_str());
+            return -1;
+        }
+        const uint16_t rvn = ((const home_block *)block.buf.data())->rvn;
+        if (rvn == 0 || rvn > images.size() || !by_rvn[rvn].empty()) {
+            fprintf(stderr, "'%s' is relative volume %u, which does not fit a set of %zu\n",
+                    image.c_str(), rvn, images.size());
+            return -1;
+        }
+        by_rvn[rvn] = image;
+    }
+
+    // enough workers for a couple of readers to span every member at once,
+    // which decompress the members too unless there is a pool to share
+    pool_ = std::make_unique<ThreadPool>(std::max<size_t>((images.size() - 1) * 2, 2));
+    if (!disk_pool_) {
+        disk_pool_ = pool_.get();
+    }
+
+    if (Mount(by_rvn[1], mode) < 0) {
+        return -1;
+    }
+    if (hblock_->setcount != images.size()) {
+        fprintf(stderr, "volume set has %u volumes, %zu given\n", hblock_->setcount,
+                images.size());
+        return -1;
+    }
+
+    volumes_.assign(images.size() + 1, nullptr);
+    volumes_[1] = this;
+    for (size_t rvn = 2; rvn < by_rvn.size(); rvn++) {
+        auto member = std::make_unique<Filesystem>();
+        member->set_ = this;
+        member->SetPool(disk_pool_);
+        if (member->Mount(by_rvn[rvn], mode) < 0) {
+            fprintf(stderr, "error mounting relative volume %zu '%s'\n", rvn,
+                    by_rvn[rvn].c_str());
+            return -1;
+        }
+        if (memcmp(member->home().strucname, hblock_->strucname, sizeof(hblock_->strucname))) {
+            fprintf(stderr, "relative volume %zu '%s' belongs to another volume set\n", rvn,
+                    by_rvn[rvn].c_str());
+            return -1;
+        }
+        volumes_[rvn] = member.get();
+        members_.push_back(std::move(member));
+    }
+
+    LTRACEF("volume set of %zu members\n", volumes_.size() - 1);
+
+    return CheckVolumeSetList();
+}
+
+int Filesystem::CheckVolumeSetList() const {
+    // loosely coupled sets have no list
+    File list(*this);
+    if (list.Open({reserved_files::VOL_SET, reserved_files::VOL_SET}) < 0) {
+        return 0;
+    }
+
+    // 64 byte records, the structure name and then the label of each volume
+    std::vector<uint8_t> records;
+    if (list.ReadContents(16, [&](const uint8_t *data, size_t len) {
+            records.insert(records.end(), data, data + len);
+        }) < 0) {
+        fprintf(stderr, "error reading the volume set list\n");
+        return -1;
+    }
+    for (size_t rvn = 1; rvn < volumes_.size() && (rvn + 1) * 64 <= records.size(); rvn++) {
+        const auto *label = records.data() + rvn * 64;
+        const auto *volname = volumes_[rvn]->home().volname;
+        if (memcmp(label, volname, sizeof(home_block::volname))) {
+            fprintf(stderr, "relative volume %zu is '%.12s', the volume set list expects '%.12s'\n",
+                    rvn, (const char *)volname, (const char *)label);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void Filesystem::EnableReadCache(size_t capacity, std::shared_ptr<CacheBudget> budget) {
+    if (!members_.empty() && !budget) {
+        budget = std::make_shared<CacheBudget>(capacity);
+    }
+    disk_.EnableReadCache(capacity, budget);
+    for (auto &member : members_) {
+        member->disk_.EnableReadCache(capacity, budget);
+    }
+}
+
+void Filesystem::SetIoLimiters(
+    const std::function<std::shared_ptr<IoLimiter>(const Disk &)> &limiter_for) {
+    disk_.SetIoLimiter(limiter_for(disk_));
+    for (auto &member : members_) {
+        member->disk_.SetIoLimiter(limiter_for(member->disk_));
+    }
+}
+
+int Filesystem::Flush() {
+    if (!cache_ || cache_->dirty_blocks() == 0) {
+        return 0;
+    }
+
+    // stamp the primary home block and the alternate, which is read back so
+    // that anything differing between the two is kept
+    auto *hb = (home_block *)home_block_buf_.buf.data();
+    hb->revdate = vms_time_now();
+    set_home_block_checksums(hb);
+    if (cache_->Write(hb->homelbn, 1, hb, BlockCache::Kind::HOME) < 0) {
+        return -1;
+    }
+    Disk::Block alt;
+    if (hb->alhomelbn != 0 && hb->alhomelbn != hb->homelbn &&
+        disk_.read_block(hb->alhomelbn, &alt) == 0) {
+        auto *ahb = (home_block *)alt.buf.data();
+        if (block_checksum(ahb, offsetof(home_block, checksum1) / 2) == ahb->checksum1) {
+            ahb->revdate = hb->revdate;
+            set_home_block_checksums(ahb);
+            if (cache_->Write(hb->alhomelbn, 1, ahb, BlockCache::Kind::HOME) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return cache_->Flush();
+}
+
+void Filesystem::Discard() {
+    if (cache_) {
+        cache_->Discard();
+    }
+}
+
+void Filesystem::ForgetStorageBitmap() {
+    std::lock_guard guard(storage_bitmap_lock_);
+    storage_bitmap_.clear();
+    storage_bitmap_loaded_.store(false, std::memory_order_release);
+}
+
+void Filesystem::LoadStorageBitmap() const {
+    std::lock_guard guard(storage_bitmap_lock_);
+    if (storage_bitmap_loaded_.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    // not fatal, the volume can still be read without it
+    if (ReadStorageBitmap() < 0) {
+        fprintf(stderr, "warning: could not read the storage bitmap\n");
+        storage_bitmap_.clear();
+        volume_blocks_ = disk_.size() / 512;
+    }
+    storage_bitmap_loaded_.store(true, std::memory_order_release);
+}
+
+int Filesystem::ReadStorageBitmap() const {
+    File bitmap(*this);
+    if (bitmap.Open({reserved_files::BITMAP, reserved_files::BITMAP}) < 0) {
+        return -1;
+    }
+
+    // vbn 1 is the storage control block, the bitmap itself follows
+    Disk::Block scb_block;
+    if (bitmap.ReadVbn(1, &scb_block) < 0) {
+        return -1;
+    }
+    const auto *scb = (const storage_control_block *)scb_block.buf.data();
+    volume_blocks_ = scb->volsize ? scb->volsize : disk_.size() / 512;
+
+    if (cluster_factor() == 0) {
+        return -1;
+    }
+    const uint32_t clusters = (volume_blocks_ + cluster_factor() - 1) / cluster_factor();
+    const uint32_t blocks = (clusters + 4095) / 4096;
+    if (blocks + 1 > bitmap.size_blocks()) {
+        return -1;
+    }
+
+    std::vector<uint8_t> map((size_t)blocks * 512);
+    if (bitmap.ReadVbns(2, blocks, map.data()) < 0) {
+        return -1;
+    }
+    map.resize((clusters + 7) / 8);
+    storage_bitmap_.swap(map);
+
+    LTRACEF("volume %u blocks, %u clusters\n", volume_blocks_, clusters);
+
     return 0;
 }
 
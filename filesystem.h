@@ -5,15 +5,22 @@
 // https://opensource.org/licenses/MIT
 #pragma once
 
+#include <atomic>
 #include <cassert>
 #include <cstdio>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
+#include "blockcache.h"
 #include "disk.h"
 #include "file.h"
 #include "ods2.h"
 
+class ThreadPool;
+
 namespace ods2 {
 
 class Filesystem {
@@ -21,7 +28,32 @@ class Filesystem {
     Filesystem();
     ~Filesystem();
 
-    int Mount(const std::string &diskfile);
+    // A writable mount routes every write through a write-back block cache,
+    // flushed by Flush or when the filesystem is destroyed. A comma separated
+    // list of images is mounted as a bound volume set, see MountSet.
+    int Mount(const std::string &diskfile, Disk::IoMode mode = Disk::IoMode::AUTO,
+              bool writable = false);
+
+    // Mount the members of a bound volume set, given in any order, read only.
+    // Each member is a volume of its own, placed by the relative volume number
+    // in its home block, and this filesystem becomes relative volume 1, which
+    // holds the MFD of the whole set. Files and directory entries on any
+    // member are reached through it.
+    int MountSet(const std::vector<std::string> &images, Disk::IoMode mode = Disk::IoMode::AUTO);
+
+    // Decompress compressed images on a pool shared with other work, see
+    // Disk::SetPool. Must be set before mounting.
+    void SetPool(ThreadPool *pool) { disk_pool_ = pool; }
+
+    // Write out everything dirty in the block cache. If anything changed the
+    // volume revision date in both home blocks is updated too, and they go
+    // out last.
+    int Flush();
+
+    // Throw away everything written since the last Flush, so the volume is
+    // left as it was. Headers of open files, the index file included, may no
+    // longer match the disk, so nothing but unmounting should follow.
+    void Discard();
 
     std::shared_ptr<File> OpenRootDir() const { return mfd_file(); }
 
@@ -37,18 +69,106 @@ class Filesystem {
 
     const Disk &disk() const { return disk_; }
 
+    // Relative volume number within a bound volume set, 0 for a volume that
+    // is not part of one
+    uint16_t rvn() const { return hblock_->rvn; }
+
+    // Members of the set this volume was mounted with, or 1 on its own
+    size_t volume_count() const { return set_->volumes_.empty() ? 1 : set_->volumes_.size() - 1; }
+
+    // The volume a file id with relative volume number rvn is on, seen from
+    // this volume, so 0 is this volume. nullptr if it is not mounted.
+    const Filesystem *volume(uint16_t rvn) const {
+        if (rvn == 0 || rvn == this->rvn()) {
+            return this;
+        }
+        return rvn < set_->volumes_.size() ? set_->volumes_[rvn] : nullptr;
+    }
+
+    // Workers for reads that span several members of a set, nullptr otherwise
+    ThreadPool *set_pool() const {
+        return set_->members_.empty() ? nullptr : set_->pool_.get();
+    }
+
+    // Share a cache of recently read blocks between every reader of the
+    // volume, before any of them start. The members of a set share one budget
+    // of capacity if none is given.
+    void EnableReadCache(size_t capacity, std::shared_ptr<CacheBudget> budget = nullptr);
+
+    // Throttle reads along with the other volumes on the same device, with
+    // the limiter for the device of each member
+    void SetIoLimiters(const std::function<std::shared_ptr<IoLimiter>(const Disk &)> &limiter_for);
+
+    bool writable() const { return cache_ != nullptr; }
+    BlockCache &cache() const {
+        assert(writable());
+        return *cache_;
+    }
+    const ods2::home_block &home() const { return *hblock_; }
+
     uint8_t cluster_factor() const { return hblock_->cluster; }
+
+    // Storage bitmap from BITMAP.SYS, one bit per cluster, set when the cluster
+    // is free. Read on first use, as only a few commands need it. If it could
+    // not be read every block counts as allocated.
+    bool has_storage_bitmap() const {
+        EnsureStorageBitmap();
+        return !storage_bitmap_.empty();
+    }
+    bool lbn_allocated(uint32_t lbn) const {
+        EnsureStorageBitmap();
+        const uint32_t cluster = lbn / cluster_factor();
+        if (cluster / 8 >= storage_bitmap_.size()) {
+            return true;
+        }
+        return !((storage_bitmap_[cluster / 8] >> (cluster % 8)) & 1);
+    }
+
+    // Size of the volume in blocks, from the storage control block
+    uint32_t volume_blocks() const {
+        EnsureStorageBitmap();
+        return volume_blocks_;
+    }
     uint32_t index_file_starting_vbn() const { return hblock_->ibmapvbn - 1 + hblock_->ibmapsize; }
 
+    // Drop the storage bitmap after allocating or freeing clusters, so the
+    // next use reads it again
+    void ForgetStorageBitmap();
+
   private:
     DISALLOW_COPY_ASSIGN_AND_MOVE(Filesystem);
 
+    // Check the member labels against the volume set list on relative volume
+    // 1, when it has one
+    int CheckVolumeSetList() const;
+
+    void EnsureStorageBitmap() const {
+        if (!storage_bitmap_loaded_.load(std::memory_order_acquire)) {
+            LoadStorageBitmap();
+        }
+    }
+    void LoadStorageBitmap() const;
+    int ReadStorageBitmap() const;
+
     bool mounted_ = false;
     Disk::Block home_block_buf_;
     const ods2::home_block *hblock_;
     std::shared_ptr<File> index_file_;
     std::shared_ptr<File> mfd_file_;
+    mutable std::mutex storage_bitmap_lock_;
+    mutable std::atomic<bool> storage_bitmap_loaded_ = false;
+    mutable std::vector<uint8_t> storage_bitmap_;
+    mutable uint32_t volume_blocks_ = 0;
     Disk disk_;
+    ThreadPool *disk_pool_ = nullptr;
+    std::unique_ptr<BlockCache> cache_;
+
+    // Bound volume sets. Relative volume 1 owns the other members, and every
+    // member points back at it.
+    const Filesystem *set_ = this;
+    std::vector<const Filesystem *> volumes_; // by rvn, 0 unused
+    std::vector<std::unique_ptr<Filesystem>> members_;
+    std::unique_ptr<ThreadPool> pool_;
 };
 
 } // namespace ods2
\ No newline at end of file
@@ -0,0 +1,126 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "hash.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+const uint64_t prime3 = 0x165667b19e3779f9ULL;
+const uint64_t prime4 = 0x85ebca77c2b2ae63ULL;
+const uint64_t prime5 = 0x27d4eb2f165667c5ULL;
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * prime2;
+    acc = rotl(acc, 31);
+    return acc * prime1;
+}
+
+inline uint64_t merge_round(uint64_t acc, uint64_t val) {
+    acc ^= round(0, val);
+    return acc * prime1 + prime4;
+}
+
+} // namespace
+
+Hash64::Hash64(uint64_t seed) : seed_(seed) {
+    acc_[0] = seed + prime1 + prime2;
+    acc_[1] = seed + prime2;
+    acc_[2] = seed;
+    acc_[3] = seed - prime1;
+}
+
+void Hash64::Update(const void *data, size_t len) {
+    auto *p = (const uint8_t *)data;
+    total_len_ += len;
+
+    // top off a partial stripe left over from the last call
+    if (buffered_ > 0) {
+        const size_t n = std::min(len, buf_.size() - buffered_);
+        memcpy(buf_.data() + buffered_, p, n);
+        buffered_ += n;
+        p += n;
+        len -= n;
+        if (buffered_ < buf_.size()) {
+            return;
+        }
+        for (int i = 0; i < 4; i++) {
+            acc_[i] = round(acc_[i], read64(buf_.data() + i * 8));
+        }
+        buffered_ = 0;
+    }
+
+    // bulk of the data, 32 bytes at a time
+    while (len >= 32) {
+        acc_[0] = round(acc_[0], read64(p));
+        acc_[1] = round(acc_[1], read64(p + 8));
+        acc_[2] = round(acc_[2], read64(p + 16));
+        acc_[3] = round(acc_[3], read64(p + 24));
+        p += 32;
+        len -= 32;
+    }
+
+    memcpy(buf_.data(), p, len);
+    buffered_ = len;
+}
+
+uint64_t Hash64::Final() const {
+    uint64_t h;
+    if (total_len_ >= 32) {
+        h = rotl(acc_[0], 1) + rotl(acc_[1], 7) + rotl(acc_[2], 12) + rotl(acc_[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = merge_round(h, acc_[i]);
+        }
+    } else {
+        h = seed_ + prime5;
+    }
+    h += total_len_;
+
+    const uint8_t *p = buf_.data();
+    size_t len = buffered_;
+    while (len >= 8) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * prime1 + prime4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)read32(p) * prime1;
+        h = rotl(h, 23) * prime2 + prime3;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        h ^= (*p) * prime5;
+        h = rotl(h, 11) * prime1;
+        p++;
+        len--;
+    }
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,34 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Streaming implementation of the 64 bit xxHash algorithm. Not
+// cryptographically strong, but fast enough that hashing file contents is
+// bound by the disk rather than the cpu.
+class Hash64 {
+  public:
+    explicit Hash64(uint64_t seed = 0);
+
+    void Update(const void *data, size_t len);
+    uint64_t Final() const;
+
+    static uint64_t Hash(const void *data, size_t len, uint64_t seed = 0) {
+        Hash64 h(seed);
+        h.Update(data, len);
+        return h.Final();
+    }
+
+  private:
+    uint64_t seed_;
+    std::array<uint64_t, 4> acc_;
+    std::array<uint8_t, 32> buf_;
+    size_t buffered_ = 0;
+    uint64_t total_len_ = 0;
+};
@@ -0,0 +1,474 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "import.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "alloc.h"
+#include "filesystem.h"
+#include "layout.h"
+#include "walk.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+// Size of each read while copying host files in
+const uint32_t copy_chunk_blocks = 2048;
+
+// Longest name and extension ODS-2 allows
+const size_t max_name_part = 39;
+
+const uint16_t max_version = 32767;
+
+// Most an import holds in the block cache before its single flush, 1 GiB
+const size_t max_held_blocks = 2 * 1024 * 1024;
+
+struct Node {
+    std::string host; // path on the host
+    std::string name; // NAME.EXT, or NAME.DIR for a directory
+    uint16_t version = 1;
+    bool dir = false;
+    uint64_t bytes = 0;
+    uint64_t date = 0;
+    uint32_t parent = 0; // index into the node list
+
+    // set once allocated, or from the volume for a directory that exists
+    file_id fid;
+    std::shared_ptr<File> existing;
+    std::vector<LbnRun> runs; // for a new file, or a directory that moves
+
+    // what the directory will hold once rewritten
+    std::vector<DirRecord> records;
+    uint32_t added = 0;
+    std::map<std::string, uint16_t> versions; // highest version of each name
+    std::map<std::string, uint32_t> subdirs;  // existing or new, to merge into
+    std::vector<Disk::Block> blocks;          // the directory as rewritten
+};
+
+std::string CleanPart(const std::string &s) {
+    std::string out;
+    for (char c : s.substr(0, max_name_part)) {
+        c = toupper((unsigned char)c);
+        out += (isalnum((unsigned char)c) || c == '_' || c == '-' || c == '$') ? c : '_';
+    }
+    return out;
+}
+
+// readme.txt -> README.TXT, foo.tar.gz -> FOO_TAR.GZ
+std::string VmsName(const std::string &host, bool dir) {
+    if (dir) {
+        return CleanPart(host) + ".DIR";
+    }
+    const auto dot = host.rfind('.');
+    if (dot == std::string::npos) {
+        return CleanPart(host) + ".";
+    }
+    return CleanPart(host.substr(0, dot)) + "." + CleanPart(host.substr(dot + 1));
+}
+
+uint64_t VmsTime(const struct timespec &ts) {
+    return (vms_unix_epoch_offset + ts.tv_sec) * 10000000ULL + ts.tv_nsec / 100;
+}
+
+class Importer {
+  public:
+    Importer(Filesystem &fs, ImportResult &result)
+        : fs_(fs), result_(result), clusters_(fs), numbers_(fs, clusters_) {}
+
+    int Run(const std::string &hostdir, const std::string &into);
+
+  private:
+    int Open(const std::string &into);
+    int OpenDirectory(uint32_t node);
+    void Scan(uint32_t dir);
+    int CopyFile(const Node &n, const std::vector<LbnRun> &runs);
+    int WriteHeader(const HeaderInfo &info);
+    bool Rewritten(uint32_t node) const;
+    int Reserve();
+    int WriteFiles();
+    int WriteDirectory(uint32_t node);
+
+    Filesystem &fs_;
+    ImportResult &result_;
+    ClusterAllocator clusters_;
+    FileNumberAllocator numbers_;
+    std::vector<Node> nodes_;
+    std::vector<LbnRun> freed_; // old directory blocks, released at the end
+    std::vector<uint8_t> copy_buf_;
+};
+
+// Pick up what a directory on the volume already holds
+int Importer::OpenDirectory(uint32_t node) {
+    auto &n = nodes_[node];
+    n.fid = n.existing->id();
+    auto [err, entries] = n.existing->ReadDirEntries();
+    if (err < 0) {
+        return -1;
+    }
+    for (auto &e : entries) {
+        n.records.push_back({e.name, e.version, e.fid});
+        auto &v = n.versions[e.name];
+        v = std::max(v, e.version);
+    }
+    return 0;
+}
+
+int Importer::Open(const std::string &into) {
+    Node root;
+    root.existing = into.empty() ? fs_.OpenRootDir() : LookupSpec(fs_, into);
+    if (!root.existing || !root.existing->is_dir()) {
+        fprintf(stderr, "directory '%s' not found\n", into.c_str());
+        return -1;
+    }
+    nodes_.push_back(std::move(root));
+    return OpenDirectory(0);
+}
+
+// Add everything under a host directory to the node list
+void Importer::Scan(uint32_t dir) {
+    DIR *d = opendir(nodes_[dir].host.c_str());
+    if (!d) {
+        fprintf(stderr, "error reading directory '%s'\n", nodes_[dir].host.c_str());
+        result_.errors++;
+        return;
+    }
+    std::vector<std::string> names;
+    while (auto *ent = readdir(d)) {
+        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+            names.push_back(ent->d_name);
+        }
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+
+    for (auto &name : names) {
+        Node n;
+        n.host = nodes_[dir].host + "/" + name;
+        n.parent = dir;
+        struct stat st;
+        if (lstat(n.host.c_str(), &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+            LTRACEF("skipping '%s'\n", n.host.c_str());
+            continue;
+        }
+        n.dir = S_ISDIR(st.st_mode);
+        n.name = VmsName(name, n.dir);
+        n.bytes = n.dir ? 0 : st.st_size;
+#ifdef __linux__
+        n.date = VmsTime(st.st_mtim);
+#else
+        n.date = VmsTime(st.st_mtimespec);
+#endif
+
+        auto &parent = nodes_[dir];
+        if (n.dir) {
+            // merge into a directory of the same name, on the volume or not
+            auto sub = parent.subdirs.find(n.name);
+            if (sub != parent.subdirs.end()) {
+                nodes_[sub->second].host = n.host;
+                Scan(sub->second);
+                continue;
+            }
+            if (parent.versions.count(n.name)) {
+                auto existing = std::make_shared<File>(fs_);
+                const auto it = std::find_if(parent.records.begin(), parent.records.end(),
+                                             [&](const DirRecord &r) { return r.name == n.name; });
+                if (existing->Open(it->fid) < 0 || !existing->is_dir()) {
+                    fprintf(stderr, "'%s' is in the way of directory '%s'\n", n.name.c_str(),
+                            n.host.c_str());
+                    result_.errors++;
+                    continue;
+                }
+                n.existing = std::move(existing);
+            }
+        } else {
+            auto &v = parent.versions[n.name];
+            if (v >= max_version) {
+                fprintf(stderr, "no versions left for '%s'\n", n.host.c_str());
+                result_.errors++;
+                continue;
+            }
+            n.version = ++v;
+        }
+
+        const uint32_t index = nodes_.size();
+        nodes_.push_back(std::move(n));
+        if (nodes_[index].dir) {
+            nodes_[dir].subdirs[nodes_[index].name] = index;
+            if (nodes_[index].existing && OpenDirectory(index) < 0) {
+                result_.errors++;
+                continue;
+            }
+            Scan(index);
+        }
+    }
+}
+
+int Importer::CopyFile(const Node &n, const std::vector<LbnRun> &runs) {
+    // a host file that cannot be read is counted and skipped, the file is
+    // there but holds zeros past the failure
+    int fd = open(n.host.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "error opening '%s'\n", n.host.c_str());
+        result_.errors++;
+        return 0;
+    }
+
+    // only the blocks up to the end of file, the rest of the last cluster is
+    // left as it was
+    int err = 0;
+    uint64_t remaining = n.bytes;
+    auto &buf = copy_buf_;
+    buf.resize((size_t)copy_chunk_blocks * 512);
+    for (auto &run : runs) {
+        for (uint32_t off = 0; off < run.count && remaining > 0 && err == 0;) {
+            const uint32_t count = std::min(copy_chunk_blocks, run.count - off);
+            const size_t len = std::min<uint64_t>(remaining, (uint64_t)count * 512);
+            const uint32_t blocks = (len + 511) / 512;
+            memset(buf.data() + len, 0, (size_t)blocks * 512 - len);
+            if (pread(fd, buf.data(), len, n.bytes - remaining) != (ssize_t)len) {
+                fprintf(stderr, "error reading '%s'\n", n.host.c_str());
+                result_.errors++;
+                remaining = 0;
+                break;
+            }
+            err = fs_.cache().Write(run.lbn + off, blocks, buf.data());
+            off += blocks;
+            remaining -= len;
+        }
+    }
+    close(fd);
+
+    return err;
+}
+
+int Importer::WriteHeader(const HeaderInfo &info) {
+    Disk::Block blk;
+    if (BuildHeader(&blk, info) < 0) {
+        fprintf(stderr, "too many extents for '%s'\n", info.name.c_str());
+        return -1;
+    }
+    uint32_t lbn;
+    if (fs_.index_file()->LbnOf(fs_.index_file_starting_vbn() + info.fid.file_num(), &lbn) < 0) {
+        return -1;
+    }
+    return fs_.cache().Write(lbn, 1, blk.buf.data(), BlockCache::Kind::HEADER);
+}
+
+// Each directory that gains entries is rewritten once
+bool Importer::Rewritten(uint32_t node) const {
+    const auto &n = nodes_[node];
+    return (n.dir || node == 0) && (!n.existing || n.added > 0);
+}
+
+// Find room for everything before any of it is written, so an import that
+// does not fit leaves the volume as it was: the files first, then numbers for
+// them, which may grow the index file out of what is left, and then the
+// directories that hold them
+int Importer::Reserve() {
+    uint32_t count = 0;
+    for (auto &n : nodes_) {
+        if (!n.existing && !n.dir && clusters_.Allocate((n.bytes + 511) / 512, &n.runs) < 0) {
+            return -1;
+        }
+        count += !n.existing;
+    }
+
+    std::vector<file_id> ids;
+    if (numbers_.Allocate(count, &ids) < 0) {
+        return -1;
+    }
+    auto id = ids.begin();
+    for (auto &n : nodes_) {
+        if (!n.existing) {
+            n.fid = *id++;
+            nodes_[n.parent].records.push_back({n.name, n.version, n.fid});
+            nodes_[n.parent].added++;
+        }
+    }
+
+    for (uint32_t i = 0; i < nodes_.size(); i++) {
+        if (!Rewritten(i)) {
+            continue;
+        }
+        auto &n = nodes_[i];
+        SortDirRecords(n.records);
+        n.blocks = BuildDirectoryBlocks(n.records);
+        const uint32_t blocks = n.blocks.size();
+        if (n.existing && blocks <= n.existing->AllocatedBlocks()) {
+            continue;
+        }
+
+        // directories stay contiguous, so one that grows moves somewhere bigger
+        n.runs.resize(1);
+        if (clusters_.AllocateContiguous(blocks, &n.runs[0]) < 0) {
+            if (n.existing) {
+                fprintf(stderr, "no contiguous space to grow directory '%s'\n",
+                        n.existing->name().c_str());
+            } else {
+                fprintf(stderr, "no contiguous space for directory '%s'\n", n.host.c_str());
+            }
+            return -1;
+        }
+        if (n.existing) {
+            for (auto &e : n.existing->extents()) {
+                freed_.push_back({e.lbn, e.block_count});
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Copy in the files and write their headers
+int Importer::WriteFiles() {
+    for (auto &n : nodes_) {
+        if (n.existing || n.dir) {
+            continue;
+        }
+
+        if (CopyFile(n, n.runs) < 0) {
+            return -1;
+        }
+
+        HeaderInfo info;
+        info.runs = n.runs;
+        info.fid = n.fid;
+        info.backlink = nodes_[n.parent].fid;
+        info.name = n.name;
+        info.version = n.version;
+        info.bytes = n.bytes;
+        info.date = n.date;
+        for (auto &r : info.runs) {
+            info.alloc_blocks += r.count;
+        }
+        if (WriteHeader(info) < 0) {
+            return -1;
+        }
+
+        result_.files++;
+        result_.bytes += n.bytes;
+    }
+
+    return 0;
+}
+
+int Importer::WriteDirectory(uint32_t node) {
+    auto &n = nodes_[node];
+    const uint32_t count = n.blocks.size();
+
+    if (!n.existing) {
+        HeaderInfo info;
+        info.runs = n.runs;
+        if (fs_.cache().Write(info.runs[0].lbn, count, n.blocks.data()) < 0) {
+            return -1;
+        }
+
+        info.fid = n.fid;
+        info.backlink = nodes_[n.parent].fid;
+        info.name = n.name;
+        info.version = 1;
+        info.filechar = file_char_directory | file_char_contig;
+        info.bytes = (uint64_t)count * 512;
+        info.alloc_blocks = info.runs[0].count;
+        info.date = n.date;
+        result_.dirs++;
+        return WriteHeader(info);
+    }
+
+    auto &f = *n.existing;
+    if (!n.runs.empty() && f.SetExtents(n.runs) < 0) {
+        return -1;
+    }
+    if (f.WriteVbns(1, count, n.blocks.data()) < 0) {
+        return -1;
+    }
+    return f.SetEndOfFile((uint64_t)count * 512);
+}
+
+int Importer::Run(const std::string &hostdir, const std::string &into) {
+    if (clusters_.Load() < 0 || numbers_.Load() < 0 || Open(into) < 0) {
+        return -1;
+    }
+
+    nodes_[0].host = hostdir;
+    Scan(0);
+    LTRACEF("%zu nodes to import\n", nodes_.size() - 1);
+
+    // the block cache is held, so nothing reaches the disk before the final
+    // flush, and a failure up to there is undone by dropping what it holds
+    // and leaving both bitmaps unwritten
+    if (Reserve() < 0 || WriteFiles() < 0) {
+        fs_.Discard();
+        return -1;
+    }
+    for (uint32_t i = 0; i < nodes_.size(); i++) {
+        if (Rewritten(i) && WriteDirectory(i) < 0) {
+            fs_.Discard();
+            return -1;
+        }
+    }
+
+    // nothing points at the old blocks of moved directories any more
+    for (auto &run : freed_) {
+        clusters_.Free(run);
+    }
+
+    if (clusters_.Flush() < 0 || numbers_.Flush() < 0 || fs_.Flush() < 0) {
+        fprintf(stderr, "error writing the volume\n");
+        return -1;
+    }
+    fs_.ForgetStorageBitmap();
+
+    return 0;
+}
+
+} // namespace
+
+int ImportTree(Filesystem &fs, const std::string &hostdir, const ImportOptions &options,
+               ImportResult *result) {
+    const auto start = std::chrono::steady_clock::now();
+
+    if (!fs.writable()) {
+        fprintf(stderr, "volume is not mounted for writing\n");
+        return -1;
+    }
+
+    ImportResult r;
+    Importer importer(fs, r);
+    fs.cache().Hold(max_held_blocks);
+    const int err = importer.Run(hostdir, options.into);
+    fs.cache().Release();
+    if (err < 0) {
+        return -1;
+    }
+
+    if (result) {
+        *result = r;
+    }
+    if (!options.quiet) {
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fprintf(stderr, "imported %llu files, %llu new directories, %.1f MiB in %.3f seconds\n",
+                (unsigned long long)r.files, (unsigned long long)r.dirs,
+                r.bytes / (1024.0 * 1024.0), elapsed.count());
+    }
+
+    return r.errors ? -1 : 0;
+}
+
+} // namespace ods2
@@ -0,0 +1,38 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace ods2 {
+
+class Filesystem;
+
+struct ImportOptions {
+    std::string into;   // directory to import into, [A.B], the MFD by default
+    bool quiet = false; // skip the summary line
+};
+
+struct ImportResult {
+    uint64_t files = 0;
+    uint64_t dirs = 0; // newly created
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+};
+
+// Copy a directory tree from the host onto a writable mount. Host names are
+// upper cased and anything ODS-2 does not allow becomes an underscore. A name
+// that is already there gets the next version, and directories that already
+// exist are merged into. Every directory touched is rewritten once at the end,
+// and everything goes out in a single flush. Space for the whole tree is found
+// before anything is written, so an import that does not fit changes nothing,
+// and neither does one that fails part way, or that writes more than 1 GiB,
+// which is all held in memory until that flush.
+int ImportTree(Filesystem &fs, const std::string &hostdir, const ImportOptions &options,
+               ImportResult *result = nullptr);
+
+} // namespace ods2
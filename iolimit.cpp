@@ -0,0 +1,31 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "iolimit.h"
+
+#include <algorithm>
+
+#include "stats.h"
+
+IoLimiter::IoLimiter(size_t max_inflight) : max_inflight_(std::max<size_t>(max_inflight, 1)) {}
+
+void IoLimiter::Acquire() {
+    std::unique_lock guard(lock_);
+    if (inflight_ >= max_inflight_) {
+        stats::Scope probe(stats::Op::IO_THROTTLE);
+        cv_.wait(guard, [this]() { return inflight_ < max_inflight_; });
+    }
+    inflight_++;
+}
+
+void IoLimiter::Release(uint64_t bytes) {
+    bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    reads_.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard guard(lock_);
+        inflight_--;
+    }
+    cv_.notify_one();
+}
@@ -0,0 +1,38 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Caps the reads in flight against one underlying device, shared by every
+// Disk opened on it, so many volumes on the same spindle or array do not
+// bury it in requests. Also counts what has been read through it.
+class IoLimiter {
+  public:
+    explicit IoLimiter(size_t max_inflight);
+
+    // Wait for a free slot
+    void Acquire();
+    void Release(uint64_t bytes);
+
+    uint64_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+    uint64_t reads() const { return reads_.load(std::memory_order_relaxed); }
+
+  private:
+    IoLimiter(const IoLimiter &) = delete;
+    IoLimiter &operator=(const IoLimiter &) = delete;
+
+    const size_t max_inflight_;
+    std::mutex lock_;
+    std::condition_variable cv_;
+    size_t inflight_ = 0;
+    std::atomic<uint64_t> bytes_ = 0;
+    std::atomic<uint64_t> reads_ = 0;
+};
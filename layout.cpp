@@ -0,0 +1,167 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "layout.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "utils.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+void EncodeMapPointer(std::vector<uint16_t> &map, uint32_t lbn, uint32_t count) {
+    const uint32_t n = count - 1;
+    if (n < 0x100 && lbn < 0x400000) {
+        map.push_back((1 << 14) | ((lbn >> 8) & 0x3f00) | n);
+        map.push_back(lbn & 0xffff);
+    } else if (n < 0x4000) {
+        map.push_back((2 << 14) | n);
+        map.push_back(lbn & 0xffff);
+        map.push_back(lbn >> 16);
+    } else {
+        map.push_back((3 << 14) | (n >> 16));
+        map.push_back(n & 0xffff);
+        map.push_back(lbn & 0xffff);
+        map.push_back(lbn >> 16);
+    }
+}
+
+int BuildHeader(Disk::Block *blk, const HeaderInfo &info) {
+    blk->buf.fill(0);
+    auto *fh = (file_header *)blk->buf.data();
+
+    fh->id_offset = sizeof(file_header) / 2;
+    fh->map_area_offset = (sizeof(file_header) + sizeof(file_ident)) / 2;
+    fh->acl_offset = 255;
+    fh->rsvd_offset = 255;
+    fh->struclev = 0x0201;
+    fh->fid = info.fid;
+    fh->ext_fid = file_id(0, 0, 0);
+
+    auto &fat = fh->file_rec_attributes;
+    fat.rtype = 1; // fixed length records
+    fat.rsize = 512;
+    fat.set_hiblk(info.alloc_blocks);
+    fat.set_efblk(info.bytes / 512 + 1);
+    fat.ffbyte = info.bytes % 512;
+    if (info.filechar & file_char_directory) {
+        fat.versions = 0x7fff;
+    }
+
+    fh->filechar = info.filechar;
+    fh->fileowner = 0x00010001; // [1,1]
+    fh->fileprot = 0xfa00;      // S:RWED,O:RWED,G:RE,W:
+    fh->backlink = info.backlink;
+
+    auto *fi = (file_ident *)(blk->buf.data() + fh->id_offset * 2);
+    char namebuf[20 + 66 + 1];
+    int len = snprintf(namebuf, sizeof(namebuf), "%s;%u", info.name.c_str(), info.version);
+    len = std::min<int>(len, sizeof(namebuf) - 1);
+    memset(fi->filename, ' ', sizeof(fi->filename));
+    memset(fi->filenamext, ' ', sizeof(fi->filenamext));
+    memcpy(fi->filename, namebuf, std::min<size_t>(len, sizeof(fi->filename)));
+    if ((size_t)len > sizeof(fi->filename)) {
+        memcpy(fi->filenamext, namebuf + sizeof(fi->filename), len - sizeof(fi->filename));
+    }
+    fi->revision = 1;
+    fi->credate = info.date;
+    fi->revdate = info.date;
+
+    if (SetHeaderMap(blk, info.runs) < 0) {
+        return -1;
+    }
+    fat.set_hiblk(info.alloc_blocks);
+
+    set_block_checksum(blk->buf.data());
+    return 0;
+}
+
+int SetHeaderMap(Disk::Block *blk, const std::vector<LbnRun> &runs) {
+    auto *fh = (file_header *)blk->buf.data();
+
+    std::vector<uint16_t> map;
+    uint32_t blocks = 0;
+    for (auto &r : runs) {
+        EncodeMapPointer(map, r.lbn, r.count);
+        blocks += r.count;
+    }
+    const uint32_t room = fh->acl_offset - fh->map_area_offset;
+    if (map.size() > std::min(room, map_area_words)) {
+        return -1;
+    }
+
+    auto *area = blk->buf.data() + fh->map_area_offset * 2;
+    memset(area, 0, fh->map_inuse * 2);
+    if (!map.empty()) {
+        memcpy(area, map.data(), map.size() * 2);
+    }
+    fh->map_inuse = map.size();
+    fh->file_rec_attributes.set_hiblk(blocks);
+    return 0;
+}
+
+void SortDirRecords(std::vector<DirRecord> &records) {
+    std::sort(records.begin(), records.end(), [](const DirRecord &a, const DirRecord &b) {
+        if (a.name != b.name) {
+            return a.name < b.name;
+        }
+        return a.version > b.version;
+    });
+}
+
+std::vector<Disk::Block> BuildDirectoryBlocks(const std::vector<DirRecord> &records) {
+    std::vector<Disk::Block> blocks(1);
+    size_t pos = 0;
+
+    auto *blk = &blocks.back();
+    blk->buf.fill(0);
+    for (size_t i = 0; i < records.size();) {
+        const auto &name = records[i].name;
+
+        // count the versions of this name that will fit in one record
+        size_t nv = 0;
+        while (i + nv < records.size() && records[i + nv].name == name) {
+            nv++;
+        }
+        const size_t fixed = sizeof(dir_header) + ROUNDUP(name.size(), 2);
+        nv = std::min(nv, (512 - 2 - fixed) / sizeof(dir_version_fid));
+        const size_t reclen = fixed + nv * sizeof(dir_version_fid);
+
+        if (pos + reclen + 2 > 512) {
+            // terminate this block and start a new one
+            uint16_t end = 0xffff;
+            memcpy(blk->buf.data() + pos, &end, 2);
+            blocks.emplace_back();
+            blk = &blocks.back();
+            blk->buf.fill(0);
+            pos = 0;
+        }
+
+        dir_header dh{};
+        dh.record_byte_count = reclen - 2;
+        dh.version_limit = 0x7fff;
+        dh.name_byte_count = name.size();
+        memcpy(blk->buf.data() + pos, &dh, sizeof(dh));
+        memcpy(blk->buf.data() + pos + sizeof(dh), name.data(), name.size());
+        pos += fixed;
+        for (size_t v = 0; v < nv; v++) {
+            dir_version_fid dv;
+            dv.version = records[i + v].version;
+            dv.id = records[i + v].fid;
+            memcpy(blk->buf.data() + pos, &dv, sizeof(dv));
+            pos += sizeof(dv);
+        }
+        i += nv;
+    }
+    uint16_t end = 0xffff;
+    memcpy(blk->buf.data() + pos, &end, 2);
+
+    return blocks;
+}
+
+} // namespace ods2
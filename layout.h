@@ -0,0 +1,63 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "disk.h"
+#include "ods2.h"
+
+// Builders for the on disk structures that are written rather than read,
+// shared by the volume generator and the importer.
+namespace ods2 {
+
+struct LbnRun {
+    uint32_t lbn;
+    uint32_t count;
+};
+
+// Words available for retrieval pointers in a header laid out by BuildHeader
+const uint32_t map_area_words = 255 - 100;
+
+// Append a retrieval pointer in the smallest format that holds it
+void EncodeMapPointer(std::vector<uint16_t> &map, uint32_t lbn, uint32_t count);
+
+struct HeaderInfo {
+    file_id fid;
+    file_id backlink;
+    std::string name; // NAME.EXT, no version
+    uint16_t version = 1;
+    uint32_t filechar = 0;
+    uint64_t bytes = 0; // logical length of the file
+    uint32_t alloc_blocks = 0;
+    uint64_t date = 0;
+    std::vector<LbnRun> runs;
+};
+
+// Fill in a primary file header, checksum included. Fails if the runs do not
+// fit in the map area.
+int BuildHeader(Disk::Block *blk, const HeaderInfo &info);
+
+// Replace the map area of an existing header and update hiblk to match,
+// leaving the checksum to the caller
+int SetHeaderMap(Disk::Block *blk, const std::vector<LbnRun> &runs);
+
+struct DirRecord {
+    std::string name; // NAME.EXT
+    uint16_t version;
+    file_id fid;
+};
+
+// Names ascending, and the versions of a name descending, as directories
+// are kept
+void SortDirRecords(std::vector<DirRecord> &records);
+
+// Pack sorted directory records into as many blocks as they need
+std::vector<Disk::Block> BuildDirectoryBlocks(const std::vector<DirRecord> &records);
+
+} // namespace ods2
@@ -0,0 +1,188 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "lz.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#define LOCAL_TRACE 0
+
+namespace {
+
+const size_t min_match = 4;
+const size_t max_offset = 65535;
+const int hash_bits = 14;
+
+uint32_t Load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t HashOf(uint32_t v) { return (v * 2654435761u) >> (32 - hash_bits); }
+
+uint8_t *PutLength(uint8_t *op, size_t n) {
+    for (; n >= 255; n -= 255) {
+        *op++ = 255;
+    }
+    *op++ = n;
+    return op;
+}
+
+// Append a sequence, a match length of 0 making it the last one. Returns
+// nullptr if it does not fit.
+uint8_t *PutSequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, size_t count,
+                     size_t offset, size_t match) {
+    const size_t worst = 1 + count / 255 + 1 + count + 2 + match / 255 + 1;
+    if ((size_t)(oend - op) < worst) {
+        return nullptr;
+    }
+
+    const size_t match_code = match ? match - min_match : 0;
+    *op++ = std::min<size_t>(count, 15) << 4 | std::min<size_t>(match_code, 15);
+    if (count >= 15) {
+        op = PutLength(op, count - 15);
+    }
+    memcpy(op, literals, count);
+    op += count;
+    if (match) {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        if (match_code >= 15) {
+            op = PutLength(op, match_code - 15);
+        }
+    }
+    return op;
+}
+
+// Add up a length continued past 15, failing if the input runs out
+bool GetLength(const uint8_t *&ip, const uint8_t *iend, size_t *n) {
+    uint8_t b;
+    do {
+        if (ip == iend) {
+            return false;
+        }
+        b = *ip++;
+        *n += b;
+    } while (b == 255);
+    return true;
+}
+
+} // namespace
+
+size_t LzBound(size_t len) { return len + len / 255 + 16; }
+
+size_t LzCompress(const void *src_, size_t len, void *dst_, size_t cap) {
+    const auto *src = (const uint8_t *)src_;
+    auto *op = (uint8_t *)dst_;
+    const uint8_t *oend = op + cap;
+
+    // last position seen for each hash of 4 bytes, plus one so 0 is empty
+    std::array<uint32_t, 1 << hash_bits> table{};
+
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t misses = 0;
+    while (len >= min_match && ip <= len - min_match) {
+        const uint32_t seq = Load32(src + ip);
+        const uint32_t h = HashOf(seq);
+        size_t ref = table[h];
+        table[h] = ip + 1;
+        if (ref == 0 || ip - (ref - 1) > max_offset || Load32(src + ref - 1) != seq) {
+            // step faster through data that is not compressing
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+        ref--;
+
+        // grow the match backwards into the pending literals, then forwards
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            ip--;
+            ref--;
+        }
+        size_t match = min_match;
+        while (ip + match < len && src[ref + match] == src[ip + match]) {
+            match++;
+        }
+
+        op = PutSequence(op, oend, src + anchor, ip - anchor, ip - ref, match);
+        if (!op) {
+            return 0;
+        }
+        ip += match;
+        anchor = ip;
+
+        // so a long repeat keeps matching from its own tail
+        if (ip - 2 <= len - min_match) {
+            table[HashOf(Load32(src + ip - 2))] = ip - 2 + 1;
+        }
+    }
+
+    op = PutSequence(op, oend, src + anchor, len - anchor, 0, 0);
+    if (!op) {
+        return 0;
+    }
+    return op - (uint8_t *)dst_;
+}
+
+int LzDecompress(const void *src, size_t len, void *dst, size_t dst_len) {
+    const auto *ip = (const uint8_t *)src;
+    const uint8_t *iend = ip + len;
+    auto *op = (uint8_t *)dst;
+    const uint8_t *oend = op + dst_len;
+
+    for (;;) {
+        if (ip == iend) {
+            return -1;
+        }
+        const uint8_t token = *ip++;
+
+        size_t count = token >> 4;
+        if (count == 15 && !GetLength(ip, iend, &count)) {
+            return -1;
+        }
+        if (count > (size_t)(iend - ip) || count > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, count);
+        ip += count;
+        op += count;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        const size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match = token & 0xf;
+        if (match == 15 && !GetLength(ip, iend, &match)) {
+            return -1;
+        }
+        match += min_match;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst) ||
+            match > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        // an offset shorter than the match repeats the bytes just written,
+        // which are copied from the start of the pattern in steps that double
+        // as more of it is filled in
+        const uint8_t *from = op - offset;
+        while (match > 0) {
+            const size_t n = std::min<size_t>(match, op - from);
+            memcpy(op, from, n);
+            op += n;
+            match -= n;
+        }
+    }
+
+    return op == oend ? 0 : -1;
+}
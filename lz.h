@@ -0,0 +1,28 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstddef>
+
+// Small byte oriented LZ77 codec in the spirit of LZ4, fast enough to sit
+// under every read of a compressed image. Each block stands alone.
+//
+// A block is a run of sequences. Each starts with a token byte holding the
+// number of literals in the high nibble and the match length less 4 in the
+// low nibble, where 15 is followed by bytes to add until one is not 255.
+// Then come the literals and a 16 bit little endian offset back to the
+// match. The last sequence stops after its literals.
+
+// Most bytes compressing len bytes can take
+size_t LzBound(size_t len);
+
+// Compress len bytes into dst, returning the compressed size, or 0 if it does
+// not fit in cap bytes
+size_t LzCompress(const void *src, size_t len, void *dst, size_t cap);
+
+// Decompress a block that must expand to exactly dst_len bytes. Fails on
+// anything malformed rather than reading or writing out of bounds.
+int LzDecompress(const void *src, size_t len, void *dst, size_t dst_len);
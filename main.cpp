@@ -4,9 +4,26 @@
 // license that can be found in the LICENSE file or at
 // https://opensource.org/licenses/MIT
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <string>
+#include <vector>
 
+#include "batch.h"
+#include "catalog.h"
+#include "chunked.h"
+#include "diff.h"
+#include "export.h"
+#include "extract.h"
 #include "filesystem.h"
+#include "import.h"
+#include "manifest.h"
+#include "server.h"
+#include "shell.h"
+#include "sparse.h"
+#include "stats.h"
+#include "volgen.h"
+#include "walk.h"
 
 // Test disk image in the root of the project
 const std::string diskfile = "ods2.disk";
@@ -35,10 +52,42 @@ int recurse_directory(std::shared_ptr<ods2::File> dir, std::string leading_path,
     return 0;
 }
 
-int main(int, char **) {
+namespace {
+
+// How every volume in this invocation is opened, set by --direct or --buffered
+Disk::IoMode io_mode = Disk::IoMode::AUTO;
+
+void usage() {
+    fprintf(stderr, "usage: files11 [--stats] [--trace file] [--direct|--buffered] <command>\n");
+    fprintf(stderr, "       files11 [image]\n");
+    fprintf(stderr, "       files11 diff [-j threads] [-v] <image a> <image b>\n");
+    fprintf(stderr, "       files11 manifest [-j threads] [--index] [-o file] <image>\n");
+    fprintf(stderr, "       files11 catalog [--top n] <image>\n");
+    fprintf(stderr, "       files11 export [--csv] [--qd depth] [-o file] <image>\n");
+    fprintf(stderr, "       files11 extract [-j threads] [--qd depth] <image> <directory>\n");
+    fprintf(stderr, "       files11 sparse [-o copy] <image>\n");
+    fprintf(stderr, "       files11 compress [-j threads] [--chunk-kb n] <image> <output>\n");
+    fprintf(stderr, "       files11 compress -d [-j threads] <compressed image> <output>\n");
+    fprintf(stderr, "       files11 write [--offset n] <image> <spec> <host file>\n");
+    fprintf(stderr, "       files11 import [--into dir] <image> <host directory>\n");
+    fprintf(stderr, "       files11 batch [--job catalog|hash|extract] [-o dir] [-j threads]\n");
+    fprintf(stderr, "                     [--images n] [--device-qd n] [--cache-mb n]\n");
+    fprintf(stderr, "                     [--max-rss-mb n] [--progress secs] [--from list]\n");
+    fprintf(stderr, "                     <image>...\n");
+    fprintf(stderr, "       files11 serve [--socket path] [-j threads] [--cache-mb n]\n");
+    fprintf(stderr, "                     <image>...\n");
+    fprintf(stderr, "       files11 query [--socket path] [request]\n");
+    fprintf(stderr, "       files11 shell [--cache-mb n] <image>\n");
+    fprintf(stderr, "       files11 mkvol [--files n] [--fanout n] [--depth n] [--versions n]\n");
+    fprintf(stderr, "                     [--min-blocks n] [--max-blocks n] [--extents n]\n");
+    fprintf(stderr, "                     [--cluster n] [--spare-headers n] [--free-blocks n]\n");
+    fprintf(stderr, "                     [--max-files n] [--set n] [--seed n] <image>\n");
+}
+
+int walk_command(const std::string &image) {
     ods2::Filesystem fs;
 
-    if (fs.Mount(diskfile) < 0) {
+    if (fs.Mount(image, io_mode) < 0) {
         fprintf(stderr, "Failed to mount volume\n");
         return 1;
     }
@@ -51,4 +100,602 @@ int main(int, char **) {
     recurse_directory(root_dir, "000000.DIR", 0);
 
     return 0;
-}
\ No newline at end of file
+}
+
+int diff_command(const std::vector<std::string> &args) {
+    ods2::DiffOptions options;
+    std::vector<std::string> images;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "-j" && i + 1 < args.size()) {
+            options.threads = strtoul(args[++i].c_str(), nullptr, 0);
+        } else if (args[i] == "-v") {
+            options.verbose = true;
+        } else {
+            images.push_back(args[i]);
+        }
+    }
+    if (images.size() != 2) {
+        usage();
+        return 1;
+    }
+
+    ods2::Filesystem a;
+    ods2::Filesystem b;
+    if (a.Mount(images[0], io_mode) < 0 || b.Mount(images[1], io_mode) < 0) {
+        fprintf(stderr, "Failed to mount volume\n");
+        return 1;
+    }
+
+    return ods2::DiffVolumes(a, b, options) < 0 ? 1 : 0;
+}
+
+int manifest_command(const std::vector<std::string> &args) {
+    ods2::ManifestOptions options;
+    std::string image;
+    std::string output;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "-j" && i + 1 < args.size()) {
+            options.threads = strtoul(args[++i].c_str(), nullptr, 0);
+        } else if (args[i] == "-o" && i + 1 < args.size()) {
+            output = args[++i];
+        } else if (args[i] == "--index") {
+            options.use_index = true;
+        } else {
+            image = args[i];
+        }
+    }
+    if (image.empty()) {
+        usage();
+        return 1;
+    }
+
+    ods2::Filesystem fs;
+    if (fs.Mount(image, io_mode) < 0) {
+        fprintf(stderr, "Failed to mount volume\n");
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (!output.empty()) {
+        out = fopen(output.c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "error opening '%s'\n", output.c_str());
+            return 1;
+        }
+    }
+    int err = ods2::WriteManifest(fs, out, options);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return err < 0 ? 1 : 0;
+}
+
+int export_command(const std::vector<std::string> &args) {
+    ods2::ExportOptions options;
+    std::string image;
+    std::string output;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--csv") {
+            options.format = ods2::ExportFormat::CSV;
+        } else if (args[i] == "--qd" && i + 1 < args.size()) {
+            options.queue_depth = strtoul(args[++i].c_str(), nullptr, 0);
+        } else if (args[i] == "-o" && i + 1 < args.size()) {
+            output = args[++i];
+        } else {
+            image = args[i];
+        }
+    }
+    if (image.empty()) {
+        usage();
+        return 1;
+    }
+
+    ods2::Filesystem fs;
+    if (fs.Mount(image, io_mode) < 0) {
+        fprintf(stderr, "Failed to mount volume\n");
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (!output.empty()) {
+        out = fopen(output.c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "error opening '%s'\n", output.c_str());
+            return 1;
+        }
+    }
+    int err = ods2::ExportVolume(fs, out, options);
+    if (out != stdout && fclose(out) != 0) {
+        err = -1;
+    }
+
+    return err < 0 ? 1 : 0;
+}
+
+int catalog_command(const std::vector<std::string> &args) {
+    size_t top = 10;
+    std::string image;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--top" && i + 1 < args.size()) {
+            top = strtoul(args[++i].c_str(), nullptr, 0);
+        } else {
+            image = args[i];
+        }
+    }
+    if (image.empty()) {
+        usage();
+        return 1;
+    }
+
+    ods2::Filesystem fs;
+    if (fs.Mount(image, io_mode) < 0) {
+        fprintf(stderr, "Failed to mount volume\n");
+        return 1;
+    }
+
+    ods2::Catalog catalog;
+    if (catalog.Build(fs) < 0) {
+        fprintf(stderr, "error building catalog\n");
+        return 1;
+    }
+    ods2::PrintCatalogSummary(catalog, top);
+
+    return 0;
+}
+
+int extract_command(const std::vector<std::string> &args) {
+    ods2::ExtractOptions options;
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "-j" && i + 1 < args.size()) {
+            options.threads = strtoul(args[++i].c_str(), nullptr, 0);
+        } else if (args[i] == "--qd" && i + 1 < args.size()) {
+            options.queue_depth = strtoul(args[++i].c_str(), nullptr, 0);
+        } else {
+            paths.push_back(args[i]);
+        }
+    }
+    if (paths.size() != 2) {
+        usage();
+        return 1;
+    }
+
+    ods2::Filesystem fs;
+    if (fs.Mount(paths[0], io_mode) < 0) {
+        fprintf(stderr, "Failed to mount volume\n");
+        return 1;
+    }
+
+    return ods2::ExtractVolume(fs, paths[1], options) < 0 ? 1 : 0;
+}
+
+int write_command(const std::vector<std::string> &args) {
+    uint64_t offset = 0;
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--offset" && i + 1 < args.size()) {
+            offset = strtoull(args[++i].c_str(), nullptr, 0);
+        } else {
+            paths.push_back(args[i]);
+        }
+    }
+    if (paths.size() != 3) {
+        usage();
+        return 1;
+    }
+
+    FILE *in = fopen(paths[2].c_str(), "rb");
+    if (!in) {
+        fprintf(stderr, "error opening '%s'\n", paths[2].c_str());
+        return 1;
+    }
+
+    ods2::Filesystem fs;
+    if (fs.Mount(paths[0], io_mode, true) < 0) {
+        fprintf(stderr, "Failed to mount volume\n");
+        fclose(in);
+        return 1;
+    }
+
+    auto f = ods2::LookupSpec(fs, paths[1]);
+    if (!f || f->is_dir()) {
+        fprintf(stderr, "file '%s' not found\n", paths[1].c_str());
+        fclose(in);
+        return 1;
+    }
+
+    // the writes collect in the block cache and go out in one flush
+    std::vector<uint8_t> buf(1024 * 1024);
+    uint64_t written = 0;
+    int err = 0;
+    size_t n;
+    while (err == 0 && (n = fread(buf.data(), 1, buf.size(), in)) > 0) {
+        err = f->Write(offset + written, buf.data(), n);
+        written += n;
+    }
+    fclose(in);
+
+    if (err < 0 || fs.Flush() < 0) {
+        fprintf(stderr, "error writing '%s'\n", paths[1].c_str());
+        return 1;
+    }
+    printf("wrote %llu bytes to %s at offset %llu\n", (unsigned long long)written,
+           paths[1].c_str(), (unsigned long long)offset);
+
+    return 0;
+}
+
+int import_command(const std::vector<std::string> &args) {
+    ods2::ImportOptions options;
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--into" && i + 1 < args.size()) {
+            options.into = args[++i];
+        } else {
+            paths.push_back(args[i]);
+        }
+    }
+    if (paths.size() != 2) {
+        usage();
+        return 1;
+    }
+
+    ods2::Filesystem fs;
+    if (fs.Mount(paths[0], io_mode, true) < 0) {
+        fprintf(stderr, "Failed to mount volume\n");
+        return 1;
+    }
+
+    return ods2::ImportTree(fs, paths[1], options) < 0 ? 1 : 0;
+}
+
+int batch_command(const std::vector<std::string> &args) {
+    ods2::BatchOptions options;
+    options.io_mode = io_mode;
+    std::vector<std::string> images;
+    for (size_t i = 0; i < args.size(); i++) {
+        const bool has_value = i + 1 < args.size();
+        if (args[i] == "--job" && has_value) {
+            const auto &job = args[++i];
+            if (job == "catalog") {
+                options.job = ods2::BatchJob::CATALOG;
+            } else if (job == "hash") {
+                options.job = ods2::BatchJob::HASH;
+            } else if (job == "extract") {
+                options.job = ods2::BatchJob::EXTRACT;
+            } else {
+                usage();
+                return 1;
+            }
+        } else if (args[i] == "-o" && has_value) {
+            options.outdir = args[++i];
+        } else if (args[i] == "-j" && has_value) {
+            options.threads = strtoul(args[++i].c_str(), nullptr, 0);
+        } else if (args[i] == "--images" && has_value) {
+            options.max_images = strtoul(args[++i].c_str(), nullptr, 0);
+        } else if (args[i] == "--device-qd" && has_value) {
+            options.device_queue_depth = strtoul(args[++i].c_str(), nullptr, 0);
+        } else if (args[i] == "--cache-mb" && has_value) {
+            options.cache_bytes = strtoull(args[++i].c_str(), nullptr, 0) * 1024 * 1024;
+        } else if (args[i] == "--max-rss-mb" && has_value) {
+            options.max_rss_bytes = strtoull(args[++i].c_str(), nullptr, 0) * 1024 * 1024;
+        } else if (args[i] == "--progress" && has_value) {
+            options.progress_interval = strtoul(args[++i].c_str(), nullptr, 0);
+        } else if (args[i] == "--from" && has_value) {
+            // one image per line
+            FILE *fp = fopen(args[++i].c_str(), "r");
+            if (!fp) {
+                fprintf(stderr, "error opening '%s'\n", args[i].c_str());
+                return 1;
+            }
+            char line[4096];
+            while (fgets(line, sizeof(line), fp)) {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0]) {
+                    images.push_back(line);
+                }
+            }
+            fclose(fp);
+        } else {
+            images.push_back(args[i]);
+        }
+    }
+    if (images.empty()) {
+        usage();
+        return 1;
+    }
+
+    return ods2::RunBatch(images, options) < 0 ? 1 : 0;
+}
+
+int serve_command(const std::vector<std::string> &args) {
+    ods2::ServeOptions options;
+    options.io_mode = io_mode;
+    std::vector<std::string> images;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--socket" && i + 1 < args.size()) {
+            options.socket_path = args[++i];
+        } else if (args[i] == "-j" && i + 1 < args.size()) {
+            options.threads = strtoul(args[++i].c_str(), nullptr, 0);
+        } else if (args[i] == "--cache-mb" && i + 1 < args.size()) {
+            options.read_cache_bytes = strtoull(args[++i].c_str(), nullptr, 0) * 1024 * 1024;
+        } else {
+            images.push_back(args[i]);
+        }
+    }
+    if (images.empty()) {
+        usage();
+        return 1;
+    }
+
+    return ods2::Serve(images, options) < 0 ? 1 : 0;
+}
+
+int shell_command(const std::vector<std::string> &args) {
+    ods2::ShellOptions options;
+    options.io_mode = io_mode;
+    std::string image;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--cache-mb" && i + 1 < args.size()) {
+            options.read_cache_bytes = strtoull(args[++i].c_str(), nullptr, 0) * 1024 * 1024;
+        } else if (image.empty()) {
+            image = args[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (image.empty()) {
+        usage();
+        return 1;
+    }
+
+    return ods2::RunShell(image, options) < 0 ? 1 : 0;
+}
+
+// Send the request on the command line, or each line of stdin in turn, and
+// copy the replies to stdout
+int query_command(const std::vector<std::string> &args) {
+    std::string socket_path = ods2::default_socket_path;
+    std::string request;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--socket" && i + 1 < args.size()) {
+            socket_path = args[++i];
+        } else {
+            request += (request.empty() ? "" : " ") + args[i];
+        }
+    }
+
+    ods2::QueryClient client;
+    if (client.Connect(socket_path) < 0) {
+        fprintf(stderr, "error connecting to '%s'\n", socket_path.c_str());
+        return 1;
+    }
+
+    int ret = 0;
+    auto send = [&](const std::string &line) {
+        std::string payload;
+        if (client.Request(line, &payload) < 0) {
+            fprintf(stderr, "%s: %s\n", line.c_str(), payload.c_str());
+            ret = 1;
+            return;
+        }
+        fwrite(payload.data(), 1, payload.size(), stdout);
+    };
+
+    if (!request.empty()) {
+        send(request);
+        return ret;
+    }
+    char *line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, stdin)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        if (line[0]) {
+            send(line);
+        }
+    }
+    free(line);
+
+    return ret;
+}
+
+int sparse_command(const std::vector<std::string> &args) {
+    std::string image;
+    std::string copy;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "-o" && i + 1 < args.size()) {
+            copy = args[++i];
+        } else if (image.empty()) {
+            image = args[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (image.empty()) {
+        usage();
+        return 1;
+    }
+
+    ods2::Filesystem fs;
+    if (fs.Mount(image, io_mode) < 0) {
+        fprintf(stderr, "Failed to mount volume\n");
+        return 1;
+    }
+
+    ods2::SparseReport report;
+    int err = ods2::CheckSparse(fs, copy, &report);
+    ods2::PrintSparseReport(stdout, report);
+
+    return err < 0 ? 1 : 0;
+}
+
+int compress_command(const std::vector<std::string> &args) {
+    CompressOptions options;
+    bool expand = false;
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "-j" && i + 1 < args.size()) {
+            options.threads = strtoul(args[++i].c_str(), nullptr, 0);
+        } else if (args[i] == "--chunk-kb" && i + 1 < args.size()) {
+            options.chunk_bytes = strtoul(args[++i].c_str(), nullptr, 0) * 1024;
+        } else if (args[i] == "-d") {
+            expand = true;
+        } else {
+            paths.push_back(args[i]);
+        }
+    }
+    if (paths.size() != 2) {
+        usage();
+        return 1;
+    }
+
+    Disk disk;
+    if (disk.open(paths[0], io_mode) < 0) {
+        fprintf(stderr, "error opening '%s'\n", paths[0].c_str());
+        return 1;
+    }
+
+    if (expand) {
+        return ExpandImage(disk, paths[1], options.threads) < 0 ? 1 : 0;
+    }
+
+    CompressResult result;
+    if (CompressImage(disk, paths[1], options, &result) < 0) {
+        return 1;
+    }
+    PrintCompressResult(stdout, result);
+    return 0;
+}
+
+int mkvol_command(const std::vector<std::string> &args) {
+    ods2::VolumeParams params;
+    std::string image;
+    for (size_t i = 0; i < args.size(); i++) {
+        const bool has_value = i + 1 < args.size();
+        const auto value = has_value ? strtoull(args[i + 1].c_str(), nullptr, 0) : 0;
+        if (args[i] == "--files" && has_value) {
+            params.files = value;
+        } else if (args[i] == "--fanout" && has_value) {
+            params.fanout = value;
+        } else if (args[i] == "--depth" && has_value) {
+            params.depth = value;
+        } else if (args[i] == "--versions" && has_value) {
+            params.versions = value;
+        } else if (args[i] == "--min-blocks" && has_value) {
+            params.min_blocks = value;
+        } else if (args[i] == "--max-blocks" && has_value) {
+            params.max_blocks = value;
+        } else if (args[i] == "--extents" && has_value) {
+            params.extents = value;
+        } else if (args[i] == "--cluster" && has_value) {
+            params.cluster = value;
+        } else if (args[i] == "--spare-headers" && has_value) {
+            params.spare_headers = value;
+        } else if (args[i] == "--max-files" && has_value) {
+            params.max_files = value;
+        } else if (args[i] == "--free-blocks" && has_value) {
+            params.free_blocks = value;
+        } else if (args[i] == "--set" && has_value) {
+            params.volumes = value;
+        } else if (args[i] == "--seed" && has_value) {
+            params.seed = value;
+        } else {
+            image = args[i];
+            continue;
+        }
+        i++;
+    }
+    if (image.empty()) {
+        usage();
+        return 1;
+    }
+
+    return ods2::GenerateVolume(image, params) < 0 ? 1 : 0;
+}
+
+int run_command(std::vector<std::string> args) {
+    if (args.empty()) {
+        return walk_command(diskfile);
+    }
+
+    const auto command = args[0];
+    args.erase(args.begin());
+    if (command == "diff") {
+        return diff_command(args);
+    } else if (command == "manifest") {
+        return manifest_command(args);
+    } else if (command == "catalog") {
+        return catalog_command(args);
+    } else if (command == "extract") {
+        return extract_command(args);
+    } else if (command == "sparse") {
+        return sparse_command(args);
+    } else if (command == "compress") {
+        return compress_command(args);
+    } else if (command == "write") {
+        return write_command(args);
+    } else if (command == "export") {
+        return export_command(args);
+    } else if (command == "import") {
+        return import_command(args);
+    } else if (command == "batch") {
+        return batch_command(args);
+    } else if (command == "serve") {
+        return serve_command(args);
+    } else if (command == "query") {
+        return query_command(args);
+    } else if (command == "shell") {
+        return shell_command(args);
+    } else if (command == "mkvol") {
+        return mkvol_command(args);
+    } else if (command == "-h" || command == "--help") {
+        usage();
+        return 0;
+    }
+
+    return walk_command(command);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+
+    // global options come before the command
+    bool print_stats = false;
+    std::string trace_file;
+    while (!args.empty()) {
+        if (args[0] == "--stats") {
+            print_stats = true;
+            stats::Enable();
+        } else if (args[0] == "--direct") {
+            io_mode = Disk::IoMode::DIRECT;
+        } else if (args[0] == "--buffered") {
+            io_mode = Disk::IoMode::BUFFERED;
+        } else if (args[0] == "--trace" && args.size() > 1) {
+            trace_file = args[1];
+            stats::EnableTrace();
+            args.erase(args.begin());
+        } else {
+            break;
+        }
+        args.erase(args.begin());
+    }
+
+    int ret = run_command(args);
+
+    if (print_stats) {
+        stats::PrintSummary(stderr);
+    }
+    if (!trace_file.empty()) {
+        stats::DumpTrace(trace_file);
+    }
+
+    return ret;
+}
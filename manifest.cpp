@@ -0,0 +1,220 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "manifest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "filesystem.h"
+#include "hash.h"
+#include "sha256.h"
+#include "threadpool.h"
+#include "walk.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+// Size of each read while hashing file contents
+const uint32_t hash_chunk_blocks = 2048;
+
+// Only the file id is kept, and the header read again when the file is
+// hashed, so a volume with millions of files does not hold all their headers
+struct ManifestEntry {
+    std::string spec;
+    file_id fid;
+    uint64_t size;
+    Sha256::Digest sha256{};
+    uint64_t xxh64 = 0;
+    int err = 0;
+};
+
+// Headers by file number and volume, as file numbers are only unique within a
+// member of a volume set
+uint64_t HeaderKey(const file_id &id) { return (uint64_t)id.rv_num << 32 | id.file_num(); }
+
+// The directory a header links back to, on the same volume as the header when
+// the backlink has no relative volume number
+file_id Backlink(const File &f) {
+    file_id backlink = f.header().backlink;
+    if (backlink.rv_num == 0) {
+        backlink.rv_num = f.id().rv_num;
+    }
+    return backlink;
+}
+
+// All a directory header contributes to the specs of the files below it
+struct DirLink {
+    std::string name; // NAME of NAME.DIR;1
+    file_id backlink;
+};
+
+// Rebuilds directory specs from header backlinks, for files found by scanning
+// the index file rather than by walking the directories.
+class BacklinkResolver {
+  public:
+    BacklinkResolver(const std::unordered_map<uint64_t, DirLink> &dirs, uint16_t root_rvn)
+        : dirs_(dirs), root_rvn_(root_rvn) {}
+
+    // Spec of a file named NAME.EXT;VERSION linking back to a directory
+    std::string Spec(const file_id &backlink, const std::string &name) {
+        return "[" + DirSpec(backlink, 0) + "]" + name;
+    }
+
+  private:
+    std::string DirSpec(const file_id &id, int depth) {
+        if (id.file_num() == (uint32_t)reserved_files::MFD && id.rv_num == root_rvn_) {
+            return "000000";
+        }
+        auto cached = specs_.find(HeaderKey(id));
+        if (cached != specs_.end()) {
+            return cached->second;
+        }
+        auto it = dirs_.find(HeaderKey(id));
+        if (it == dirs_.end() || depth > 64) {
+            return "?";
+        }
+
+        const auto &dir = it->second;
+        const auto &parent = dir.backlink;
+        auto spec = parent.file_num() == (uint32_t)reserved_files::MFD && parent.rv_num == root_rvn_
+                        ? dir.name
+                        : DirSpec(parent, depth + 1) + "." + dir.name;
+        specs_.emplace(HeaderKey(id), spec);
+        return spec;
+    }
+
+    const std::unordered_map<uint64_t, DirLink> &dirs_;
+    const uint16_t root_rvn_;
+    std::unordered_map<uint64_t, std::string> specs_;
+};
+
+} // namespace
+
+int WriteManifest(const Filesystem &fs, FILE *out, const ManifestOptions &options) {
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<ManifestEntry> entries;
+    if (options.use_index) {
+        // every member of a bound volume set has an index file of its own.
+        // An entry holds just the file name until every directory is in, and
+        // only what the specs need is kept from each header.
+        std::unordered_map<uint64_t, DirLink> dirs;
+        std::vector<file_id> backlinks;
+        const size_t members = fs.volume_count();
+        for (size_t rvn = 1; rvn <= members; rvn++) {
+            const Filesystem *vol = members > 1 ? fs.volume(rvn) : &fs;
+            if (ScanIndexFile(*vol, [&](const std::shared_ptr<File> &f) {
+                    const auto backlink = Backlink(*f);
+                    auto name = f->ident().name();
+                    if (f->is_dir()) {
+                        name = name.substr(0, name.find('.'));
+                        dirs.emplace(HeaderKey(f->id()), DirLink{std::move(name), backlink});
+                        return;
+                    }
+
+                    // the reserved files of the other members link back to
+                    // their own MFD, which is not in the directory tree of
+                    // the set, so leave them out as the walk does
+                    if (backlink.file_num() == (uint32_t)reserved_files::MFD &&
+                        backlink.rv_num != fs.rvn()) {
+                        return;
+                    }
+                    entries.push_back({std::move(name), f->id(), f->size_bytes()});
+                    backlinks.push_back(backlink);
+                }) < 0) {
+                return -1;
+            }
+        }
+
+        BacklinkResolver resolver(dirs, fs.rvn());
+        for (size_t i = 0; i < entries.size(); i++) {
+            entries[i].spec = resolver.Spec(backlinks[i], entries[i].spec);
+        }
+    } else {
+        if (WalkVolume(fs, [&](const std::string &spec, const DirEntry &,
+                               const std::shared_ptr<File> &f) {
+                if (!f->is_dir()) {
+                    entries.push_back({spec, f->id(), f->size_bytes()});
+                }
+            }) < 0) {
+            return -1;
+        }
+    }
+
+    LTRACEF("%zu files to hash\n", entries.size());
+
+    // schedule the largest files first, which keeps the pool evenly loaded
+    std::vector<ManifestEntry *> order;
+    for (auto &e : entries) {
+        order.push_back(&e);
+    }
+    std::sort(order.begin(), order.end(), [](const ManifestEntry *a, const ManifestEntry *b) {
+        return a->size > b->size;
+    });
+
+    std::atomic<uint64_t> bytes_hashed = 0;
+    {
+        std::unique_ptr<ThreadPool> own_pool;
+        if (!options.pool) {
+            own_pool = std::make_unique<ThreadPool>(options.threads);
+        }
+        TaskGroup group(options.pool ? *options.pool : *own_pool);
+        for (auto *e : order) {
+            group.Submit([e, &fs, &bytes_hashed]() {
+                File f(fs);
+                if (f.Open(e->fid) < 0) {
+                    e->err = -1;
+                    return;
+                }
+                Sha256 sha;
+                Hash64 xxh;
+                e->err = f.ReadContents(hash_chunk_blocks, [&](const uint8_t *data,
+                                                                     size_t len) {
+                    sha.Update(data, len);
+                    xxh.Update(data, len);
+                    bytes_hashed += len;
+                });
+                e->sha256 = sha.Final();
+                e->xxh64 = xxh.Final();
+            });
+        }
+        group.Wait();
+    }
+
+    std::sort(entries.begin(), entries.end(),
+              [](const ManifestEntry &a, const ManifestEntry &b) { return a.spec < b.spec; });
+
+    size_t errors = 0;
+    fprintf(out, "# spec fid bytes sha256 xxh64\n");
+    for (auto &e : entries) {
+        if (e.err < 0) {
+            fprintf(stderr, "error reading '%s'\n", e.spec.c_str());
+            errors++;
+            continue;
+        }
+        fprintf(out, "%s %s %llu %s %016llx\n", e.spec.c_str(), e.fid.id_str().c_str(),
+                (unsigned long long)e.size, Sha256::ToString(e.sha256).c_str(),
+                (unsigned long long)e.xxh64);
+    }
+
+    if (!options.quiet) {
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fprintf(stderr, "%zu files, %.1f MiB hashed in %.3f seconds (%.1f MiB/s)\n",
+                entries.size(), bytes_hashed / (1024.0 * 1024.0), elapsed.count(),
+                bytes_hashed / (1024.0 * 1024.0) / elapsed.count());
+    }
+
+    return errors ? -1 : 0;
+}
+
+} // namespace ods2
@@ -0,0 +1,34 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+
+class ThreadPool;
+
+namespace ods2 {
+
+class Filesystem;
+
+struct ManifestOptions {
+    size_t threads = 0;     // hashing threads, 0 picks the hardware concurrency
+    bool use_index = false; // enumerate through the index file instead of the directories
+    bool quiet = false;     // skip the summary line
+
+    // Hash on this shared pool instead of one of its own
+    ThreadPool *pool = nullptr;
+};
+
+// Write a manifest line for every non directory file on the volume, sorted by
+// file spec:
+//   [DIR]NAME.EXT;VERSION file,seq,rvn bytes sha256 xxh64
+//
+// Files are hashed on a thread pool, largest first, so a single huge file is
+// started early instead of being left to run alone at the end.
+int WriteManifest(const Filesystem &fs, FILE *out, const ManifestOptions &options);
+
+} // namespace ods2
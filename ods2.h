@@ -4,6 +4,8 @@
 // license that can be found in the LICENSE file or at
 // https://opensource.org/licenses/MIT
 #pragma once
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
@@ -12,6 +14,30 @@
 // structures in the ODS2 filesystem
 namespace ods2 {
 
+// The ubiquitous additive checksum over the first n words of a block
+inline uint16_t block_checksum(const void *block, size_t words) {
+    const uint16_t *w = (const uint16_t *)block;
+    uint16_t sum = 0;
+    for (size_t i = 0; i < words; i++) {
+        sum += w[i];
+    }
+    return sum;
+}
+
+// Checksum of the first 255 words, stored in the last word of the block
+inline void set_block_checksum(void *block) {
+    ((uint16_t *)block)[255] = block_checksum(block, 255);
+}
+
+// VMS times count 100ns units from 17-Nov-1858, this many seconds before the unix epoch
+const uint64_t vms_unix_epoch_offset = 3506716800ULL;
+
+inline uint64_t vms_time_now() {
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    return vms_unix_epoch_offset * 10000000ULL +
+           std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() / 100;
+}
+
 struct home_block {
     uint32_t homelbn;   // this LBN
     uint32_t alhomelbn; // alternate home LBN
@@ -75,6 +101,31 @@ struct home_block {
 
 static_assert(sizeof(home_block) == 512);
 
+inline void set_home_block_checksums(home_block *hb) {
+    hb->checksum1 = block_checksum(hb, offsetof(home_block, checksum1) / 2);
+    hb->checksum2 = block_checksum(hb, offsetof(home_block, checksum2) / 2);
+}
+
+// Virtual block 1 of the storage bitmap file
+struct storage_control_block {
+    uint16_t struclev;
+    uint16_t cluster;
+    uint32_t volsize;
+    uint32_t blksize;
+    uint32_t sectors;
+    uint32_t tracks;
+    uint32_t cylinder;
+    uint32_t status;
+    uint32_t status2;
+    uint16_t writecnt;
+    uint8_t volockname[12];
+    uint64_t mounttime;
+    uint8_t pad[512 - 56];
+    uint16_t checksum;
+} __attribute__((packed));
+
+static_assert(sizeof(storage_control_block) == 512);
+
 enum class reserved_files {
     INDEX = 1,
     BITMAP = 2,
@@ -117,7 +168,7 @@ struct file_id {
         puts("");
     }
 
-    bool operator==(const file_id &id) {
+    bool operator==(const file_id &id) const {
         return low_num == id.low_num && sequence_num == id.sequence_num && rv_num == id.rv_num &&
                high_num == id.high_num;
     }
@@ -143,6 +194,8 @@ struct file_record_attribute {
     // swizzle the PDP11 order (16 bit values reversed)
     uint32_t hiblk() const { return ((_hiblk >> 16) & 0xffff) | ((_hiblk << 16) & 0xffff0000); }
     uint32_t efblk() const { return ((_efblk >> 16) & 0xffff) | ((_efblk << 16) & 0xffff0000); }
+    void set_hiblk(uint32_t v) { _hiblk = ((v >> 16) & 0xffff) | ((v << 16) & 0xffff0000); }
+    void set_efblk(uint32_t v) { _efblk = ((v >> 16) & 0xffff) | ((v << 16) & 0xffff0000); }
 
     void dump() const {
         printf("\trtype %#x\n", rtype);
@@ -0,0 +1,135 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "outbuf.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// "00" through "99", so integers are converted two digits at a time
+constexpr struct DigitPairs {
+    char c[200];
+    constexpr DigitPairs() : c() {
+        for (int i = 0; i < 100; i++) {
+            c[i * 2] = '0' + i / 10;
+            c[i * 2 + 1] = '0' + i % 10;
+        }
+    }
+} digit_pairs;
+
+} // namespace
+
+OutputBuffer::OutputBuffer(FILE *out, size_t capacity)
+    : out_(out), capacity_(capacity), buf_(new char[capacity]) {}
+
+OutputBuffer::~OutputBuffer() { Flush(); }
+
+void OutputBuffer::Drain() {
+    if (pos_ > 0 && fwrite(buf_.get(), 1, pos_, out_) != pos_) {
+        failed_ = true;
+    }
+    written_ += pos_;
+    pos_ = 0;
+}
+
+int OutputBuffer::Flush() {
+    Drain();
+    if (fflush(out_) != 0) {
+        failed_ = true;
+    }
+    return failed_ ? -1 : 0;
+}
+
+void OutputBuffer::Put(std::string_view s) {
+    while (!s.empty()) {
+        Reserve(1);
+        const size_t n = std::min(s.size(), capacity_ - pos_);
+        memcpy(buf_.get() + pos_, s.data(), n);
+        pos_ += n;
+        s.remove_prefix(n);
+    }
+}
+
+void OutputBuffer::PutUint(uint64_t v, int width) {
+    // fill in from the right of a scratch buffer big enough for any uint64_t
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    while (v >= 100) {
+        const auto pair = (v % 100) * 2;
+        v /= 100;
+        *--p = digit_pairs.c[pair + 1];
+        *--p = digit_pairs.c[pair];
+    }
+    if (v >= 10) {
+        *--p = digit_pairs.c[v * 2 + 1];
+        *--p = digit_pairs.c[v * 2];
+    } else {
+        *--p = '0' + v;
+    }
+    while (tmp + sizeof(tmp) - p < width && p > tmp) {
+        *--p = '0';
+    }
+
+    const size_t n = tmp + sizeof(tmp) - p;
+    Reserve(n);
+    memcpy(buf_.get() + pos_, p, n);
+    pos_ += n;
+}
+
+void OutputBuffer::PutOctal(uint64_t v) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    do {
+        *--p = '0' + (v & 7);
+        v >>= 3;
+    } while (v);
+
+    const size_t n = tmp + sizeof(tmp) - p;
+    Reserve(n);
+    memcpy(buf_.get() + pos_, p, n);
+    pos_ += n;
+}
+
+void OutputBuffer::PutJsonString(std::string_view s) {
+    static const char hex[] = "0123456789abcdef";
+
+    Put('"');
+    for (const char c : s) {
+        // worst case is a six character \u escape
+        Reserve(6);
+        if (c == '"' || c == '\\') {
+            buf_[pos_++] = '\\';
+            buf_[pos_++] = c;
+        } else if ((unsigned char)c < 0x20 || (unsigned char)c >= 0x80) {
+            // names on the volume are 8 bit, taken as Latin-1 so the output is
+            // valid UTF-8 whatever they hold
+            memcpy(buf_.get() + pos_, "\\u00", 4);
+            buf_[pos_ + 4] = hex[((unsigned char)c >> 4) & 0xf];
+            buf_[pos_ + 5] = hex[c & 0xf];
+            pos_ += 6;
+        } else {
+            buf_[pos_++] = c;
+        }
+    }
+    Put('"');
+}
+
+void OutputBuffer::PutCsvField(std::string_view s) {
+    if (s.find_first_of(",\"\r\n") == std::string_view::npos) {
+        Put(s);
+        return;
+    }
+
+    Put('"');
+    for (const char c : s) {
+        if (c == '"') {
+            Put('"');
+        }
+        Put(c);
+    }
+    Put('"');
+}
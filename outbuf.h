@@ -0,0 +1,61 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string_view>
+
+// Text output for streaming out large numbers of records. Fields are
+// formatted straight into one fixed buffer, which goes out in a single write
+// whenever it fills, so there is no allocation and no printf per field.
+class OutputBuffer {
+  public:
+    explicit OutputBuffer(FILE *out, size_t capacity = 256 * 1024);
+    ~OutputBuffer();
+
+    // Write out what is buffered. Fails if any write so far has failed.
+    int Flush();
+
+    void Put(char c) {
+        Reserve(1);
+        buf_[pos_++] = c;
+    }
+    void Put(std::string_view s);
+
+    // Decimal, optionally zero padded to width digits
+    void PutUint(uint64_t v, int width = 0);
+    void PutOctal(uint64_t v);
+
+    // Quoted, with quotes, backslashes, control characters and bytes from 0x80
+    // up escaped
+    void PutJsonString(std::string_view s);
+
+    // Quoted only if it holds a comma, quote or line break
+    void PutCsvField(std::string_view s);
+
+    uint64_t bytes() const { return written_ + pos_; }
+
+  private:
+    OutputBuffer(const OutputBuffer &) = delete;
+    OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+    void Reserve(size_t n) {
+        if (capacity_ - pos_ < n) {
+            Drain();
+        }
+    }
+    void Drain();
+
+    FILE *out_;
+    const size_t capacity_;
+    std::unique_ptr<char[]> buf_;
+    size_t pos_ = 0;
+    uint64_t written_ = 0;
+    bool failed_ = false;
+};
@@ -0,0 +1,176 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "readcache.h"
+
+#include <algorithm>
+#include <cstring>
+
+bool CacheBudget::Charge(size_t bytes) {
+    size_t used = used_.load();
+    do {
+        if (used + bytes > limit_) {
+            return false;
+        }
+    } while (!used_.compare_exchange_weak(used, used + bytes));
+    return true;
+}
+
+void CacheBudget::set_limit(size_t limit) {
+    limit_ = limit;
+
+    // take a chunk from each cache in turn until back within the limit
+    std::lock_guard guard(lock_);
+    bool evicted = true;
+    while (used_ > limit_ && evicted) {
+        evicted = false;
+        for (auto *cache : caches_) {
+            evicted |= cache->EvictNext();
+        }
+    }
+}
+
+void CacheBudget::Add(ReadCache *cache) {
+    std::lock_guard guard(lock_);
+    caches_.push_back(cache);
+}
+
+void CacheBudget::Remove(ReadCache *cache) {
+    std::lock_guard guard(lock_);
+    caches_.erase(std::find(caches_.begin(), caches_.end(), cache));
+}
+
+ReadCache::ReadCache(size_t capacity_bytes, std::shared_ptr<CacheBudget> budget)
+    : shard_capacity_(std::max(capacity_bytes / num_shards, chunk_bytes)),
+      shard_missed_(std::max<size_t>(shard_capacity_ / chunk_bytes, 64)),
+      budget_(std::move(budget)) {
+    if (budget_) {
+        budget_->Add(this);
+    }
+}
+
+ReadCache::~ReadCache() {
+    if (budget_) {
+        budget_->Remove(this);
+        budget_->Release(bytes());
+    }
+}
+
+void ReadCache::Evict(Shard &shard) {
+    auto &victim = shard.lru.back();
+    shard.bytes -= victim.data.size();
+    if (budget_) {
+        budget_->Release(victim.data.size());
+    }
+    shard.map.erase(victim.chunk);
+    shard.lru.pop_back();
+}
+
+bool ReadCache::EvictNext() {
+    for (size_t i = 0; i < num_shards; i++) {
+        auto &shard = shards_[next_victim_++ % num_shards];
+        std::lock_guard guard(shard.lock);
+        if (!shard.lru.empty()) {
+            Evict(shard);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ReadCache::Lookup(uint64_t chunk, size_t skip, void *buf, size_t len) {
+    auto &shard = ShardOf(chunk);
+    std::lock_guard guard(shard.lock);
+
+    auto it = shard.map.find(chunk);
+    if (it == shard.map.end() || skip + len > it->second->data.size()) {
+        return false;
+    }
+    memcpy(buf, it->second->data.data() + skip, len);
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return true;
+}
+
+bool ReadCache::Contains(uint64_t chunk) const {
+    auto &shard = ShardOf(chunk);
+    std::lock_guard guard(shard.lock);
+    return shard.map.count(chunk) != 0;
+}
+
+bool ReadCache::Admit(uint64_t chunk) {
+    auto &shard = ShardOf(chunk);
+    std::lock_guard guard(shard.lock);
+
+    auto it = shard.missed.find(chunk);
+    if (it != shard.missed.end()) {
+        shard.missed_order.erase(it->second);
+        shard.missed.erase(it);
+        return true;
+    }
+    shard.missed_order.push_back(chunk);
+    shard.missed[chunk] = std::prev(shard.missed_order.end());
+    while (shard.missed_order.size() > shard_missed_) {
+        shard.missed.erase(shard.missed_order.front());
+        shard.missed_order.pop_front();
+    }
+    return false;
+}
+
+void ReadCache::Insert(uint64_t chunk, const void *data, size_t len) {
+    auto &shard = ShardOf(chunk);
+    std::lock_guard guard(shard.lock);
+
+    // another reader may have got here first
+    if (shard.map.count(chunk)) {
+        return;
+    }
+
+    // make room within the shared budget at the expense of this shard, or
+    // leave the chunk out if that is not enough
+    while (budget_ && !budget_->Charge(len)) {
+        if (shard.lru.empty()) {
+            return;
+        }
+        Evict(shard);
+    }
+
+    const auto *p = (const uint8_t *)data;
+    shard.lru.push_front({chunk, std::vector<uint8_t>(p, p + len)});
+    shard.map[chunk] = shard.lru.begin();
+    shard.bytes += len;
+
+    while (shard.bytes > shard_capacity_ && shard.lru.size() > 1) {
+        Evict(shard);
+    }
+}
+
+void ReadCache::Invalidate(uint64_t offset, uint64_t len) {
+    if (len == 0) {
+        return;
+    }
+    for (uint64_t chunk = offset / chunk_bytes; chunk <= (offset + len - 1) / chunk_bytes;
+         chunk++) {
+        auto &shard = ShardOf(chunk);
+        std::lock_guard guard(shard.lock);
+        auto it = shard.map.find(chunk);
+        if (it != shard.map.end()) {
+            shard.bytes -= it->second->data.size();
+            if (budget_) {
+                budget_->Release(it->second->data.size());
+            }
+            shard.lru.erase(it->second);
+            shard.map.erase(it);
+        }
+    }
+}
+
+size_t ReadCache::bytes() const {
+    size_t total = 0;
+    for (auto &shard : shards_) {
+        std::lock_guard guard(shard.lock);
+        total += shard.bytes;
+    }
+    return total;
+}
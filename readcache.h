@@ -0,0 +1,121 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class ReadCache;
+
+// Memory shared by several caches. Each keeps within its own capacity and
+// also evicts its own chunks to make room for new ones whenever they would
+// take the total over the limit. The limit can be changed at any time, and
+// lowering it trims the caches down to it straight away.
+class CacheBudget {
+  public:
+    explicit CacheBudget(size_t limit) : limit_(limit) {}
+
+    bool Charge(size_t bytes);
+    void Release(size_t bytes) { used_ -= bytes; }
+
+    size_t used() const { return used_; }
+    size_t limit() const { return limit_; }
+    void set_limit(size_t limit);
+
+  private:
+    friend class ReadCache;
+
+    // Caches sharing the budget, which add and remove themselves
+    void Add(ReadCache *cache);
+    void Remove(ReadCache *cache);
+
+    std::atomic<size_t> used_ = 0;
+    std::atomic<size_t> limit_;
+    std::mutex lock_; // for caches_
+    std::vector<ReadCache *> caches_;
+};
+
+// Clean copies of recently read regions of a disk, for long running processes
+// where many readers keep going back to the same blocks. The disk is cached in
+// fixed size aligned chunks, split across independently locked shards that
+// each evict their least recently used chunks once over their share of the
+// capacity.
+class ReadCache {
+  public:
+    static constexpr size_t chunk_bytes = 4 * 1024;
+
+    // Larger reads are mostly file contents being streamed through once, and
+    // go around the cache rather than flushing everything else out of it
+    static constexpr size_t max_cached_read = 256 * 1024;
+
+    explicit ReadCache(size_t capacity_bytes, std::shared_ptr<CacheBudget> budget = nullptr);
+    ~ReadCache();
+
+    // Copy len bytes starting skip bytes into a chunk out to buf. Fails if the
+    // chunk is not cached.
+    bool Lookup(uint64_t chunk, size_t skip, void *buf, size_t len);
+    bool Contains(uint64_t chunk) const;
+
+    // Whether a chunk that a read only partly covers is worth reading whole.
+    // Only a chunk that already missed recently is, so small reads of data
+    // that is only read once do not pull in more than was asked for.
+    // Remembers the chunk when it is not.
+    bool Admit(uint64_t chunk);
+
+    // Add a chunk, which is short only at the end of the disk
+    void Insert(uint64_t chunk, const void *data, size_t len);
+
+    // Drop every chunk overlapping the byte range
+    void Invalidate(uint64_t offset, uint64_t len);
+
+    size_t bytes() const;
+
+  private:
+    friend class CacheBudget;
+
+    ReadCache(const ReadCache &) = delete;
+    ReadCache &operator=(const ReadCache &) = delete;
+
+    struct Entry {
+        uint64_t chunk;
+        std::vector<uint8_t> data;
+    };
+    struct Shard {
+        mutable std::mutex lock;
+        std::list<Entry> lru; // most recently used first
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> map;
+        size_t bytes = 0;
+
+        // chunks that missed once, oldest first
+        std::list<uint64_t> missed_order;
+        std::unordered_map<uint64_t, std::list<uint64_t>::iterator> missed;
+    };
+
+    static constexpr size_t num_shards = 16;
+
+    Shard &ShardOf(uint64_t chunk) { return shards_[chunk % num_shards]; }
+    const Shard &ShardOf(uint64_t chunk) const { return shards_[chunk % num_shards]; }
+
+    // Drop the least recently used chunk of a shard
+    void Evict(Shard &shard);
+
+    // Drop the least recently used chunk of the next shard holding any, for
+    // a budget that has been lowered. False if the cache is empty.
+    bool EvictNext();
+
+    const size_t shard_capacity_;
+    const size_t shard_missed_;
+    std::shared_ptr<CacheBudget> budget_;
+    std::array<Shard, num_shards> shards_;
+    std::atomic<size_t> next_victim_ = 0; // shard EvictNext starts at
+};
@@ -0,0 +1,712 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "server.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <set>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "export.h"
+#include "filesystem.h"
+#include "outbuf.h"
+#include "readcache.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "volcache.h"
+#include "walk.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+// Longest READ reply, longer reads are cut short
+const size_t max_read_bytes = 16 * 1024 * 1024;
+
+// Longest request line accepted before the connection is dropped
+const size_t max_request_bytes = 4096;
+
+#ifndef MSG_NOSIGNAL
+// macOS, where sockets get SO_NOSIGPIPE instead
+#define MSG_NOSIGNAL 0
+#endif
+
+// SOCK_CLOEXEC, accept4 and pipe2 are Linux only, so close on exec is set
+// once the descriptor exists. Nothing here forks in between.
+int CloseOnExec(int fd) {
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    }
+    return fd;
+}
+
+// Written to by the signal handler to wake up the poll loop
+std::atomic<int> signal_wake_fd = -1;
+volatile sig_atomic_t signalled = 0;
+
+void OnSignal(int) {
+    signalled = 1;
+    const int fd = signal_wake_fd.load();
+    if (fd >= 0) {
+        [[maybe_unused]] auto n = write(fd, "s", 1);
+    }
+}
+
+struct Volume {
+    explicit Volume(const ServeOptions &options)
+        : cache(fs, options.header_cache_files, options.dir_cache_dirs) {}
+
+    std::string name;
+    Filesystem fs;
+    VolumeCache cache;
+};
+
+// Text built up for a reply with stdio or an OutputBuffer
+class MemStream {
+  public:
+    MemStream() : fp_(open_memstream(&data_, &size_)) {}
+    ~MemStream() {
+        if (fp_) {
+            fclose(fp_);
+        }
+        free(data_);
+    }
+
+    FILE *fp() const { return fp_; }
+    std::string_view view() {
+        fflush(fp_);
+        return {data_, size_};
+    }
+
+  private:
+    MemStream(const MemStream &) = delete;
+    MemStream &operator=(const MemStream &) = delete;
+
+    char *data_ = nullptr;
+    size_t size_ = 0;
+    FILE *fp_;
+};
+
+std::string Ok(std::string_view payload) {
+    std::string reply = "OK " + std::to_string(payload.size()) + "\n";
+    reply.append(payload);
+    return reply;
+}
+
+std::string Err(std::string_view message) {
+    std::string reply = "ERR ";
+    reply.append(message);
+    reply += '\n';
+    return reply;
+}
+
+int SendAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+bool SocketAddress(const std::string &path, sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "socket path '%s' is too long\n", path.c_str());
+        return false;
+    }
+    memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+class Server {
+  public:
+    explicit Server(const ServeOptions &options) : options_(options), pool_(options.threads) {}
+    ~Server();
+
+    int Mount(const std::vector<std::string> &images);
+    int Run();
+
+  private:
+    struct Connection {
+        int fd;
+        std::string in; // received but not yet handled
+        bool busy = false;
+        bool failed = false;
+    };
+
+    int Listen();
+    void Process(Connection *c);
+    std::string Handle(std::string_view line);
+
+    std::string List(Volume &vol, const std::vector<std::string> &args);
+    std::string Stat(Volume &vol, const std::vector<std::string> &args);
+    std::string Open(Volume &vol, const std::vector<std::string> &args);
+    std::string Read(Volume &vol, const std::vector<std::string> &args);
+    std::string Search(Volume &vol, const std::vector<std::string> &args);
+    std::string Stats();
+
+    Volume *FindVolume(const std::string &name);
+    void SearchDir(Volume &vol, const File &dir, const std::string &path,
+                   std::set<uint32_t> &visited, const std::string &pattern, bool full_spec,
+                   OutputBuffer &out);
+
+    const ServeOptions &options_;
+    std::vector<std::unique_ptr<Volume>> volumes_;
+    int listen_fd_ = -1;
+    int wake_[2] = {-1, -1};
+    std::atomic<bool> stop_ = false;
+
+    // connections handed back by the workers
+    std::mutex done_lock_;
+    std::vector<Connection *> done_;
+
+    // last, so the workers are gone before anything they use
+    ThreadPool pool_;
+};
+
+Server::~Server() {
+    pool_.Wait();
+    signal_wake_fd = -1;
+    for (int fd : {listen_fd_, wake_[0], wake_[1]}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (listen_fd_ >= 0) {
+        unlink(options_.socket_path.c_str());
+    }
+}
+
+int Server::Mount(const std::vector<std::string> &images) {
+    for (auto &image : images) {
+        auto vol = std::make_unique<Volume>(options_);
+        // a volume set goes by its first member
+        const auto first = image.substr(0, image.find(','));
+        auto slash = first.rfind('/');
+        vol->name = slash == std::string::npos ? first : first.substr(slash + 1);
+        if (FindVolume(vol->name)) {
+            fprintf(stderr, "more than one volume named '%s'\n", vol->name.c_str());
+            return -1;
+        }
+        vol->fs.SetPool(&pool_);
+        if (vol->fs.Mount(image, options_.io_mode) < 0) {
+            fprintf(stderr, "error mounting '%s'\n", image.c_str());
+            return -1;
+        }
+        vol->fs.EnableReadCache(options_.read_cache_bytes);
+        volumes_.push_back(std::move(vol));
+    }
+    return 0;
+}
+
+int Server::Listen() {
+    sockaddr_un addr;
+    if (!SocketAddress(options_.socket_path, &addr)) {
+        return -1;
+    }
+
+    // clear out the socket of a server that is no longer running
+    struct stat st;
+    if (stat(options_.socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        QueryClient probe;
+        if (probe.Connect(options_.socket_path) == 0) {
+            fprintf(stderr, "a server is already running on '%s'\n",
+                    options_.socket_path.c_str());
+            return -1;
+        }
+        unlink(options_.socket_path.c_str());
+    }
+
+    int fd = CloseOnExec(socket(AF_UNIX, SOCK_STREAM, 0));
+    if (fd < 0) {
+        fprintf(stderr, "error creating socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (const sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        fprintf(stderr, "error listening on '%s': %s\n", options_.socket_path.c_str(),
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+    listen_fd_ = fd;
+
+    if (pipe(wake_) < 0) {
+        fprintf(stderr, "error creating pipe\n");
+        return -1;
+    }
+    for (int fd : wake_) {
+        CloseOnExec(fd);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+    return 0;
+}
+
+int Server::Run() {
+    if (Listen() < 0) {
+        return -1;
+    }
+
+    signal_wake_fd = wake_[1];
+    struct sigaction sa {};
+    sa.sa_handler = OnSignal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    fprintf(stderr, "serving %zu volume%s on '%s' with %zu threads\n", volumes_.size(),
+            volumes_.size() == 1 ? "" : "s", options_.socket_path.c_str(), pool_.size());
+
+    std::list<Connection> conns;
+    std::vector<pollfd> fds;
+    std::vector<Connection *> polled;
+    while (!stop_ && !signalled) {
+        fds.clear();
+        polled.clear();
+        fds.push_back({listen_fd_, POLLIN, 0});
+        fds.push_back({wake_[0], POLLIN, 0});
+        for (auto &c : conns) {
+            if (!c.busy) {
+                fds.push_back({c.fd, POLLIN, 0});
+                polled.push_back(&c);
+            }
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents) {
+            char drain[64];
+            while (read(wake_[0], drain, sizeof(drain)) > 0) {
+            }
+            std::lock_guard guard(done_lock_);
+            for (auto *c : done_) {
+                c->busy = false;
+            }
+            done_.clear();
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = CloseOnExec(accept(listen_fd_, nullptr, nullptr));
+            if (fd >= 0) {
+                conns.push_back({fd, {}});
+            }
+        }
+
+        for (size_t i = 0; i < polled.size(); i++) {
+            auto *c = polled[i];
+            if (!fds[i + 2].revents) {
+                continue;
+            }
+            char buf[64 * 1024];
+            ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                c->failed = true;
+                continue;
+            }
+            c->in.append(buf, n);
+            if (c->in.find('\n') != std::string::npos) {
+                c->busy = true;
+                pool_.Submit([this, c]() { Process(c); });
+            } else if (c->in.size() > max_request_bytes) {
+                SendAll(c->fd, "ERR request too long\n", 21);
+                c->failed = true;
+            }
+        }
+
+        // drop closed connections that are not in the middle of a request
+        for (auto it = conns.begin(); it != conns.end();) {
+            if (it->failed && !it->busy) {
+                close(it->fd);
+                it = conns.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // let the requests in flight finish before the connections go away
+    pool_.Wait();
+    for (auto &c : conns) {
+        close(c.fd);
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    return 0;
+}
+
+// Runs on a worker, handling every complete request line received so far
+void Server::Process(Connection *c) {
+    size_t eol;
+    while (!c->failed && (eol = c->in.find('\n')) != std::string::npos) {
+        std::string_view line(c->in.data(), eol);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        const auto reply = Handle(line);
+        c->in.erase(0, eol + 1);
+        if (SendAll(c->fd, reply.data(), reply.size()) < 0) {
+            c->failed = true;
+        }
+    }
+
+    std::lock_guard guard(done_lock_);
+    done_.push_back(c);
+    [[maybe_unused]] auto n = write(wake_[1], "w", 1);
+}
+
+std::string Server::Handle(std::string_view line) {
+    std::vector<std::string> args;
+    size_t pos = 0;
+    while (pos < line.size()) {
+        const size_t start = line.find_first_not_of(" \t", pos);
+        if (start == std::string_view::npos) {
+            break;
+        }
+        const size_t end = std::min(line.find_first_of(" \t", start), line.size());
+        args.emplace_back(line.substr(start, end - start));
+        pos = end;
+    }
+    if (args.empty()) {
+        return Err("empty request");
+    }
+
+    std::string command = args[0];
+    std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+    if (command == "VOLUMES") {
+        std::string names;
+        for (auto &vol : volumes_) {
+            names += vol->name + "\n";
+        }
+        return Ok(names);
+    } else if (command == "STATS") {
+        return Stats();
+    } else if (command == "SHUTDOWN") {
+        stop_ = true;
+        return Ok({});
+    }
+
+    static const struct {
+        const char *name;
+        std::string (Server::*handler)(Volume &, const std::vector<std::string> &);
+        stats::Op op;
+    } volume_commands[] = {
+        {"LIST", &Server::List, stats::Op::SERVE_LIST},
+        {"STAT", &Server::Stat, stats::Op::SERVE_STAT},
+        {"OPEN", &Server::Open, stats::Op::SERVE_OPEN},
+        {"READ", &Server::Read, stats::Op::SERVE_READ},
+        {"SEARCH", &Server::Search, stats::Op::SERVE_SEARCH},
+    };
+    for (auto &vc : volume_commands) {
+        if (command != vc.name) {
+            continue;
+        }
+        if (args.size() < 2) {
+            return Err("missing volume name");
+        }
+        auto *vol = FindVolume(args[1]);
+        if (!vol) {
+            return Err("no volume named '" + args[1] + "'");
+        }
+
+        stats::Scope probe(vc.op);
+        args.erase(args.begin(), args.begin() + 2);
+        auto reply = (this->*vc.handler)(*vol, args);
+        probe.set_bytes(reply.size());
+        return reply;
+    }
+
+    return Err("unknown request '" + args[0] + "'");
+}
+
+std::string Server::List(Volume &vol, const std::vector<std::string> &args) {
+    SpecParts parts;
+    if (args.size() > 1 || (args.size() == 1 && !ParseSpec(args[0], &parts))) {
+        return Err("usage: LIST <vol> [dir]");
+    }
+    auto dir = args.empty() ? vol.fs.OpenRootDir() : vol.cache.Resolve(args[0]);
+    if (!dir || !dir->is_dir()) {
+        return Err("directory not found");
+    }
+    auto list = vol.cache.Entries(*dir);
+    if (!list) {
+        return Err("error reading directory");
+    }
+
+    // [A.B] from the directory files it was found through
+    std::string prefix = "[";
+    for (auto &d : parts.dirs) {
+        prefix += (prefix.size() > 1 ? "." : "") + DirStem(d);
+    }
+    prefix += prefix.size() > 1 ? "]" : "000000]";
+
+    MemStream ms;
+    {
+        OutputBuffer out(ms.fp());
+        for (auto &e : *list) {
+            auto f = vol.cache.OpenFid(e.fid);
+            if (f) {
+                PutJsonRecord(out, prefix + e.name + ";" + std::to_string(e.version), *f);
+            }
+        }
+    }
+    return Ok(ms.view());
+}
+
+std::string Server::Stat(Volume &vol, const std::vector<std::string> &args) {
+    if (args.size() != 1) {
+        return Err("usage: STAT <vol> <spec>");
+    }
+    auto f = vol.cache.Resolve(args[0]);
+    if (!f) {
+        return Err("file not found");
+    }
+
+    MemStream ms;
+    {
+        OutputBuffer out(ms.fp());
+        PutJsonRecord(out, args[0], *f);
+    }
+    return Ok(ms.view());
+}
+
+std::string Server::Open(Volume &vol, const std::vector<std::string> &args) {
+    if (args.size() != 1) {
+        return Err("usage: OPEN <vol> <spec>");
+    }
+    auto f = vol.cache.Resolve(args[0]);
+    if (!f) {
+        return Err("file not found");
+    }
+    return Ok("(" + f->id().id_str() + ") " + std::to_string(f->size_bytes()) + "\n");
+}
+
+std::string Server::Read(Volume &vol, const std::vector<std::string> &args) {
+    if (args.size() != 3) {
+        return Err("usage: READ <vol> <spec> <offset> <length>");
+    }
+    auto f = vol.cache.Resolve(args[0]);
+    if (!f) {
+        return Err("file not found");
+    }
+
+    const uint64_t offset = strtoull(args[1].c_str(), nullptr, 0);
+    const uint64_t size = f->size_bytes();
+    if (offset >= size) {
+        return Ok({});
+    }
+    const size_t len = std::min<uint64_t>(
+        {strtoull(args[2].c_str(), nullptr, 0), size - offset, max_read_bytes});
+    if (len == 0) {
+        return Ok({});
+    }
+
+    // read the covering blocks, then trim them to the range
+    const uint32_t vbn = offset / 512 + 1;
+    const uint32_t count = (offset + len - 1) / 512 + 2 - vbn;
+    std::string blocks((size_t)count * 512, '\0');
+    if (f->ReadVbns(vbn, count, blocks.data()) < 0) {
+        return Err("read error");
+    }
+    return Ok(std::string_view(blocks).substr(offset % 512, len));
+}
+
+std::string Server::Search(Volume &vol, const std::vector<std::string> &args) {
+    if (args.size() != 1) {
+        return Err("usage: SEARCH <vol> <pattern>");
+    }
+
+    // match every version unless the pattern names one, and only the file
+    // name unless it has a directory part
+    std::string pattern = args[0];
+    std::transform(pattern.begin(), pattern.end(), pattern.begin(), ::toupper);
+    if (pattern.find(';') == std::string::npos) {
+        pattern += ";*";
+    }
+    const bool full_spec = pattern[0] == '[';
+
+    auto root = vol.fs.OpenRootDir();
+    std::set<uint32_t> visited{FileKey(root->id())};
+    MemStream ms;
+    {
+        OutputBuffer out(ms.fp());
+        SearchDir(vol, *root, "000000", visited, pattern, full_spec, out);
+    }
+    return Ok(ms.view());
+}
+
+void Server::SearchDir(Volume &vol, const File &dir, const std::string &path,
+                       std::set<uint32_t> &visited, const std::string &pattern, bool full_spec,
+                       OutputBuffer &out) {
+    auto list = vol.cache.Entries(dir);
+    if (!list) {
+        return;
+    }
+
+    for (auto &e : *list) {
+        const auto name = e.name + ";" + std::to_string(e.version);
+        const auto spec = "[" + path + "]" + name;
+        std::shared_ptr<File> f;
+        if (WildcardMatch(pattern, full_spec ? spec : name)) {
+            f = vol.cache.OpenFid(e.fid);
+            if (f) {
+                PutJsonRecord(out, spec, *f);
+            }
+        }
+
+        // only entries named like directories need their headers to find out
+        const bool dir_name = e.name.size() > 4 && e.name.ends_with(".DIR");
+        if (dir_name && !visited.count(FileKey(e.fid))) {
+            if (!f) {
+                f = vol.cache.OpenFid(e.fid);
+            }
+            if (f && f->is_dir() && visited.insert(FileKey(e.fid)).second) {
+                const auto sub = path == "000000" ? DirStem(e.name) : path + "." + DirStem(e.name);
+                SearchDir(vol, *f, sub, visited, pattern, full_spec, out);
+            }
+        }
+    }
+}
+
+std::string Server::Stats() {
+    MemStream ms;
+    stats::PrintSummary(ms.fp());
+    fprintf(ms.fp(), "\n%-16s %10s\n", "volume", "cache KiB");
+    for (auto &vol : volumes_) {
+        fprintf(ms.fp(), "%-16s %10zu\n", vol->name.c_str(),
+                vol->fs.disk().read_cache()->bytes() / 1024);
+    }
+    return Ok(ms.view());
+}
+
+Volume *Server::FindVolume(const std::string &name) {
+    for (auto &vol : volumes_) {
+        if (vol->name == name) {
+            return vol.get();
+        }
+    }
+    return nullptr;
+}
+
+} // namespace
+
+int Serve(const std::vector<std::string> &images, const ServeOptions &options) {
+    // per request latencies are always kept, for STATS
+    stats::Enable();
+
+    Server server(options);
+    if (server.Mount(images) < 0) {
+        return -1;
+    }
+    return server.Run();
+}
+
+QueryClient::QueryClient() = default;
+
+QueryClient::~QueryClient() {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+int QueryClient::Connect(const std::string &socket_path) {
+    sockaddr_un addr;
+    if (!SocketAddress(socket_path, &addr)) {
+        return -1;
+    }
+    fd_ = CloseOnExec(socket(AF_UNIX, SOCK_STREAM, 0));
+    if (fd_ < 0 || connect(fd_, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int QueryClient::Request(const std::string &request, std::string *payload) {
+    payload->clear();
+    const auto line = request + "\n";
+    if (SendAll(fd_, line.data(), line.size()) < 0) {
+        *payload = "error sending request";
+        return -1;
+    }
+
+    // Fill buf_ until it holds at least want bytes
+    auto fill = [this](size_t want) {
+        char tmp[64 * 1024];
+        while (buf_.size() < want) {
+            ssize_t n = recv(fd_, tmp, sizeof(tmp), 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            buf_.append(tmp, n);
+        }
+        return true;
+    };
+
+    size_t eol;
+    while ((eol = buf_.find('\n')) == std::string::npos) {
+        if (!fill(buf_.size() + 1)) {
+            *payload = "connection closed";
+            return -1;
+        }
+    }
+    const std::string status = buf_.substr(0, eol);
+    buf_.erase(0, eol + 1);
+
+    if (status.starts_with("ERR ")) {
+        *payload = status.substr(4);
+        return -1;
+    }
+    if (!status.starts_with("OK ")) {
+        *payload = "bad reply '" + status + "'";
+        return -1;
+    }
+    const size_t len = strtoull(status.c_str() + 3, nullptr, 10);
+    if (!fill(len)) {
+        *payload = "connection closed";
+        return -1;
+    }
+    payload->assign(buf_, 0, len);
+    buf_.erase(0, len);
+    return 0;
+}
+
+} // namespace ods2
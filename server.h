@@ -0,0 +1,76 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "disk.h"
+
+namespace ods2 {
+
+// Query server. Each image is mounted read only once, and stays mounted with
+// warm caches while clients send requests over a Unix domain socket, one per
+// line:
+//
+//   VOLUMES                          names of the mounted volumes
+//   LIST <vol> [dir]                 a JSON record per entry of a directory,
+//                                    the MFD if none is given
+//   STAT <vol> <spec>                the JSON record of one file
+//   OPEN <vol> <spec>                "(num,seq,rvn) bytes", the file id can
+//                                    stand in for the spec in later requests
+//   READ <vol> <spec> <offset> <len> raw contents, cut short at end of file
+//   SEARCH <vol> <pattern>           JSON records of every file matching a
+//                                    spec with * and % wildcards
+//   STATS                            request latencies and cache counters
+//   SHUTDOWN
+//
+// A volume is named by the file name of its image. Every reply is either
+// "OK <length>\n" followed by length bytes, or "ERR <message>\n". Requests on
+// a connection are answered in order; different connections are served at
+// the same time, all sharing the same caches of file headers, directory
+// contents and disk blocks.
+
+inline const char default_socket_path[] = "files11.sock";
+
+struct ServeOptions {
+    std::string socket_path = default_socket_path;
+    Disk::IoMode io_mode = Disk::IoMode::AUTO;
+
+    // Worker threads handling requests, 0 picks the hardware concurrency
+    size_t threads = 0;
+
+    // Per volume cache sizes
+    size_t read_cache_bytes = 256 * 1024 * 1024;
+    size_t header_cache_files = 64 * 1024;
+    size_t dir_cache_dirs = 4096;
+};
+
+// Serve requests until SHUTDOWN, SIGINT or SIGTERM
+int Serve(const std::vector<std::string> &images, const ServeOptions &options);
+
+// One connection to a server
+class QueryClient {
+  public:
+    QueryClient();
+    ~QueryClient();
+
+    int Connect(const std::string &socket_path);
+
+    // Send a request and wait for the reply. On an ERR reply, returns -1 with
+    // the message in payload.
+    int Request(const std::string &request, std::string *payload);
+
+  private:
+    QueryClient(const QueryClient &) = delete;
+    QueryClient &operator=(const QueryClient &) = delete;
+
+    int fd_ = -1;
+    std::string buf_; // received past the end of the last reply
+};
+
+} // namespace ods2
@@ -0,0 +1,32 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Streaming SHA-256, as specified in FIPS 180-4
+class Sha256 {
+  public:
+    using Digest = std::array<uint8_t, 32>;
+
+    Sha256();
+
+    void Update(const void *data, size_t len);
+    Digest Final();
+
+    static std::string ToString(const Digest &digest);
+
+  private:
+    void Transform(const uint8_t *block);
+
+    std::array<uint32_t, 8> state_;
+    std::array<uint8_t, 64> buf_;
+    size_t buffered_ = 0;
+    uint64_t total_len_ = 0;
+};
@@ -0,0 +1,1082 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "shell.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <set>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+#include "export.h"
+#include "filesystem.h"
+#include "outbuf.h"
+#include "volcache.h"
+#include "walk.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+// Blocks read at a time by type
+const uint32_t type_chunk_blocks = 64;
+
+// Most blocks a single dump prints
+const uint32_t max_dump_blocks = 1024;
+
+// Record formats and attributes, from the file attributes in the header
+const uint8_t rfm_udf = 0;
+const uint8_t rfm_fix = 1;
+const uint8_t rfm_var = 2;
+const uint8_t rfm_vfc = 3;
+const uint8_t rfm_stm = 4;
+const uint8_t rfm_stmlf = 5;
+const uint8_t rfm_stmcr = 6;
+
+const uint8_t rat_ftn = 1 << 0;
+const uint8_t rat_cr = 1 << 1;
+const uint8_t rat_prn = 1 << 2;
+const uint8_t rat_blk = 1 << 3;
+
+std::string Upper(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), ::toupper);
+    return s;
+}
+
+std::string Lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+}
+
+// Terminal input a line at a time, with the cursor keys, history and
+// completion when stdin is a terminal, and plain lines when it is not
+class LineEditor {
+  public:
+    struct Completion {
+        size_t start = 0;                // of the text the candidates replace
+        std::vector<std::string> words;  // candidates
+        bool finished = true;            // a single candidate ends the word
+    };
+    using Completer = std::function<Completion(const std::string &before_cursor)>;
+
+    explicit LineEditor(Completer completer)
+        : completer_(std::move(completer)), tty_(isatty(STDIN_FILENO)) {}
+
+    bool is_tty() const { return tty_; }
+
+    // False at the end of input
+    bool ReadLine(const std::string &prompt, std::string *line);
+
+  private:
+    LineEditor(const LineEditor &) = delete;
+    LineEditor &operator=(const LineEditor &) = delete;
+
+    bool ReadRaw(const std::string &prompt, std::string *line);
+    void Refresh();
+    void Complete();
+
+    Completer completer_;
+    const bool tty_;
+    std::vector<std::string> history_;
+
+    // the line being edited
+    std::string prompt_;
+    std::string buf_;
+    size_t cursor_ = 0;
+};
+
+bool LineEditor::ReadLine(const std::string &prompt, std::string *line) {
+    if (!tty_) {
+        char *raw = nullptr;
+        size_t cap = 0;
+        ssize_t len = getline(&raw, &cap, stdin);
+        if (len < 0) {
+            free(raw);
+            return false;
+        }
+        line->assign(raw, len);
+        free(raw);
+        while (!line->empty() && (line->back() == '\n' || line->back() == '\r')) {
+            line->pop_back();
+        }
+        return true;
+    }
+
+    termios saved;
+    if (tcgetattr(STDIN_FILENO, &saved) < 0) {
+        return false;
+    }
+    termios raw = saved;
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    const bool ok = ReadRaw(prompt, line);
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    if (ok && !line->empty() && (history_.empty() || history_.back() != *line)) {
+        history_.push_back(*line);
+    }
+    return ok;
+}
+
+bool LineEditor::ReadRaw(const std::string &prompt, std::string *line) {
+    prompt_ = prompt;
+    buf_.clear();
+    cursor_ = 0;
+    size_t history_pos = history_.size();
+    std::string pending; // the new line, while going through the history
+
+    Refresh();
+    for (;;) {
+        char c;
+        if (read(STDIN_FILENO, &c, 1) != 1) {
+            return false;
+        }
+
+        switch (c) {
+        case '\r':
+        case '\n':
+            fputs("\n", stdout);
+            *line = buf_;
+            return true;
+        case 3: // ^C drops the line
+            fputs("^C\n", stdout);
+            buf_.clear();
+            cursor_ = 0;
+            break;
+        case 4: // ^D
+            if (buf_.empty()) {
+                fputs("\n", stdout);
+                return false;
+            }
+            if (cursor_ < buf_.size()) {
+                buf_.erase(cursor_, 1);
+            }
+            break;
+        case 1: // ^A
+            cursor_ = 0;
+            break;
+        case 5: // ^E
+            cursor_ = buf_.size();
+            break;
+        case 11: // ^K
+            buf_.resize(cursor_);
+            break;
+        case 21: // ^U
+            buf_.erase(0, cursor_);
+            cursor_ = 0;
+            break;
+        case 8:
+        case 127:
+            if (cursor_ > 0) {
+                buf_.erase(--cursor_, 1);
+            }
+            break;
+        case '\t':
+            Complete();
+            break;
+        case 27: {
+            // cursor keys come as ESC [ x, and delete as ESC [ 3 ~
+            char seq[3];
+            if (read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1) {
+                return false;
+            }
+            if (seq[0] != '[') {
+                break;
+            }
+            if (seq[1] >= '0' && seq[1] <= '9') {
+                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+                    return false;
+                }
+                if (seq[1] == '3' && seq[2] == '~' && cursor_ < buf_.size()) {
+                    buf_.erase(cursor_, 1);
+                }
+                break;
+            }
+            if (seq[1] == 'A' || seq[1] == 'B') {
+                if (history_pos == history_.size()) {
+                    pending = buf_;
+                }
+                if (seq[1] == 'A' && history_pos > 0) {
+                    history_pos--;
+                } else if (seq[1] == 'B' && history_pos < history_.size()) {
+                    history_pos++;
+                }
+                buf_ = history_pos == history_.size() ? pending : history_[history_pos];
+                cursor_ = buf_.size();
+            } else if (seq[1] == 'C' && cursor_ < buf_.size()) {
+                cursor_++;
+            } else if (seq[1] == 'D' && cursor_ > 0) {
+                cursor_--;
+            } else if (seq[1] == 'H') {
+                cursor_ = 0;
+            } else if (seq[1] == 'F') {
+                cursor_ = buf_.size();
+            }
+            break;
+        }
+        default:
+            if (isprint((unsigned char)c)) {
+                buf_.insert(cursor_++, 1, c);
+            }
+            break;
+        }
+        Refresh();
+    }
+}
+
+void LineEditor::Refresh() {
+    std::string out = "\r" + prompt_ + buf_ + "\x1b[K";
+    if (cursor_ < buf_.size()) {
+        out += "\x1b[" + std::to_string(buf_.size() - cursor_) + "D";
+    }
+    fputs(out.c_str(), stdout);
+    fflush(stdout);
+}
+
+void LineEditor::Complete() {
+    auto c = completer_(buf_.substr(0, cursor_));
+    if (c.words.empty()) {
+        fputc('\a', stdout);
+        return;
+    }
+
+    // extend the word by whatever all the candidates have in common
+    std::string common = c.words[0];
+    for (auto &w : c.words) {
+        size_t n = 0;
+        while (n < common.size() && n < w.size() && common[n] == w[n]) {
+            n++;
+        }
+        common.resize(n);
+    }
+    if (c.words.size() == 1 && c.finished) {
+        common += ' ';
+    }
+    if (common.size() > cursor_ - c.start) {
+        buf_.replace(c.start, cursor_ - c.start, common);
+        cursor_ = c.start + common.size();
+        return;
+    }
+    if (c.words.size() == 1) {
+        return;
+    }
+
+    // nothing more to add, so show them all below the line
+    size_t width = 0;
+    for (auto &w : c.words) {
+        width = std::max(width, w.size() + 2);
+    }
+    const size_t columns = std::max<size_t>(80 / width, 1);
+    fputs("\n", stdout);
+    for (size_t i = 0; i < c.words.size(); i++) {
+        const bool last = (i + 1) % columns == 0 || i + 1 == c.words.size();
+        printf("%-*s%s", last ? 0 : (int)width, c.words[i].c_str(), last ? "\n" : "");
+    }
+}
+
+// The words of a command line, with /QUALIFIERS pulled out of them
+struct Args {
+    std::vector<std::string> words;
+    std::vector<std::string> qualifiers; // upper cased, without the slash
+
+    bool has(const char *q) const {
+        return std::find(qualifiers.begin(), qualifiers.end(), q) != qualifiers.end();
+    }
+};
+
+Args SplitArgs(const std::string &line) {
+    Args args;
+    size_t pos = 0;
+    while ((pos = line.find_first_not_of(" \t", pos)) != std::string::npos) {
+        const size_t end = std::min(line.find_first_of(" \t", pos), line.size());
+        const std::string word = line.substr(pos, end - pos);
+        pos = end;
+
+        // specs never hold a slash, so everything after one is a qualifier
+        const size_t slash = word.find('/');
+        if (slash != 0 || word.size() == 1) {
+            args.words.push_back(word.substr(0, slash == 0 ? std::string::npos : slash));
+        }
+        for (size_t q = slash; q != std::string::npos && q + 1 < word.size();) {
+            const size_t next = word.find('/', q + 1);
+            args.qualifiers.push_back(Upper(word.substr(q + 1, next - q - 1)));
+            q = next;
+        }
+    }
+    return args;
+}
+
+// Prints the records of a file as text, one per line when they have
+// carriage control, and the rest of the formats as they are
+class RecordPrinter {
+  public:
+    RecordPrinter(const file_record_attribute &fat, OutputBuffer &out)
+        : format_(fat.rtype & 0xf), rattrib_(fat.rattrib), rsize_(fat.rsize),
+          vfc_(fat.vfcsize ? fat.vfcsize : 2), out_(out) {}
+
+    void Add(const uint8_t *data, size_t len);
+
+    // End the last line, so the prompt starts on one of its own
+    void Finish() {
+        if (!at_line_start_) {
+            out_.Put('\n');
+        }
+    }
+
+  private:
+    void Text(const uint8_t *data, size_t len) {
+        if (len > 0) {
+            out_.Put(std::string_view((const char *)data, len));
+            at_line_start_ = data[len - 1] == '\n';
+        }
+    }
+    void Record(const uint8_t *data, size_t len) {
+        Text(data, len);
+        if (rattrib_ & (rat_cr | rat_ftn | rat_prn)) {
+            out_.Put('\n');
+            at_line_start_ = true;
+        }
+    }
+
+    const uint8_t format_;
+    const uint8_t rattrib_;
+    const uint16_t rsize_;
+    const uint8_t vfc_;
+    OutputBuffer &out_;
+
+    std::string pending_; // the start of a record that continues in the next chunk
+    uint64_t pos_ = 0;    // file offset of pending_
+    bool at_line_start_ = true;
+};
+
+void RecordPrinter::Add(const uint8_t *data, size_t len) {
+    const bool counted = format_ == rfm_var || format_ == rfm_vfc;
+    if (!counted && !(format_ == rfm_fix && rsize_ > 0)) {
+        Text(data, len);
+        return;
+    }
+
+    pending_.append((const char *)data, len);
+    const auto *p = (const uint8_t *)pending_.data();
+    size_t i = 0;
+    while (i < pending_.size()) {
+        size_t count = rsize_;
+        size_t skip = 0;
+        if (counted) {
+            if (pending_.size() - i < 2) {
+                break;
+            }
+            count = p[i] | p[i + 1] << 8;
+            if (count == 0xffff) {
+                // no more records in this block
+                const uint64_t next = ROUNDUP(pos_ + i + 1, 512);
+                if (next > pos_ + pending_.size()) {
+                    break;
+                }
+                i = next - pos_;
+                continue;
+            }
+            skip = 2;
+        }
+        const size_t padded = skip + count + (count & 1);
+        if (pending_.size() - i < skip + count) {
+            break;
+        }
+        // the fixed control area of a VFC record is not part of the text
+        const size_t control = format_ == rfm_vfc ? std::min<size_t>(vfc_, count) : 0;
+        Record(p + i + skip + control, count - control);
+        i = std::min(i + padded, pending_.size());
+    }
+    pending_.erase(0, i);
+    pos_ += i;
+}
+
+const char *FormatName(uint8_t rtype) {
+    switch (rtype & 0xf) {
+    case rfm_udf:
+        return "Undefined";
+    case rfm_fix:
+        return "Fixed length";
+    case rfm_var:
+        return "Variable length";
+    case rfm_vfc:
+        return "VFC";
+    case rfm_stm:
+        return "Stream";
+    case rfm_stmlf:
+        return "Stream_LF";
+    case rfm_stmcr:
+        return "Stream_CR";
+    }
+    return "Unknown";
+}
+
+class Shell {
+  public:
+    explicit Shell(const ShellOptions &options)
+        : options_(options), cache_(fs_, options.header_cache_files, options.dir_cache_dirs),
+          editor_([this](const std::string &line) { return Complete(line); }) {}
+
+    int Mount(const std::string &image);
+    int Run();
+
+  private:
+    // A spec taken apart, with the directories from the MFD down
+    struct Path {
+        std::vector<std::string> dirs; // names without the .DIR
+        std::string name;              // upper cased, with any version
+    };
+
+    // Apply the directory part of a spec to the current directory. Fails if it
+    // is not closed or climbs above the MFD.
+    bool ParsePath(const std::string &spec, Path *path) const;
+    std::shared_ptr<File> OpenDir(const std::vector<std::string> &dirs);
+    std::shared_ptr<File> OpenSpec(const std::string &spec, Path *path = nullptr);
+    static std::string DirSpec(const std::vector<std::string> &dirs);
+
+    // Directories from the MFD down to a file opened by its id, following the
+    // header backlinks. Fails on a broken or looping chain.
+    bool BacklinkDirs(const File &f, std::vector<std::string> *dirs);
+
+    // False to stop
+    bool Execute(const std::string &line);
+
+    void Cd(const Args &args);
+    void Pwd(const Args &args);
+    void Dir(const Args &args);
+    void Type(const Args &args);
+    void Dump(const Args &args);
+    void Find(const Args &args);
+    void Stat(const Args &args);
+    void Help(const Args &args);
+
+    void PutFull(OutputBuffer &out, const std::string &name, const File &f);
+    void FindIn(const File &dir, std::vector<std::string> &dirs, std::set<uint32_t> &visited,
+                const std::string &pattern, bool full_spec, OutputBuffer &out, uint64_t *found);
+
+    LineEditor::Completion Complete(const std::string &line);
+
+    struct Command {
+        const char *name;
+        void (Shell::*handler)(const Args &);
+        const char *usage;
+    };
+    static const Command commands_[];
+
+    const ShellOptions &options_;
+    Filesystem fs_;
+    VolumeCache cache_;
+    LineEditor editor_;
+    std::vector<std::string> cwd_;
+};
+
+const Shell::Command Shell::commands_[] = {
+    {"cd", &Shell::Cd, "cd [dir]"},
+    {"dir", &Shell::Dir, "dir [/FULL] [spec]"},
+    {"dump", &Shell::Dump, "dump [/HEADER|/EXTENTS] <spec> [vbn [count]]"},
+    {"exit", nullptr, "exit"},
+    {"find", &Shell::Find, "find <pattern>"},
+    {"help", &Shell::Help, "help"},
+    {"pwd", &Shell::Pwd, "pwd"},
+    {"stat", &Shell::Stat, "stat <spec>"},
+    {"type", &Shell::Type, "type <spec>"},
+};
+
+int Shell::Mount(const std::string &image) {
+    if (fs_.Mount(image, options_.io_mode) < 0) {
+        return -1;
+    }
+    fs_.EnableReadCache(options_.read_cache_bytes);
+    return 0;
+}
+
+int Shell::Run() {
+    std::string line;
+    for (;;) {
+        fflush(stdout);
+        const auto prompt = editor_.is_tty() ? "files11 " + DirSpec(cwd_) + "> " : "";
+        if (!editor_.ReadLine(prompt, &line) || !Execute(line)) {
+            break;
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+bool Shell::Execute(const std::string &line) {
+    auto args = SplitArgs(line);
+    if (args.words.empty()) {
+        return true;
+    }
+    const auto name = Lower(args.words[0]);
+    args.words.erase(args.words.begin());
+
+    if (name == "exit" || name == "quit") {
+        return false;
+    }
+    for (auto &c : commands_) {
+        if (name == c.name && c.handler) {
+            (this->*c.handler)(args);
+            return true;
+        }
+    }
+    fprintf(stderr, "unknown command '%s', try help\n", name.c_str());
+    return true;
+}
+
+bool Shell::ParsePath(const std::string &spec, Path *path) const {
+    path->dirs = cwd_;
+    path->name.clear();
+    const auto upper = Upper(spec);
+
+    // unix style, for cd
+    if (upper == "..") {
+        if (path->dirs.empty()) {
+            return false;
+        }
+        path->dirs.pop_back();
+        return true;
+    }
+    if (upper == "/") {
+        path->dirs.clear();
+        return true;
+    }
+
+    if (upper.empty() || upper[0] != '[') {
+        path->name = upper;
+        return true;
+    }
+    const auto close = upper.find(']');
+    if (close == std::string::npos) {
+        return false;
+    }
+    path->name = upper.substr(close + 1);
+
+    // [A.B] starts at the MFD, [.A], [-] and [-.A] at the current directory
+    std::string inner = upper.substr(1, close - 1);
+    size_t pos = 0;
+    if (!inner.empty() && inner[0] != '.' && inner[0] != '-') {
+        path->dirs.clear();
+    }
+    for (; pos < inner.size() && inner[pos] == '-'; pos++) {
+        if (path->dirs.empty()) {
+            return false;
+        }
+        path->dirs.pop_back();
+    }
+    while (pos < inner.size()) {
+        const size_t dot = std::min(inner.find('.', pos), inner.size());
+        const auto component = inner.substr(pos, dot - pos);
+        if (component == "-") {
+            if (path->dirs.empty()) {
+                return false;
+            }
+            path->dirs.pop_back();
+        } else if (!component.empty() && component != "000000") {
+            path->dirs.push_back(component);
+        }
+        pos = dot + 1;
+    }
+    return true;
+}
+
+std::shared_ptr<File> Shell::OpenDir(const std::vector<std::string> &dirs) {
+    auto dir = fs_.OpenRootDir();
+    for (auto &d : dirs) {
+        dir = cache_.Find(*dir, d + ".DIR", 0);
+        if (!dir || !dir->is_dir()) {
+            return nullptr;
+        }
+    }
+    return dir;
+}
+
+std::shared_ptr<File> Shell::OpenSpec(const std::string &spec, Path *path) {
+    if (!spec.empty() && spec[0] == '(') {
+        return cache_.Resolve(spec);
+    }
+
+    Path local;
+    if (!path) {
+        path = &local;
+    }
+    if (!ParsePath(spec, path)) {
+        return nullptr;
+    }
+    auto dir = OpenDir(path->dirs);
+    if (!dir || path->name.empty()) {
+        return dir;
+    }
+
+    const auto semi = path->name.find(';');
+    const uint32_t version =
+        semi == std::string::npos ? 0 : strtoul(path->name.c_str() + semi + 1, nullptr, 10);
+    return cache_.Find(*dir, path->name.substr(0, semi), version);
+}
+
+bool Shell::BacklinkDirs(const File &f, std::vector<std::string> *dirs) {
+    dirs->clear();
+    auto link = [](const File &from) {
+        file_id id = from.header().backlink;
+        if (id.rv_num == 0) {
+            id.rv_num = from.id().rv_num;
+        }
+        return id;
+    };
+    for (file_id id = link(f); id.file_num() != (uint32_t)reserved_files::MFD;) {
+        auto dir = cache_.OpenFid(id);
+        if (!dir || !dir->is_dir() || dirs->size() >= 64) {
+            return false;
+        }
+        dirs->insert(dirs->begin(), DirStem(dir->ident().name()));
+        id = link(*dir);
+    }
+    return true;
+}
+
+std::string Shell::DirSpec(const std::vector<std::string> &dirs) {
+    if (dirs.empty()) {
+        return "[000000]";
+    }
+    std::string spec = "[";
+    for (auto &d : dirs) {
+        spec += (spec.size() > 1 ? "." : "") + d;
+    }
+    return spec + "]";
+}
+
+void Shell::Cd(const Args &args) {
+    if (args.words.size() > 1) {
+        fprintf(stderr, "usage: cd [dir]\n");
+        return;
+    }
+
+    // a plain name is a subdirectory
+    auto target = args.words.empty() ? std::string("[000000]") : args.words[0];
+    if (target[0] != '[' && target != ".." && target != "/") {
+        target = "[." + target + "]";
+    }
+
+    Path path;
+    if (!ParsePath(target, &path) || !path.name.empty()) {
+        fprintf(stderr, "bad directory '%s'\n", args.words[0].c_str());
+        return;
+    }
+    if (!OpenDir(path.dirs)) {
+        fprintf(stderr, "directory %s not found\n", DirSpec(path.dirs).c_str());
+        return;
+    }
+    cwd_ = path.dirs;
+}
+
+void Shell::Pwd(const Args &) { printf("%s\n", DirSpec(cwd_).c_str()); }
+
+void Shell::Dir(const Args &args) {
+    Path path;
+    if (args.words.size() > 1 || !ParsePath(args.words.empty() ? "" : args.words[0], &path)) {
+        fprintf(stderr, "usage: dir [/FULL] [spec]\n");
+        return;
+    }
+    auto dir = OpenDir(path.dirs);
+    auto list = dir ? cache_.Entries(*dir) : nullptr;
+    if (!list) {
+        fprintf(stderr, "directory %s not found\n", DirSpec(path.dirs).c_str());
+        return;
+    }
+
+    // every version of everything unless the spec says otherwise
+    std::string pattern = path.name.empty() ? "*" : path.name;
+    if (pattern.find(';') == std::string::npos) {
+        pattern += ";*";
+    }
+
+    const bool full = args.has("FULL");
+    uint64_t files = 0;
+    uint64_t used = 0;
+    uint64_t allocated = 0;
+    OutputBuffer out(stdout);
+    for (auto &e : *list) {
+        const auto name = e.name + ";" + std::to_string(e.version);
+        if (!WildcardMatch(pattern, name)) {
+            continue;
+        }
+        if (files++ == 0) {
+            out.Put("\nDirectory ");
+            out.Put(DirSpec(path.dirs));
+            out.Put("\n\n");
+        }
+        if (!full) {
+            out.Put(name);
+            out.Put('\n');
+            continue;
+        }
+        auto f = cache_.OpenFid(e.fid);
+        if (!f) {
+            out.Put(name);
+            out.Put("  no such file\n\n");
+            continue;
+        }
+        PutFull(out, name, *f);
+        used += f->size_blocks();
+        allocated += f->header().file_rec_attributes.hiblk();
+    }
+
+    if (files == 0) {
+        fprintf(stderr, "no files found\n");
+        return;
+    }
+    out.Put(full ? "Total of " : "\nTotal of ");
+    out.PutUint(files);
+    out.Put(files == 1 ? " file" : " files");
+    if (full) {
+        out.Put(", ");
+        out.PutUint(used);
+        out.Put('/');
+        out.PutUint(allocated);
+        out.Put(" blocks");
+    }
+    out.Put(".\n");
+    out.Flush();
+}
+
+// Laid out after the DIRECTORY/FULL of VMS
+void Shell::PutFull(OutputBuffer &out, const std::string &name, const File &f) {
+    const auto &fh = f.header();
+    const auto &fi = f.ident();
+    const auto &fat = fh.file_rec_attributes;
+    char buf[128];
+
+    snprintf(buf, sizeof(buf), "%-30s File ID:  (", name.c_str());
+    out.Put(buf);
+    PutFid(out, f.id());
+    snprintf(buf, sizeof(buf), ")\nSize:       %8u/%-8u       Owner:    ", f.size_blocks(),
+             fat.hiblk());
+    out.Put(buf);
+    PutUic(out, fh.fileowner);
+
+    const struct {
+        const char *label;
+        uint64_t date;
+        const char *none;
+    } dates[] = {
+        {"\nCreated:    ", fi.credate, "<None specified>"},
+        {"\nRevised:    ", fi.revdate, "<None specified>"},
+        {"\nExpires:    ", fi.expdate, "<None specified>"},
+        {"\nBackup:     ", fi.bakdate, "<No backup recorded>"},
+    };
+    for (auto &d : dates) {
+        out.Put(d.label);
+        if (d.date) {
+            PutVmsTime(out, d.date);
+        } else {
+            out.Put(d.none);
+        }
+        if (d.date && &d == &dates[1]) {
+            out.Put(" (");
+            out.PutUint(fi.revision);
+            out.Put(')');
+        }
+    }
+
+    out.Put("\nRecord format:      ");
+    out.Put(FormatName(fat.rtype));
+    if ((fat.rtype & 0xf) == rfm_fix) {
+        snprintf(buf, sizeof(buf), ", %u byte records", fat.rsize);
+        out.Put(buf);
+    } else if ((fat.rtype & 0xf) == rfm_var || (fat.rtype & 0xf) == rfm_vfc) {
+        snprintf(buf, sizeof(buf), ", maximum %u bytes", fat.rsize);
+        out.Put(buf);
+    }
+    out.Put("\nRecord attributes:  ");
+    if (!(fat.rattrib & (rat_ftn | rat_cr | rat_prn | rat_blk))) {
+        out.Put("None");
+    } else {
+        const char *sep = "";
+        for (auto [bit, text] : {std::pair{rat_ftn, "Fortran carriage control"},
+                                 std::pair{rat_cr, "Carriage return carriage control"},
+                                 std::pair{rat_prn, "Print file carriage control"},
+                                 std::pair{rat_blk, "Non-spanned"}}) {
+            if (fat.rattrib & bit) {
+                out.Put(sep);
+                out.Put(text);
+                sep = ", ";
+            }
+        }
+    }
+    out.Put("\nFile protection:    ");
+    PutProtection(out, fh.fileprot);
+    out.Put("\nCharacteristics:    ");
+    if (fh.filechar) {
+        PutFlags(out, fh.filechar, false);
+    } else {
+        out.Put("None");
+    }
+    out.Put("\nMap:                ");
+    out.PutUint(f.extents().size());
+    out.Put(f.extents().size() == 1 ? " extent\n\n" : " extents\n\n");
+}
+
+void Shell::Type(const Args &args) {
+    if (args.words.size() != 1) {
+        fprintf(stderr, "usage: type <spec>\n");
+        return;
+    }
+    auto f = OpenSpec(args.words[0]);
+    if (!f) {
+        fprintf(stderr, "file '%s' not found\n", args.words[0].c_str());
+        return;
+    }
+    if (f->is_dir()) {
+        fprintf(stderr, "'%s' is a directory\n", args.words[0].c_str());
+        return;
+    }
+
+    OutputBuffer out(stdout);
+    RecordPrinter printer(f->header().file_rec_attributes, out);
+    int err = f->ReadContents(type_chunk_blocks, [&](const uint8_t *data, size_t len) {
+        printer.Add(data, len);
+    });
+    printer.Finish();
+    out.Flush();
+    if (err < 0) {
+        fprintf(stderr, "error reading '%s'\n", args.words[0].c_str());
+    }
+}
+
+void Shell::Dump(const Args &args) {
+    if (args.words.empty() || args.words.size() > 3) {
+        fprintf(stderr, "usage: dump [/HEADER|/EXTENTS] <spec> [vbn [count]]\n");
+        return;
+    }
+    auto f = OpenSpec(args.words[0]);
+    if (!f) {
+        fprintf(stderr, "file '%s' not found\n", args.words[0].c_str());
+        return;
+    }
+
+    if (args.has("HEADER")) {
+        printf("file header (%s)\n", f->id().id_str().c_str());
+        f->header().dump();
+        f->ident().dump();
+        hexdump8_ex(f->header_block().buf.data(), f->header_block().buf.size());
+        return;
+    }
+    if (args.has("EXTENTS")) {
+        const bool set = fs_.volume_count() > 1;
+        for (auto &e : f->extents()) {
+            printf("vbn %8u-%-8u  lbn %8u-%-8u  %8u blocks", e.vbn, e.vbn + e.block_count - 1,
+                   e.lbn, e.lbn + e.block_count - 1, e.block_count);
+            if (set) {
+                printf("  rvn %u", e.rvn);
+            }
+            printf("\n");
+        }
+        printf("%zu extents, %u blocks\n", f->extents().size(), f->AllocatedBlocks());
+        return;
+    }
+
+    const uint32_t vbn = args.words.size() > 1 ? strtoul(args.words[1].c_str(), nullptr, 0) : 1;
+    uint32_t count = args.words.size() > 2 ? strtoul(args.words[2].c_str(), nullptr, 0) : 1;
+    const uint32_t blocks = f->AllocatedBlocks();
+    if (vbn == 0 || vbn > blocks) {
+        fprintf(stderr, "vbn %u is not within the %u allocated blocks\n", vbn, blocks);
+        return;
+    }
+    count = std::min({count, blocks - vbn + 1, max_dump_blocks});
+
+    std::vector<uint8_t> buf((size_t)count * 512);
+    if (f->ReadVbns(vbn, count, buf.data()) < 0) {
+        fprintf(stderr, "error reading vbn %u\n", vbn);
+        return;
+    }
+    hexdump8_ex(buf.data(), buf.size(), (uint64_t)(vbn - 1) * 512);
+}
+
+void Shell::Find(const Args &args) {
+    if (args.words.size() != 1) {
+        fprintf(stderr, "usage: find <pattern>\n");
+        return;
+    }
+
+    // as with SEARCH, only the name is matched unless the pattern has a
+    // directory part
+    auto pattern = Upper(args.words[0]);
+    if (pattern.find(';') == std::string::npos) {
+        pattern += ";*";
+    }
+    auto dir = OpenDir(cwd_);
+    if (!dir) {
+        fprintf(stderr, "directory %s not found\n", DirSpec(cwd_).c_str());
+        return;
+    }
+
+    auto dirs = cwd_;
+    std::set<uint32_t> visited{FileKey(dir->id())};
+    uint64_t found = 0;
+    OutputBuffer out(stdout);
+    FindIn(*dir, dirs, visited, pattern, pattern[0] == '[', out, &found);
+    out.Flush();
+    if (found == 0) {
+        fprintf(stderr, "no files found\n");
+    }
+}
+
+void Shell::FindIn(const File &dir, std::vector<std::string> &dirs, std::set<uint32_t> &visited,
+                   const std::string &pattern, bool full_spec, OutputBuffer &out,
+                   uint64_t *found) {
+    auto list = cache_.Entries(dir);
+    if (!list) {
+        return;
+    }
+
+    const auto path = DirSpec(dirs);
+    for (auto &e : *list) {
+        const auto spec = path + e.name + ";" + std::to_string(e.version);
+        if (WildcardMatch(pattern, full_spec ? spec : spec.substr(path.size()))) {
+            out.Put(spec);
+            out.Put('\n');
+            (*found)++;
+        }
+
+        // only entries named like directories need their headers to find out
+        if (e.name.size() > 4 && e.name.ends_with(".DIR") && !visited.count(FileKey(e.fid))) {
+            auto f = cache_.OpenFid(e.fid);
+            if (f && f->is_dir() && visited.insert(FileKey(f->id())).second) {
+                dirs.push_back(DirStem(e.name));
+                FindIn(*f, dirs, visited, pattern, full_spec, out, found);
+                dirs.pop_back();
+            }
+        }
+    }
+}
+
+void Shell::Stat(const Args &args) {
+    if (args.words.size() != 1) {
+        fprintf(stderr, "usage: stat <spec>\n");
+        return;
+    }
+    Path path;
+    auto f = OpenSpec(args.words[0], &path);
+    if (!f) {
+        fprintf(stderr, "file '%s' not found\n", args.words[0].c_str());
+        return;
+    }
+
+    // report the full spec of what was found, with its version, rather than
+    // what was typed relative to the current directory. A directory is named
+    // in its parent, and a file opened by its id is placed by its backlinks.
+    auto spec = args.words[0];
+    if (spec[0] != '(') {
+        if (path.name.empty() && !path.dirs.empty()) {
+            path.dirs.pop_back();
+        }
+        spec = DirSpec(path.dirs) + f->ident().name();
+    } else if (BacklinkDirs(*f, &path.dirs)) {
+        spec = DirSpec(path.dirs) + f->ident().name();
+    }
+
+    OutputBuffer out(stdout);
+    PutJsonRecord(out, spec, *f);
+    out.Flush();
+}
+
+void Shell::Help(const Args &) {
+    for (auto &c : commands_) {
+        printf("  %s\n", c.usage);
+    }
+    printf("specs: [A.B]NAME.EXT;1 from the MFD, [.SUB] or [-] from here, NAME.EXT in here,\n"
+           "       or (num,seq,rvn); dir and find take * and %% wildcards\n");
+}
+
+LineEditor::Completion Shell::Complete(const std::string &line) {
+    LineEditor::Completion c;
+    c.start = line.find_last_of(" \t");
+    c.start = c.start == std::string::npos ? 0 : c.start + 1;
+    const auto word = line.substr(c.start);
+
+    // the command itself
+    if (line.find_first_not_of(" \t") >= c.start) {
+        for (auto &cmd : commands_) {
+            if (std::string_view(cmd.name).starts_with(Lower(word))) {
+                c.words.push_back(cmd.name);
+            }
+        }
+        return c;
+    }
+    const auto command = Lower(SplitArgs(line).words[0]);
+
+    // a directory within an open [..., otherwise a name in a directory
+    const auto close = word.find(']');
+    const bool in_dirs = word.find('[') == 0 && close == std::string::npos;
+    size_t cut = 0;
+    if (in_dirs) {
+        cut = word.find_last_of("[.") + 1;
+    } else if (close != std::string::npos) {
+        cut = close + 1;
+    }
+    const auto base = word.substr(0, cut);
+    const auto partial = Upper(word.substr(cut));
+    c.start += cut;
+
+    Path path;
+    if (base == "[") {
+        // a bare [ starts at the MFD, unlike the [] it would close to
+        path.dirs.clear();
+    } else if (!ParsePath(in_dirs ? base + "]" : base, &path)) {
+        return c;
+    }
+    auto dir = OpenDir(path.dirs);
+    auto list = dir ? cache_.Entries(*dir) : nullptr;
+    if (!list) {
+        return c;
+    }
+
+    // subdirectories only while naming a directory
+    const bool dirs_only = in_dirs || (command == "cd" && cut == 0);
+    c.finished = !in_dirs;
+    for (auto &e : *list) {
+        if (!e.name.starts_with(partial)) {
+            continue;
+        }
+        const bool is_dir = e.name.size() > 4 && e.name.ends_with(".DIR");
+        if (dirs_only && !is_dir) {
+            continue;
+        }
+        // 000000.DIR in the MFD is the MFD itself
+        if (dirs_only && path.dirs.empty() && e.name == "000000.DIR") {
+            continue;
+        }
+        auto w = dirs_only ? DirStem(e.name) : e.name;
+        if (c.words.empty() || c.words.back() != w) {
+            c.words.push_back(std::move(w));
+        }
+    }
+    return c;
+}
+
+} // namespace
+
+int RunShell(const std::string &image, const ShellOptions &options) {
+    Shell shell(options);
+    if (shell.Mount(image) < 0) {
+        fprintf(stderr, "Failed to mount volume\n");
+        return -1;
+    }
+    return shell.Run();
+}
+
+} // namespace ods2
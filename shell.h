@@ -0,0 +1,48 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "disk.h"
+
+namespace ods2 {
+
+// Interactive shell over a single mount of a volume. Commands are read from
+// the terminal with line editing, history and tab completion of commands,
+// directories and file names, or one per line when stdin is not a terminal:
+//
+//   cd [dir]                         change directory, to the MFD if none
+//   pwd
+//   dir [/FULL] [spec]               list a directory, wildcards allowed
+//   type <spec>                      print the records of a file
+//   dump [/HEADER|/EXTENTS] <spec> [vbn [count]]
+//                                    hexdump blocks, the header or the map
+//   find <pattern>                   search the tree below the current
+//                                    directory
+//   stat <spec>                      the JSON record export writes
+//   help, exit
+//
+// Specs are VMS style and relative to the current directory: [A.B]FILE.TXT;2
+// from the MFD, [.SUB] and [-] from the current directory, a plain name in
+// it, or a file id as (num,seq,rvn). cd also takes SUB and ..
+//
+// File headers, directory contents and disk blocks stay cached for the whole
+// session, so going back to a directory, listing it again or completing a
+// name in it does not touch the disk.
+struct ShellOptions {
+    Disk::IoMode io_mode = Disk::IoMode::AUTO;
+
+    size_t read_cache_bytes = 64 * 1024 * 1024;
+    size_t header_cache_files = 64 * 1024;
+    size_t dir_cache_dirs = 4096;
+};
+
+// Run until exit or the end of input
+int RunShell(const std::string &image, const ShellOptions &options);
+
+} // namespace ods2
@@ -0,0 +1,157 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "sparse.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+#include "filesystem.h"
+#include "walk.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+// Largest read issued while copying the image
+const uint32_t copy_chunk_blocks = 2048;
+
+// Copies runs of blocks from the image into a sparse output file, merging
+// adjacent runs into larger reads
+class SparseWriter {
+  public:
+    SparseWriter(const Disk &disk, int fd) : disk_(disk), fd_(fd) {}
+
+    int Add(uint64_t lbn, uint64_t count) {
+        if (run_count_ > 0 && run_lbn_ + run_count_ == lbn) {
+            run_count_ += count;
+            return 0;
+        }
+        if (Flush() < 0) {
+            return -1;
+        }
+        run_lbn_ = lbn;
+        run_count_ = count;
+        return 0;
+    }
+
+    int Flush() {
+        while (run_count_ > 0) {
+            const uint32_t n = std::min<uint64_t>(run_count_, copy_chunk_blocks);
+            buf_.resize((size_t)n * 512);
+            if (disk_.read_blocks(run_lbn_, n, buf_.data()) < 0 ||
+                pwrite(fd_, buf_.data(), buf_.size(), (off_t)run_lbn_ * 512) !=
+                    (ssize_t)buf_.size()) {
+                return -1;
+            }
+            run_lbn_ += n;
+            run_count_ -= n;
+        }
+        return 0;
+    }
+
+  private:
+    const Disk &disk_;
+    const int fd_;
+    uint64_t run_lbn_ = 0;
+    uint64_t run_count_ = 0;
+    std::vector<uint8_t> buf_;
+};
+
+} // namespace
+
+int CheckSparse(const Filesystem &fs, const std::string &copy_path, SparseReport *report) {
+    const auto &disk = fs.disk();
+    const uint32_t c = fs.cluster_factor();
+    const uint64_t disk_blocks = disk.size() / 512;
+
+    *report = {};
+    report->volume = fs.volume_blocks();
+
+    int fd = -1;
+    if (!copy_path.empty()) {
+        fd = open(copy_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, disk.size()) < 0) {
+            fprintf(stderr, "error creating '%s'\n", copy_path.c_str());
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+    }
+    SparseWriter writer(disk, fd);
+
+    int err = 0;
+    for (uint64_t lbn = 0; lbn < disk_blocks && err == 0; lbn += c) {
+        const uint64_t n = std::min<uint64_t>(c, disk_blocks - lbn);
+        const bool zero = disk.is_zero(lbn * 512, n * 512);
+        // anything past the end of the volume is copied as it is
+        const bool allocated = lbn >= report->volume || fs.lbn_allocated(lbn);
+
+        if (lbn < report->volume) {
+            report->allocated += allocated ? n : 0;
+            report->allocated_holes += (allocated && zero) ? n : 0;
+            report->free_data += (!allocated && !zero) ? n : 0;
+        }
+        report->holes += zero ? n : 0;
+
+        if (fd >= 0 && allocated && !zero) {
+            err = writer.Add(lbn, n);
+            report->copied += n;
+        }
+    }
+    if (fd >= 0) {
+        if (err == 0) {
+            err = writer.Flush();
+        }
+        close(fd);
+        if (err < 0) {
+            fprintf(stderr, "error copying to '%s'\n", copy_path.c_str());
+            return -1;
+        }
+    }
+
+    // every block a file maps should be in an allocated cluster
+    if (fs.has_storage_bitmap()) {
+        err = ScanIndexFile(fs, [&](const std::shared_ptr<File> &f) {
+            report->files++;
+            for (auto &e : f->extents()) {
+                for (uint32_t i = 0; i < e.block_count; i++) {
+                    if (!fs.lbn_allocated(e.lbn + i)) {
+                        LTRACEF("%s: lbn %#x marked free\n", f->name().c_str(), e.lbn + i);
+                        report->file_blocks_free++;
+                    }
+                }
+            }
+        });
+    }
+
+    return err;
+}
+
+void PrintSparseReport(FILE *out, const SparseReport &r) {
+    auto mib = [](uint64_t blocks) { return blocks / 2048.0; };
+
+    fprintf(out, "volume             %12llu blocks %10.1f MiB\n", (unsigned long long)r.volume,
+            mib(r.volume));
+    fprintf(out, "allocated          %12llu blocks %10.1f MiB\n",
+            (unsigned long long)r.allocated, mib(r.allocated));
+    fprintf(out, "holes              %12llu blocks %10.1f MiB\n", (unsigned long long)r.holes,
+            mib(r.holes));
+    fprintf(out, "allocated in holes %12llu blocks\n", (unsigned long long)r.allocated_holes);
+    fprintf(out, "data in free space %12llu blocks\n", (unsigned long long)r.free_data);
+    fprintf(out, "files checked      %12llu, %llu blocks in clusters marked free\n",
+            (unsigned long long)r.files, (unsigned long long)r.file_blocks_free);
+    if (r.copied) {
+        fprintf(out, "copied             %12llu blocks %10.1f MiB\n",
+                (unsigned long long)r.copied, mib(r.copied));
+    }
+}
+
+} // namespace ods2
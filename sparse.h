@@ -0,0 +1,36 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace ods2 {
+
+class Filesystem;
+
+// All counts are in blocks
+struct SparseReport {
+    uint64_t volume = 0;
+    uint64_t allocated = 0;        // clusters in use according to the storage bitmap
+    uint64_t holes = 0;            // known zero in the image
+    uint64_t allocated_holes = 0;  // in use, but a hole in the image
+    uint64_t free_data = 0;        // free, but holding data in the image
+    uint64_t files = 0;            // files whose extents were checked
+    uint64_t file_blocks_free = 0; // file blocks in clusters the bitmap marks free
+    uint64_t copied = 0;
+};
+
+// Cross-check the hole map of the image against the storage bitmap, and the
+// extents of every file against the bitmap. With a copy path, also write a
+// sparse copy of the image that only reads the clusters that are allocated
+// and not holes, leaving everything else as holes in the copy.
+int CheckSparse(const Filesystem &fs, const std::string &copy_path, SparseReport *report);
+
+void PrintSparseReport(FILE *out, const SparseReport &report);
+
+} // namespace ods2
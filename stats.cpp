@@ -0,0 +1,294 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "stats.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace stats {
+
+namespace {
+
+const size_t num_ops = (size_t)Op::COUNT;
+const size_t num_counts = (size_t)Count::COUNT;
+const size_t num_buckets = 64;
+
+// Counters are only ever written by their owning thread, so plain relaxed
+// load/store pairs are enough; the atomics just make concurrent summaries safe.
+struct Counter {
+    std::atomic<uint64_t> value = 0;
+
+    void add(uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+struct OpStats {
+    Counter count;
+    Counter bytes;
+    Counter total_ns;
+    Counter max_ns;
+    std::array<Counter, num_buckets> histogram; // bucket n holds [2^(n-1), 2^n) ns
+};
+
+struct Event {
+    uint64_t start;
+    uint64_t end;
+    uint64_t arg;
+    Op op;
+};
+
+struct ThreadStats {
+    uint32_t tid;
+    std::array<OpStats, num_ops> ops;
+    std::array<Counter, num_counts> counts;
+
+    // single writer ring of the most recent events
+    std::vector<Event> ring;
+    std::atomic<uint64_t> head = 0;
+};
+
+// Per thread storage is owned by the registry so it outlives its thread
+std::mutex registry_lock;
+std::vector<std::unique_ptr<ThreadStats>> registry;
+size_t trace_events_per_thread = 0;
+const uint64_t epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now().time_since_epoch())
+                           .count();
+
+thread_local ThreadStats *current;
+
+ThreadStats *Current() {
+    if (!current) {
+        auto ts = std::make_unique<ThreadStats>();
+        std::lock_guard guard(registry_lock);
+        ts->tid = registry.size() + 1;
+        ts->ring.resize(trace_events_per_thread);
+        current = ts.get();
+        registry.push_back(std::move(ts));
+    }
+    return current;
+}
+
+uint64_t Percentile(const OpStats &s, uint64_t count, double p) {
+    const uint64_t target = std::max<uint64_t>(1, count * p);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < num_buckets; b++) {
+        seen += s.histogram[b].get();
+        if (seen >= target) {
+            return b == 0 ? 0 : 1ULL << b;
+        }
+    }
+    return 0;
+}
+
+} // namespace
+
+const char *OpName(Op op) {
+    switch (op) {
+    case Op::DISK_READ:
+        return "disk_read";
+    case Op::DISK_WRITE:
+        return "disk_write";
+    case Op::VBN_TRANSLATE:
+        return "vbn_translate";
+    case Op::HEADER_PARSE:
+        return "header_parse";
+    case Op::DIR_PARSE:
+        return "dir_block_parse";
+    case Op::DIR_LOOKUP:
+        return "dir_lookup";
+    case Op::ASYNC_READ:
+        return "async_read";
+    case Op::READAHEAD:
+        return "readahead";
+    case Op::CACHE_FLUSH:
+        return "cache_flush";
+    case Op::SERVE_LIST:
+        return "serve_list";
+    case Op::SERVE_STAT:
+        return "serve_stat";
+    case Op::SERVE_OPEN:
+        return "serve_open";
+    case Op::SERVE_READ:
+        return "serve_read";
+    case Op::SERVE_SEARCH:
+        return "serve_search";
+    case Op::IO_THROTTLE:
+        return "io_throttle";
+    case Op::CHUNK_DECOMPRESS:
+        return "chunk_decompress";
+    case Op::COUNT:
+        break;
+    }
+    return "unknown";
+}
+
+const char *CountName(Count count) {
+    switch (count) {
+    case Count::READAHEAD_USED:
+        return "readahead_used";
+    case Count::READAHEAD_WASTED:
+        return "readahead_wasted";
+    case Count::READ_CACHE_HIT:
+        return "read_cache_hit";
+    case Count::READ_CACHE_MISS:
+        return "read_cache_miss";
+    case Count::HDR_CACHE_HIT:
+        return "hdr_cache_hit";
+    case Count::HDR_CACHE_MISS:
+        return "hdr_cache_miss";
+    case Count::DIR_CACHE_HIT:
+        return "dir_cache_hit";
+    case Count::DIR_CACHE_MISS:
+        return "dir_cache_miss";
+    case Count::VOLSET_SPLIT_READ:
+        return "volset_split_read";
+    case Count::CHUNK_CACHE_HIT:
+        return "chunk_cache_hit";
+    case Count::CHUNK_CACHE_MISS:
+        return "chunk_cache_miss";
+    case Count::CHUNK_PREFETCH:
+        return "chunk_prefetch";
+    case Count::COUNT:
+        break;
+    }
+    return "unknown";
+}
+
+namespace internal {
+
+uint64_t Now() {
+    // offset from process start, so a valid timestamp is never zero
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+               .count() -
+           epoch + 1;
+}
+
+void Record(Op op, uint64_t start, uint64_t end, uint64_t bytes, uint64_t arg) {
+    auto *ts = Current();
+    auto &s = ts->ops[(size_t)op];
+
+    const uint64_t ns = end - start;
+    s.count.add(1);
+    s.bytes.add(bytes);
+    s.total_ns.add(ns);
+    if (ns > s.max_ns.get()) {
+        s.max_ns.value.store(ns, std::memory_order_relaxed);
+    }
+    const size_t bucket = ns ? std::min<size_t>(64 - __builtin_clzll(ns), num_buckets - 1) : 0;
+    s.histogram[bucket].add(1);
+
+    if (tracing.load(std::memory_order_relaxed) && !ts->ring.empty()) {
+        const uint64_t h = ts->head.load(std::memory_order_relaxed);
+        ts->ring[h % ts->ring.size()] = {start, end, arg, op};
+        ts->head.store(h + 1, std::memory_order_release);
+    }
+}
+
+void Add(Count count, uint64_t n) { Current()->counts[(size_t)count].add(n); }
+
+} // namespace internal
+
+void Enable() { internal::enabled = true; }
+
+void EnableTrace(size_t events_per_thread) {
+    {
+        std::lock_guard guard(registry_lock);
+        trace_events_per_thread = events_per_thread;
+        for (auto &ts : registry) {
+            ts->ring.resize(events_per_thread);
+        }
+    }
+    internal::tracing = true;
+    internal::enabled = true;
+}
+
+void PrintSummary(FILE *out) {
+    std::lock_guard guard(registry_lock);
+
+    fprintf(out, "%-16s %10s %12s %10s %10s %10s %10s %12s\n", "op", "count", "total ms",
+            "avg us", "~p50 us", "~p99 us", "max us", "MiB");
+    for (size_t op = 0; op < num_ops; op++) {
+        // fold the per thread stats together
+        OpStats sum;
+        for (auto &ts : registry) {
+            auto &s = ts->ops[op];
+            sum.count.add(s.count.get());
+            sum.bytes.add(s.bytes.get());
+            sum.total_ns.add(s.total_ns.get());
+            sum.max_ns.value = std::max(sum.max_ns.get(), s.max_ns.get());
+            for (size_t b = 0; b < num_buckets; b++) {
+                sum.histogram[b].add(s.histogram[b].get());
+            }
+        }
+
+        const uint64_t count = sum.count.get();
+        if (count == 0) {
+            continue;
+        }
+        fprintf(out, "%-16s %10llu %12.3f %10.3f %10.3f %10.3f %10.3f %12.2f\n",
+                OpName((Op)op), (unsigned long long)count, sum.total_ns.get() / 1e6,
+                sum.total_ns.get() / 1e3 / count, Percentile(sum, count, 0.5) / 1e3,
+                Percentile(sum, count, 0.99) / 1e3, sum.max_ns.get() / 1e3,
+                sum.bytes.get() / (1024.0 * 1024.0));
+    }
+
+    bool header = false;
+    for (size_t c = 0; c < num_counts; c++) {
+        uint64_t total = 0;
+        for (auto &ts : registry) {
+            total += ts->counts[c].get();
+        }
+        if (total == 0) {
+            continue;
+        }
+        if (!header) {
+            fprintf(out, "\n%-16s %10s\n", "counter", "value");
+            header = true;
+        }
+        fprintf(out, "%-16s %10llu\n", CountName((Count)c), (unsigned long long)total);
+    }
+}
+
+int DumpTrace(const std::string &path) {
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "error opening trace file '%s'\n", path.c_str());
+        return -1;
+    }
+
+    std::lock_guard guard(registry_lock);
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (auto &ts : registry) {
+        const size_t size = ts->ring.size();
+        if (size == 0) {
+            continue;
+        }
+        const uint64_t head = ts->head.load(std::memory_order_acquire);
+        for (uint64_t i = head > size ? head - size : 0; i < head; i++) {
+            const auto &e = ts->ring[i % size];
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                        "\"dur\":%.3f,\"args\":{\"arg\":%llu}}",
+                    first ? "" : ",\n", OpName(e.op), ts->tid, e.start / 1e3,
+                    (e.end - e.start) / 1e3, (unsigned long long)e.arg);
+            first = false;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+    return 0;
+}
+
+} // namespace stats
@@ -0,0 +1,119 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Runtime instrumentation. Each probe records a count, a byte total and a
+// log2 latency histogram per operation into per thread storage, and optionally
+// appends an event to a per thread ring buffer that can be dumped as a Chrome
+// trace (chrome://tracing or ui.perfetto.dev).
+//
+// Everything is off by default. A disabled probe costs one relaxed load of a
+// global flag and a predictable branch.
+namespace stats {
+
+enum class Op : uint8_t {
+    DISK_READ,
+    DISK_WRITE,
+    VBN_TRANSLATE,
+    HEADER_PARSE,
+    DIR_PARSE,
+    DIR_LOOKUP,
+    ASYNC_READ,
+    READAHEAD,
+    CACHE_FLUSH,
+    SERVE_LIST,
+    SERVE_STAT,
+    SERVE_OPEN,
+    SERVE_READ,
+    SERVE_SEARCH,
+    IO_THROTTLE,
+    CHUNK_DECOMPRESS,
+    COUNT,
+};
+
+const char *OpName(Op op);
+
+// Plain event counters, for things that have no duration of their own
+enum class Count : uint8_t {
+    READAHEAD_USED,
+    READAHEAD_WASTED,
+    READ_CACHE_HIT,
+    READ_CACHE_MISS,
+    HDR_CACHE_HIT,
+    HDR_CACHE_MISS,
+    DIR_CACHE_HIT,
+    DIR_CACHE_MISS,
+    VOLSET_SPLIT_READ,
+    CHUNK_CACHE_HIT,
+    CHUNK_CACHE_MISS,
+    CHUNK_PREFETCH,
+    COUNT,
+};
+
+const char *CountName(Count count);
+
+namespace internal {
+inline std::atomic<bool> enabled = false;
+inline std::atomic<bool> tracing = false;
+
+uint64_t Now();
+void Record(Op op, uint64_t start, uint64_t end, uint64_t bytes, uint64_t arg);
+void Add(Count count, uint64_t n);
+} // namespace internal
+
+inline bool enabled() { return internal::enabled.load(std::memory_order_relaxed); }
+
+inline void Add(Count count, uint64_t n) {
+    if (enabled()) {
+        internal::Add(count, n);
+    }
+}
+
+// Turn on the counters and histograms
+void Enable();
+
+// Also keep the last events_per_thread events of each thread for DumpTrace
+void EnableTrace(size_t events_per_thread = 1 << 16);
+
+// Print a table of every operation and counter seen so far
+void PrintSummary(FILE *out);
+
+// Write the traced events of every thread, oldest first, as Chrome trace JSON
+int DumpTrace(const std::string &path);
+
+// Times the enclosing scope and records it against an operation
+class Scope {
+  public:
+    explicit Scope(Op op, uint64_t arg = 0) : op_(op), arg_(arg) {
+        if (enabled()) {
+            start_ = internal::Now();
+        }
+    }
+    ~Scope() {
+        if (start_) {
+            internal::Record(op_, start_, internal::Now(), bytes_, arg_);
+        }
+    }
+
+    void set_bytes(uint64_t bytes) { bytes_ = bytes; }
+
+  private:
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+    Op op_;
+    uint64_t arg_;
+    uint64_t bytes_ = 0;
+    uint64_t start_ = 0;
+};
+
+} // namespace stats
@@ -0,0 +1,84 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "threadpool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    for (size_t i = 0; i < threads; i++) {
+        threads_.emplace_back([this]() { Worker(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard guard(lock_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto &t : threads_) {
+        t.join();
+    }
+}
+
+void ThreadPool::Submit(std::function<void()> job) {
+    {
+        std::lock_guard guard(lock_);
+        queue_.push_back(std::move(job));
+    }
+    work_cv_.notify_one();
+}
+
+void ThreadPool::Wait() {
+    std::unique_lock guard(lock_);
+    idle_cv_.wait(guard, [this]() { return queue_.empty() && busy_ == 0; });
+}
+
+void ThreadPool::Worker() {
+    std::unique_lock guard(lock_);
+    for (;;) {
+        work_cv_.wait(guard, [this]() { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) {
+            // only get here when stopping with nothing left to do
+            return;
+        }
+
+        auto job = std::move(queue_.front());
+        queue_.pop_front();
+        busy_++;
+
+        guard.unlock();
+        job();
+        guard.lock();
+
+        busy_--;
+        if (queue_.empty() && busy_ == 0) {
+            idle_cv_.notify_all();
+        }
+    }
+}
+
+void TaskGroup::Submit(std::function<void()> job) {
+    {
+        std::lock_guard guard(lock_);
+        pending_++;
+    }
+    pool_.Submit([this, job = std::move(job)]() {
+        job();
+        std::lock_guard guard(lock_);
+        if (--pending_ == 0) {
+            done_cv_.notify_all();
+        }
+    });
+}
+
+void TaskGroup::Wait() {
+    std::unique_lock guard(lock_);
+    done_cv_.wait(guard, [this]() { return pending_ == 0; });
+}
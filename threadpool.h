@@ -0,0 +1,65 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+
+// Simple fixed size pool of worker threads pulling jobs off a shared queue
+class ThreadPool {
+  public:
+    // threads == 0 picks the hardware concurrency
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+
+    void Submit(std::function<void()> job);
+
+    // Block until every submitted job has completed
+    void Wait();
+
+    size_t size() const { return threads_.size(); }
+
+  private:
+    DISALLOW_COPY_ASSIGN_AND_MOVE(ThreadPool);
+
+    void Worker();
+
+    std::mutex lock_;
+    std::condition_variable work_cv_;
+    std::condition_variable idle_cv_;
+    std::deque<std::function<void()>> queue_;
+    size_t busy_ = 0;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
+
+// A set of jobs on a shared pool that can be waited on by themselves, while
+// other users keep submitting to the same pool. Must not be waited on from a
+// job running on that pool.
+class TaskGroup {
+  public:
+    explicit TaskGroup(ThreadPool &pool) : pool_(pool) {}
+    ~TaskGroup() { Wait(); }
+
+    void Submit(std::function<void()> job);
+
+    // Block until every job submitted through this group has completed
+    void Wait();
+
+  private:
+    DISALLOW_COPY_ASSIGN_AND_MOVE(TaskGroup);
+
+    ThreadPool &pool_;
+    std::mutex lock_;
+    std::condition_variable done_cv_;
+    size_t pending_ = 0;
+};
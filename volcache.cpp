@@ -0,0 +1,98 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "volcache.h"
+
+#include <cstdio>
+
+#include "filesystem.h"
+#include "stats.h"
+#include "walk.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+std::shared_ptr<File> VolumeCache::OpenFid(file_id fid) {
+    // open files carry the number of the volume they are on
+    if (fid.rv_num == 0) {
+        fid.rv_num = fs_.rvn();
+    }
+    auto f = headers_.Get(FileKey(fid));
+    if (f && f->id() == fid) {
+        stats::Add(stats::Count::HDR_CACHE_HIT, 1);
+        return f;
+    }
+    stats::Add(stats::Count::HDR_CACHE_MISS, 1);
+
+    f = std::make_shared<File>(fs_);
+    if (f->Open(fid) < 0) {
+        return nullptr;
+    }
+    headers_.Put(FileKey(fid), f);
+    return f;
+}
+
+std::shared_ptr<const DirEntryList> VolumeCache::Entries(const File &dir) {
+    const uint32_t key = FileKey(dir.id());
+    if (auto list = dirs_.Get(key)) {
+        stats::Add(stats::Count::DIR_CACHE_HIT, 1);
+        return list;
+    }
+    stats::Add(stats::Count::DIR_CACHE_MISS, 1);
+
+    auto [err, entries] = dir.ReadDirEntries();
+    if (err < 0) {
+        return nullptr;
+    }
+    auto list = std::make_shared<const DirEntryList>(std::move(entries));
+    dirs_.Put(key, list);
+    return list;
+}
+
+std::shared_ptr<File> VolumeCache::Find(const File &dir, const std::string &name,
+                                        uint32_t version) {
+    auto list = Entries(dir);
+    if (!list) {
+        return nullptr;
+    }
+
+    // versions of a name are sorted highest first
+    for (auto &e : *list) {
+        if (e.name == name && (version == 0 || e.version == version)) {
+            return OpenFid(e.fid);
+        }
+    }
+    return nullptr;
+}
+
+std::shared_ptr<File> VolumeCache::Resolve(const std::string &spec) {
+    if (!spec.empty() && spec[0] == '(') {
+        unsigned num, seq, rvn;
+        if (sscanf(spec.c_str(), "(%u,%u,%u)", &num, &seq, &rvn) != 3) {
+            return nullptr;
+        }
+        return OpenFid(file_id(num, seq, rvn));
+    }
+
+    SpecParts parts;
+    if (!ParseSpec(spec, &parts)) {
+        return nullptr;
+    }
+
+    auto dir = fs_.OpenRootDir();
+    for (auto &d : parts.dirs) {
+        dir = Find(*dir, d, 0);
+        if (!dir || !dir->is_dir()) {
+            return nullptr;
+        }
+    }
+    if (parts.name.empty()) {
+        return dir;
+    }
+    return Find(*dir, parts.name, parts.version);
+}
+
+} // namespace ods2
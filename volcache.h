@@ -0,0 +1,103 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "file.h"
+
+namespace ods2 {
+
+class Filesystem;
+
+// Map from a key to a shared object, bounded by evicting the least recently
+// used entry
+template <typename T>
+class LruMap {
+  public:
+    explicit LruMap(size_t capacity) : capacity_(std::max<size_t>(capacity, 1)) {}
+
+    std::shared_ptr<T> Get(uint32_t key) {
+        std::lock_guard guard(lock_);
+        auto it = map_.find(key);
+        if (it == map_.end()) {
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+
+    void Put(uint32_t key, std::shared_ptr<T> value) {
+        std::lock_guard guard(lock_);
+        auto it = map_.find(key);
+        if (it != map_.end()) {
+            it->second->second = std::move(value);
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return;
+        }
+        lru_.emplace_front(key, std::move(value));
+        map_[key] = lru_.begin();
+        if (lru_.size() > capacity_) {
+            map_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+    }
+
+  private:
+    using List = std::list<std::pair<uint32_t, std::shared_ptr<T>>>;
+
+    const size_t capacity_;
+    std::mutex lock_;
+    List lru_; // most recently used first
+    std::unordered_map<uint32_t, typename List::iterator> map_;
+};
+
+// File numbers are 24 bits and only unique within a member of a volume set,
+// so the relative volume number goes on top
+inline uint32_t FileKey(const file_id &fid) {
+    return (uint32_t)fid.rv_num << 24 | fid.file_num();
+}
+
+// Recently opened file headers and directory contents of a mounted volume,
+// for long lived readers that keep going back to the same directories. Safe
+// to share between threads; the volume must be read only.
+class VolumeCache {
+  public:
+    VolumeCache(const Filesystem &fs, size_t header_files, size_t dirs)
+        : fs_(fs), headers_(header_files), dirs_(dirs) {}
+
+    // Open a file by id, where relative volume 0 is the volume itself
+    std::shared_ptr<File> OpenFid(file_id fid);
+
+    // The entries of a directory, in the order they are on disk
+    std::shared_ptr<const DirEntryList> Entries(const File &dir);
+
+    // An entry of a directory by name, the highest version if version is 0
+    std::shared_ptr<File> Find(const File &dir, const std::string &name, uint32_t version);
+
+    // A spec relative to the MFD, or a file id as (num,seq,rvn)
+    std::shared_ptr<File> Resolve(const std::string &spec);
+
+    const Filesystem &fs() const { return fs_; }
+
+  private:
+    VolumeCache(const VolumeCache &) = delete;
+    VolumeCache &operator=(const VolumeCache &) = delete;
+
+    const Filesystem &fs_;
+    LruMap<File> headers_; // both by FileKey
+    LruMap<const DirEntryList> dirs_;
+};
+
+} // namespace ods2
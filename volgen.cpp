@@ -0,0 +1,559 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "volgen.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <utility>
+#include <unistd.h>
+#include <vector>
+
+#include "disk.h"
+#include "layout.h"
+#include "ods2.h"
+#include "utils.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+// Small deterministic generator so images are reproducible from the seed
+struct SplitMix64 {
+    uint64_t state;
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    uint32_t range(uint32_t lo, uint32_t hi) {
+        return lo + (uint32_t)(next() % ((uint64_t)hi - lo + 1));
+    }
+};
+
+struct GenFile {
+    GenFile(uint32_t num, std::string name, uint16_t version, int32_t parent)
+        : num(num), name(std::move(name)), version(version), parent(parent) {}
+
+    uint32_t num;     // on the member holding the header
+    uint32_t vol = 0; // member of a set holding the header, from 0
+    std::string name; // NAME.EXT, no version
+    uint16_t version;
+    int32_t parent;        // index into dirs of the containing directory
+    int32_t dir = -1;      // index into dirs if this file is a directory
+    uint32_t filechar = 0;
+    uint64_t bytes = 0;    // logical length of the file
+    uint32_t alloc_blocks = 0;
+    std::vector<LbnRun> extents;
+
+    // the rest of a file that spans two members of a set, mapped by an
+    // extension header on the second
+    uint32_t ext_num = 0;
+    uint32_t ext_vol = 0;
+    std::vector<LbnRun> ext_extents;
+};
+
+struct GenDir {
+    uint32_t file; // index into files
+    std::vector<uint32_t> entries;
+    std::vector<Disk::Block> blocks;
+};
+
+// One volume of a set, or the only one
+struct GenMember {
+    uint32_t reserved = 0;  // index into files of its INDEXF.SYS
+    uint32_t next_num = 10; // after the reserved files
+    uint32_t cursor = 0;    // next free cluster
+    uint32_t maxfiles = 0;
+    uint32_t ibmapsize = 0;
+    uint32_t bitmap_blocks = 0;
+    uint32_t total_clusters = 0;
+};
+
+// 1-Jan-2001 in VMS time (100ns units since 17-Nov-1858)
+const uint64_t base_vms_time = (978307200ULL + 3506716800ULL) * 10000000ULL;
+
+// The id of a file as seen from a member of the set, with a relative volume
+// number of 0 on its own member
+file_id GenFileId(const GenFile &f, uint32_t from_vol) {
+    return file_id(f.num, f.num <= 9 ? f.num : 1, f.vol == from_vol ? 0 : f.vol + 1);
+}
+
+void BuildHeader(Disk::Block *blk, const GenFile &f, const file_id &backlink, uint64_t date) {
+    HeaderInfo info;
+    info.fid = GenFileId(f, f.vol);
+    info.backlink = backlink;
+    info.name = f.name;
+    info.version = f.version;
+    info.filechar = f.filechar;
+    info.bytes = f.bytes;
+    info.alloc_blocks = f.alloc_blocks;
+    info.date = date;
+    info.runs = f.extents;
+    [[maybe_unused]] int err = ods2::BuildHeader(blk, info);
+    assert(err == 0);
+
+    if (f.ext_num) {
+        auto *fh = (file_header *)blk->buf.data();
+        fh->ext_fid = file_id(f.ext_num, 1, f.ext_vol + 1);
+        set_block_checksum(blk->buf.data());
+    }
+}
+
+// The extension header mapping the part of a spanning file on its second member
+void BuildExtensionHeader(Disk::Block *blk, const GenFile &f, uint64_t date) {
+    HeaderInfo info;
+    info.fid = file_id(f.ext_num, 1, 0);
+    info.backlink = file_id(f.num, 1, f.vol + 1);
+    info.name = f.name;
+    info.version = f.version;
+    info.filechar = f.filechar;
+    info.bytes = f.bytes;
+    info.date = date;
+    info.runs = f.ext_extents;
+    for (auto &r : f.ext_extents) {
+        info.alloc_blocks += r.count;
+    }
+    [[maybe_unused]] int err = ods2::BuildHeader(blk, info);
+    assert(err == 0);
+
+    auto *fh = (file_header *)blk->buf.data();
+    fh->seg_num = 1;
+    set_block_checksum(blk->buf.data());
+}
+
+// Pack directory records for the entries of a directory into blocks
+void BuildDirectory(GenDir &d, const std::vector<GenFile> &files) {
+    const uint32_t vol = files[d.file].vol;
+    std::vector<DirRecord> records;
+    for (auto i : d.entries) {
+        records.push_back({files[i].name, files[i].version, GenFileId(files[i], vol)});
+    }
+    SortDirRecords(records);
+    d.blocks = BuildDirectoryBlocks(records);
+}
+
+// Deterministic, moderately compressible file contents
+void FillBlock(uint8_t *buf, uint32_t filenum, uint32_t vbn, uint64_t seed) {
+    static const char *const words[] = {
+        "alpha ",  "bravo ", "charlie ", "delta ", "echo ",     "foxtrot ", "golf ",  "hotel ",
+        "india ",  "juliet ", "kilo ",   "lima ",  "mike ",     "november ", "oscar ", "papa ",
+    };
+
+    SplitMix64 rng{seed ^ ((uint64_t)filenum << 32) ^ vbn};
+    int pos = snprintf((char *)buf, 512, "%08u:%08u ", filenum, vbn);
+    while (pos < 512) {
+        const char *w = words[rng.next() & 0xf];
+        size_t len = std::min(strlen(w), (size_t)(512 - pos));
+        memcpy(buf + pos, w, len);
+        pos += len;
+    }
+}
+
+int WriteBlocks(int fd, uint32_t lbn, const void *buf, size_t count) {
+    const size_t len = count * 512;
+    if (pwrite(fd, buf, len, (off_t)lbn * 512) != (ssize_t)len) {
+        fprintf(stderr, "volgen: error writing lbn %#x\n", lbn);
+        return -1;
+    }
+    return 0;
+}
+
+} // namespace
+
+std::string VolumeSetPath(const std::string &path, uint16_t rvn) {
+    const auto slash = path.rfind('/');
+    auto dot = path.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = path.size();
+    }
+    return path.substr(0, dot) + std::to_string(rvn) + path.substr(dot);
+}
+
+int GenerateVolume(const std::string &path, const VolumeParams &params) {
+    const uint32_t c = std::max<uint16_t>(params.cluster, 1);
+    const uint32_t extents_per_file = std::clamp<uint32_t>(params.extents, 1, 32);
+    const uint32_t set = std::clamp<uint32_t>(params.volumes, 1, 255);
+    SplitMix64 rng{params.seed};
+
+    std::vector<GenFile> files;
+    std::vector<GenDir> dirs;
+    std::vector<GenMember> members(set);
+
+    // reserved files occupy file numbers 1 through 9 of every member, those
+    // of the first one in the MFD of the whole set
+    static const char *const reserved_names[] = {
+        "INDEXF.SYS", "BITMAP.SYS", "BADBLK.SYS", "000000.DIR", "CORIMG.SYS",
+        "VOLSET.SYS", "CONTIN.SYS", "BACKUP.SYS", "BADLOG.SYS",
+    };
+    auto add_reserved = [&](uint32_t vol, int32_t mfd_dir) {
+        members[vol].reserved = files.size();
+        for (uint32_t i = 0; i < 9; i++) {
+            files.emplace_back(i + 1, reserved_names[i], 1, mfd_dir);
+            files.back().vol = vol;
+        }
+        auto *reserved = &files[members[vol].reserved];
+        reserved[(int)reserved_files::MFD - 1].dir = mfd_dir;
+        reserved[(int)reserved_files::MFD - 1].filechar = file_char_directory | file_char_contig;
+        reserved[(int)reserved_files::INDEX - 1].filechar = file_char_contig;
+        reserved[(int)reserved_files::BITMAP - 1].filechar = file_char_contig;
+        dirs.push_back({members[vol].reserved + (int)reserved_files::MFD - 1, {}, {}});
+        for (uint32_t i = 0; i < 9; i++) {
+            dirs[mfd_dir].entries.push_back(members[vol].reserved + i);
+        }
+    };
+    add_reserved(0, 0);
+
+    // lay out the directory tree breadth first, dealing the directories out
+    // across the members of a set
+    std::vector<uint32_t> leaves{0};
+    for (uint32_t level = 0; level < params.depth; level++) {
+        std::vector<uint32_t> next;
+        for (auto parent : leaves) {
+            for (uint32_t i = 0; i < params.fanout; i++) {
+                char name[32];
+                snprintf(name, sizeof(name), "D%05zu.DIR", dirs.size());
+                const uint32_t vol = dirs.size() % set;
+                GenFile f{members[vol].next_num++, name, 1, (int32_t)parent};
+                f.vol = vol;
+                f.dir = dirs.size();
+                f.filechar = file_char_directory | file_char_contig;
+                dirs[parent].entries.push_back(files.size());
+                dirs.push_back({(uint32_t)files.size(), {}, {}});
+                files.push_back(f);
+                next.push_back(f.dir);
+            }
+        }
+        if (next.empty()) {
+            break;
+        }
+        leaves = std::move(next);
+    }
+
+    // spread the user files across all of the directories but the MFD, unless
+    // there are no others, and across the members of a set. Every fourth file
+    // in a set continues on the next member.
+    const uint32_t versions = std::max<uint32_t>(params.versions, 1);
+    const uint32_t names = (params.files + versions - 1) / versions;
+    uint32_t made = 0;
+    for (uint32_t n = 0; n < names && made < params.files; n++) {
+        const uint32_t parent = dirs.size() > 1 ? 1 + n % (dirs.size() - 1) : 0;
+        char name[32];
+        snprintf(name, sizeof(name), "F%07u.DAT", n);
+        for (uint32_t v = 0; v < versions && made < params.files; v++, made++) {
+            const uint32_t vol = made % set;
+            GenFile f{members[vol].next_num++, name, (uint16_t)(v + 1), (int32_t)parent};
+            f.vol = vol;
+            const uint32_t blocks = rng.range(std::max<uint32_t>(params.min_blocks, 1),
+                                              std::max(params.max_blocks, params.min_blocks));
+            f.bytes = (uint64_t)blocks * 512 - rng.range(0, 511);
+            if (set > 1 && made % 4 == 3 && blocks > c) {
+                f.ext_vol = (vol + 1) % set;
+                f.ext_num = members[f.ext_vol].next_num++;
+            }
+            dirs[parent].entries.push_back(files.size());
+            files.push_back(f);
+        }
+    }
+
+    // the other members of a set have an MFD of their own, holding only their
+    // reserved files
+    for (uint32_t vol = 1; vol < set; vol++) {
+        add_reserved(vol, dirs.size());
+    }
+
+    // the volume set list on the first member
+    auto &volset = files[(int)reserved_files::VOL_SET - 1];
+    if (set > 1) {
+        volset.bytes = (uint64_t)(set + 1) * 64;
+    }
+
+    // allocate everything in cluster units, starting with the index file at
+    // LBN 0 of each member
+    auto allocate = [&](std::vector<LbnRun> &extents, uint32_t &cursor, uint32_t blocks,
+                        uint32_t pieces) {
+        const uint32_t clusters = std::max<uint32_t>((blocks + c - 1) / c, 1);
+        pieces = std::min(pieces, clusters);
+        uint32_t remaining = clusters;
+        for (uint32_t p = 0; p < pieces; p++) {
+            const uint32_t len = remaining / (pieces - p);
+            extents.push_back({cursor * c, len * c});
+            cursor += len;
+            remaining -= len;
+            // leave a one cluster hole between the pieces of a fragmented file
+            if (p + 1 < pieces) {
+                cursor++;
+            }
+        }
+        return clusters * c;
+    };
+
+    const uint32_t free_clusters = (params.free_blocks + c - 1) / c;
+    for (uint32_t vol = 0; vol < set; vol++) {
+        auto &m = members[vol];
+        auto *reserved = &files[m.reserved];
+
+        const uint32_t header_slots = m.next_num - 1 + params.spare_headers;
+        m.maxfiles =
+            std::max<uint32_t>(ROUNDUP(std::max(header_slots, params.max_files), 4096), 4096);
+        m.ibmapsize = m.maxfiles / 4096;
+        const uint32_t index_blocks = ROUNDUP(4 * c + m.ibmapsize + header_slots, c);
+
+        auto &indexf = reserved[(int)reserved_files::INDEX - 1];
+        indexf.alloc_blocks = allocate(indexf.extents, m.cursor, index_blocks, 1);
+        indexf.bytes = (uint64_t)index_blocks * 512;
+
+        for (auto &d : dirs) {
+            auto &f = files[d.file];
+            if (f.vol != vol) {
+                continue;
+            }
+            BuildDirectory(d, files);
+            f.alloc_blocks = allocate(f.extents, m.cursor, d.blocks.size(), 1);
+            f.bytes = d.blocks.size() * 512;
+        }
+        if (vol == 0 && set > 1) {
+            volset.alloc_blocks =
+                allocate(volset.extents, m.cursor, (volset.bytes + 511) / 512, 1);
+        }
+
+        // a spanning file keeps its first half of whole clusters on its own member
+        for (auto &f : files) {
+            if (f.num <= 9 || f.dir >= 0) {
+                continue;
+            }
+            const uint32_t blocks = (f.bytes + 511) / 512;
+            const uint32_t first = f.ext_num ? (blocks + c - 1) / c / 2 * c : blocks;
+            if (f.vol == vol) {
+                f.alloc_blocks += allocate(f.extents, m.cursor, first, extents_per_file);
+            }
+            if (f.ext_num && f.ext_vol == vol) {
+                f.alloc_blocks +=
+                    allocate(f.ext_extents, m.cursor, blocks - first, extents_per_file);
+            }
+        }
+
+        // the storage bitmap goes last, and its size depends on the volume size
+        m.bitmap_blocks = 2;
+        for (;;) {
+            m.total_clusters = m.cursor + (m.bitmap_blocks + c - 1) / c + free_clusters;
+            const uint32_t needed = 1 + (m.total_clusters + 4095) / 4096;
+            if (needed == m.bitmap_blocks) {
+                break;
+            }
+            m.bitmap_blocks = needed;
+        }
+        auto &bitmapf = reserved[(int)reserved_files::BITMAP - 1];
+        bitmapf.alloc_blocks = allocate(bitmapf.extents, m.cursor, m.bitmap_blocks, 1);
+        bitmapf.bytes = (uint64_t)m.bitmap_blocks * 512;
+        assert(m.cursor + free_clusters == m.total_clusters);
+    }
+
+    LTRACEF("%zu files, %zu dirs, %u members\n", files.size(), dirs.size(), set);
+
+    int err = 0;
+    const uint64_t volume_date = base_vms_time + (params.seed % 1000) * 86400ULL * 10000000ULL;
+
+    // the structure name of a set, and the label of each member
+    auto label = [&](uint8_t *out, uint32_t vol) {
+        std::string name = params.volname;
+        if (set > 1 && vol > 0) {
+            name = name.substr(0, 12 - std::to_string(vol + 1).size()) + std::to_string(vol + 1);
+        }
+        memset(out, ' ', 12);
+        memcpy(out, name.data(), std::min<size_t>(name.size(), 12));
+    };
+
+    std::vector<int> fds(set, -1);
+    for (uint32_t vol = 0; vol < set; vol++) {
+        const auto member_path = set > 1 ? VolumeSetPath(path, vol + 1) : path;
+        fds[vol] = ::open(member_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fds[vol] < 0) {
+            fprintf(stderr, "volgen: error creating '%s'\n", member_path.c_str());
+            err = -1;
+            break;
+        }
+        if (ftruncate(fds[vol], (uint64_t)members[vol].total_clusters * c * 512) < 0) {
+            fprintf(stderr, "volgen: error sizing '%s'\n", member_path.c_str());
+            err = -1;
+            break;
+        }
+    }
+
+    for (uint32_t vol = 0; vol < set && !err; vol++) {
+        const auto &m = members[vol];
+        const int fd = fds[vol];
+        const uint32_t ibmaplbn = 4 * c;
+        const uint64_t volume_blocks = (uint64_t)m.total_clusters * c;
+
+        // home block, and the alternate home block
+        Disk::Block home{};
+        auto *hb = (home_block *)home.buf.data();
+        hb->homelbn = 1;
+        hb->alhomelbn = 2 * c;
+        hb->altidxlbn = 3 * c;
+        hb->struclev = 0x0201;
+        hb->cluster = c;
+        hb->homevbn = 2;
+        hb->alhomevbn = 2 * c + 1;
+        hb->altidxvbn = 3 * c + 1;
+        hb->ibmapvbn = 4 * c + 1;
+        hb->ibmaplbn = ibmaplbn;
+        hb->maxfiles = m.maxfiles;
+        hb->ibmapsize = m.ibmapsize;
+        hb->resfiles = 9;
+        if (set > 1) {
+            hb->rvn = vol + 1;
+            hb->setcount = set;
+        }
+        hb->volowner = 0x00010001;
+        hb->protect = 0;
+        hb->fileprot = 0xfa00;
+        hb->credate = volume_date;
+        hb->revdate = volume_date;
+        hb->window = 7;
+        hb->lru_lim = 16;
+        hb->serialnum = (uint32_t)params.seed + vol;
+        memset(hb->strucname, ' ', sizeof(hb->strucname));
+        if (set > 1) {
+            label(hb->strucname, 0);
+        }
+        label(hb->volname, vol);
+        memset(hb->ownername, ' ', sizeof(hb->ownername));
+        memcpy(hb->format, "DECFILE11B  ", sizeof(hb->format));
+        set_home_block_checksums(hb);
+        err |= WriteBlocks(fd, hb->homelbn, home.buf.data(), 1);
+        err |= WriteBlocks(fd, hb->alhomelbn, home.buf.data(), 1);
+
+        // index file bitmap
+        std::vector<uint8_t> ibmap(m.ibmapsize * 512);
+        auto mark = [&](uint32_t num) { ibmap[(num - 1) / 8] |= 1 << ((num - 1) % 8); };
+        for (auto &f : files) {
+            if (f.vol == vol) {
+                mark(f.num);
+            }
+            if (f.ext_num && f.ext_vol == vol) {
+                mark(f.ext_num);
+            }
+        }
+        err |= WriteBlocks(fd, ibmaplbn, ibmap.data(), m.ibmapsize);
+
+        // file headers
+        Disk::Block blk;
+        const uint32_t header_lbn = ibmaplbn + m.ibmapsize - 1;
+        for (auto &f : files) {
+            if (f.vol == vol) {
+                const auto backlink = GenFileId(files[dirs[f.parent].file], vol);
+                BuildHeader(&blk, f, backlink, volume_date + f.num * 10000000ULL);
+                err |= WriteBlocks(fd, header_lbn + f.num, blk.buf.data(), 1);
+                if (f.num == (uint32_t)reserved_files::INDEX) {
+                    err |= WriteBlocks(fd, hb->altidxlbn, blk.buf.data(), 1);
+                }
+            }
+            if (f.ext_num && f.ext_vol == vol) {
+                BuildExtensionHeader(&blk, f, volume_date + f.num * 10000000ULL);
+                err |= WriteBlocks(fd, header_lbn + f.ext_num, blk.buf.data(), 1);
+            }
+        }
+
+        // directory contents
+        for (auto &d : dirs) {
+            const auto &f = files[d.file];
+            if (f.vol == vol) {
+                err |= WriteBlocks(fd, f.extents[0].lbn, d.blocks.data(), d.blocks.size());
+            }
+        }
+
+        // the volume set list, 64 byte records of the structure name and then
+        // the label of each member
+        if (vol == 0 && set > 1) {
+            std::vector<uint8_t> list(volset.alloc_blocks * 512);
+            for (uint32_t i = 0; i <= set; i++) {
+                label(list.data() + i * 64, i == 0 ? 0 : i - 1);
+            }
+            err |= WriteBlocks(fd, volset.extents[0].lbn, list.data(), volset.alloc_blocks);
+        }
+
+        // storage control block and bitmap, a set bit is a free cluster
+        std::vector<uint8_t> sbm((m.bitmap_blocks - 1) * 512);
+        for (uint32_t i = 0; i < m.total_clusters; i++) {
+            sbm[i / 8] |= 1 << (i % 8);
+        }
+        auto mark_used = [&](const std::vector<LbnRun> &extents) {
+            for (auto &e : extents) {
+                for (uint32_t cl = e.lbn / c; cl < (e.lbn + e.count) / c; cl++) {
+                    sbm[cl / 8] &= ~(1 << (cl % 8));
+                }
+            }
+        };
+        for (auto &f : files) {
+            if (f.vol == vol) {
+                mark_used(f.extents);
+            }
+            if (f.ext_num && f.ext_vol == vol) {
+                mark_used(f.ext_extents);
+            }
+        }
+        const auto &bitmapf = files[m.reserved + (int)reserved_files::BITMAP - 1];
+        blk.buf.fill(0);
+        auto *scb = (storage_control_block *)blk.buf.data();
+        scb->struclev = 0x0201;
+        scb->cluster = c;
+        scb->volsize = volume_blocks;
+        scb->blksize = 1;
+        set_block_checksum(blk.buf.data());
+        err |= WriteBlocks(fd, bitmapf.extents[0].lbn, blk.buf.data(), 1);
+        err |= WriteBlocks(fd, bitmapf.extents[0].lbn + 1, sbm.data(), m.bitmap_blocks - 1);
+    }
+
+    // user file contents, an extent at a time, following a spanning file onto
+    // its second member
+    std::vector<uint8_t> buf;
+    for (auto &f : files) {
+        if (f.num <= 9 || f.dir >= 0 || err) {
+            continue;
+        }
+        std::vector<std::pair<int, LbnRun>> runs;
+        for (auto &e : f.extents) {
+            runs.emplace_back(fds[f.vol], e);
+        }
+        for (auto &e : f.ext_extents) {
+            runs.emplace_back(fds[f.ext_vol], e);
+        }
+        const uint32_t used = (f.bytes + 511) / 512;
+        uint32_t vbn = 1;
+        for (auto &[fd, e] : runs) {
+            const uint32_t count = std::min(e.count, used + 1 - vbn);
+            buf.assign(count * 512, 0);
+            for (uint32_t i = 0; i < count; i++) {
+                FillBlock(buf.data() + i * 512, f.num | f.vol << 24, vbn + i, params.seed);
+            }
+            if (vbn + count - 1 == used && f.bytes % 512) {
+                memset(buf.data() + (count - 1) * 512 + f.bytes % 512, 0, 512 - f.bytes % 512);
+            }
+            err |= WriteBlocks(fd, e.lbn, buf.data(), count);
+            vbn += count;
+            if (vbn > used) {
+                break;
+            }
+        }
+    }
+
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return err ? -1 : 0;
+}
+
+} // namespace ods2
@@ -0,0 +1,43 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace ods2 {
+
+// Parameters for generating a synthetic ODS-2 volume. Every field has a
+// default so a bare VolumeParams{} produces a small, valid image. The output is
+// fully determined by the parameters, so the same parameters always produce a
+// byte-identical image.
+struct VolumeParams {
+    uint32_t files = 100;        // total file headers for user files (all versions)
+    uint32_t fanout = 4;         // subdirectories per directory
+    uint32_t depth = 2;          // directory levels below the MFD
+    uint32_t versions = 1;       // versions per file name
+    uint32_t min_blocks = 1;     // smallest file, in blocks
+    uint32_t max_blocks = 16;    // largest file, in blocks
+    uint32_t extents = 1;        // extents per file (> 1 fragments files with LBN gaps)
+    uint16_t cluster = 1;        // storage bitmap cluster factor
+    uint32_t spare_headers = 64; // preallocated but unused file headers
+    uint32_t max_files = 0;      // room in the index file bitmap, 0 for just the headers
+    uint32_t free_blocks = 1024; // free space left at the end of the volume
+    uint32_t volumes = 1;        // members of a bound volume set, 1 for a volume on its own
+    uint64_t seed = 1;
+    std::string volname = "SYNTHETIC"; // and the structure name of a set
+};
+
+// A set is written to one image per member, named by VolumeSetPath. Its
+// directories and files are dealt out across the members, and some files
+// continue on the next member through an extension header.
+int GenerateVolume(const std::string &path, const VolumeParams &params);
+
+// Where relative volume rvn of a set generated at path goes: the number is
+// put before the extension, so set.img becomes set1.img, set2.img and so on
+std::string VolumeSetPath(const std::string &path, uint16_t rvn);
+
+} // namespace ods2
@@ -0,0 +1,335 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include "walk.h"
+
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <set>
+#include <vector>
+
+#include "filesystem.h"
+#include "utils.h"
+
+#define LOCAL_TRACE 0
+
+namespace ods2 {
+
+namespace {
+
+// Number of file headers read from the index file at a time
+const uint32_t scan_batch_headers = 256;
+
+// Most batches kept in flight when scanning through an engine
+const size_t scan_batch_window = 16;
+
+// Directories already walked, by file number and volume, as file numbers are
+// only unique within a member of a volume set
+uint64_t VisitKey(const file_id &id) { return (uint64_t)id.rv_num << 32 | id.file_num(); }
+
+// Read the file headers of every entry of a directory through the engine.
+// Entries on other members of a volume set than the one the engine reads are
+// left with a status of 1, to be opened without it.
+std::vector<int> ReadEntryHeaders(const Filesystem &fs, const DirEntryList &list, IoEngine &io,
+                                  std::vector<Disk::Block> &headers) {
+    headers.resize(list.size());
+    std::vector<int> errs(list.size(), 0);
+    for (size_t i = 0; i < list.size(); i++) {
+        const auto *vol = fs.volume(list[i].fid.rv_num);
+        if (!vol || &vol->disk() != &io.disk()) {
+            errs[i] = 1;
+            continue;
+        }
+        const auto index = vol->index_file();
+        const uint32_t vbn = list[i].fid.file_num() + vol->index_file_starting_vbn();
+        if (index->ReadVbnsAsync(io, vbn, 1, &headers[i],
+                                 [&errs, i](int err) { errs[i] = err; }) < 0) {
+            errs[i] = -1;
+        }
+    }
+    io.Drain();
+
+    return errs;
+}
+
+int WalkDirectory(const Filesystem &fs, const std::shared_ptr<File> &dir, const std::string &path,
+                  std::set<uint64_t> &visited, const WalkCallback &callback, IoEngine *io) {
+    auto [err, list] = dir->ReadDirEntries();
+    if (err < 0) {
+        fprintf(stderr, "error reading directory [%s]\n", path.c_str());
+        return err;
+    }
+
+    LTRACEF("[%s] %zu entries\n", path.c_str(), list.size());
+
+    std::vector<Disk::Block> headers;
+    std::vector<int> errs;
+    if (io) {
+        errs = ReadEntryHeaders(fs, list, *io, headers);
+    }
+
+    for (size_t i = 0; i < list.size(); i++) {
+        const auto &e = list[i];
+        auto f = std::make_shared<File>(fs);
+        const bool read = io && errs[i] == 0;
+        if ((io && errs[i] < 0) || (read ? f->Open(e.fid, headers[i]) : f->Open(e.fid)) < 0) {
+            fprintf(stderr, "error opening file '[%s]%s;%u'\n", path.c_str(), e.name.c_str(),
+                    e.version);
+            continue;
+        }
+
+        callback("[" + path + "]" + e.name + ";" + std::to_string(e.version), e, f);
+
+        // recurse into subdirectories, taking care to not loop back into the
+        // MFD through its own entry, or through a damaged directory tree
+        if (f->is_dir() && visited.insert(VisitKey(f->id())).second) {
+            const auto sub = path == "000000" ? DirStem(e.name) : path + "." + DirStem(e.name);
+            WalkDirectory(fs, f, sub, visited, callback, io);
+        }
+    }
+
+    return 0;
+}
+
+} // namespace
+
+int WalkVolume(const Filesystem &fs, const WalkCallback &callback, IoEngine *io) {
+    auto root = fs.OpenRootDir();
+    if (!root) {
+        return -1;
+    }
+
+    std::set<uint64_t> visited{VisitKey(root->id())};
+    return WalkDirectory(fs, root, "000000", visited, callback, io);
+}
+
+bool ParseSpec(const std::string &spec, SpecParts *parts) {
+    std::string upper(spec);
+    std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+
+    // split off the directory part
+    parts->dirs.clear();
+    parts->name = upper;
+    if (!upper.empty() && upper[0] == '[') {
+        auto close = upper.find(']');
+        if (close == std::string::npos) {
+            return false;
+        }
+        size_t start = 1;
+        while (start < close) {
+            auto dot = std::min(upper.find('.', start), close);
+            auto component = upper.substr(start, dot - start);
+            if (!component.empty() && component != "000000") {
+                parts->dirs.push_back(component + ".DIR");
+            }
+            start = dot + 1;
+        }
+        parts->name = upper.substr(close + 1);
+    }
+
+    // and the version
+    parts->version = 0;
+    auto semi = parts->name.find(';');
+    if (semi != std::string::npos) {
+        parts->version = strtoul(parts->name.c_str() + semi + 1, nullptr, 10);
+        parts->name.resize(semi);
+    }
+
+    return true;
+}
+
+std::string DirStem(const std::string &name) {
+    auto dot = name.rfind('.');
+    return dot == std::string::npos ? name : name.substr(0, dot);
+}
+
+bool WildcardMatch(std::string_view pattern, std::string_view s) {
+    size_t p = 0;
+    size_t i = 0;
+    size_t star = std::string_view::npos;
+    size_t resume = 0;
+    while (i < s.size()) {
+        if (p < pattern.size() && (pattern[p] == '%' || pattern[p] == s[i])) {
+            p++;
+            i++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            resume = i;
+        } else if (star != std::string_view::npos) {
+            p = star + 1;
+            i = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+std::shared_ptr<File> LookupSpec(const Filesystem &fs, const std::string &spec) {
+    SpecParts parts;
+    if (!ParseSpec(spec, &parts)) {
+        return nullptr;
+    }
+
+    auto open_entry = [&](const File &dir, const std::string &n,
+                          uint32_t v) -> std::shared_ptr<File> {
+        auto [err, list] = dir.ReadDirEntries();
+        if (err < 0) {
+            return nullptr;
+        }
+        // versions of a name are sorted highest first
+        for (auto &e : list) {
+            if (e.name == n && (v == 0 || e.version == v)) {
+                auto f = std::make_shared<File>(fs);
+                if (f->Open(e.fid) < 0) {
+                    return nullptr;
+                }
+                return f;
+            }
+        }
+        return nullptr;
+    };
+
+    auto dir = fs.OpenRootDir();
+    for (auto &d : parts.dirs) {
+        dir = open_entry(*dir, d, 0);
+        if (!dir || !dir->is_dir()) {
+            return nullptr;
+        }
+    }
+    if (parts.name.empty()) {
+        return dir;
+    }
+
+    return open_entry(*dir, parts.name, parts.version);
+}
+
+int ScanIndexFile(const Filesystem &fs, const ScanCallback &callback, IoEngine *io) {
+    const auto &hb = fs.home();
+    const auto index = fs.index_file();
+
+    std::vector<uint8_t> bitmap((size_t)hb.ibmapsize * 512);
+    if (index->ReadVbns(hb.ibmapvbn, hb.ibmapsize, bitmap.data()) < 0) {
+        fprintf(stderr, "error reading index file bitmap\n");
+        return -1;
+    }
+    auto in_use = [&](uint32_t num) {
+        const uint32_t bit = num - 1;
+        return (bitmap[bit / 8] >> (bit % 8)) & 1;
+    };
+
+    // headers can only exist within the allocated part of the index file
+    uint32_t index_blocks = 0;
+    for (auto &e : index->extents()) {
+        index_blocks = std::max(index_blocks, e.vbn + e.block_count - 1);
+    }
+    const uint32_t first_vbn = fs.index_file_starting_vbn() + 1;
+    if (index_blocks < first_vbn) {
+        return 0;
+    }
+    const uint32_t maxfiles = std::min<uint32_t>(
+        {hb.maxfiles, index_blocks - first_vbn + 1, (uint32_t)bitmap.size() * 8});
+
+    LTRACEF("scanning %u headers starting at vbn %#x\n", maxfiles, first_vbn);
+
+    auto parse_batch = [&](uint32_t num, uint32_t n, const std::vector<Disk::Block> &batch) {
+        for (uint32_t i = 0; i < n; i++) {
+            if (!in_use(num + i)) {
+                continue;
+            }
+
+            // the header is the final authority, the bitmap may be stale
+            const auto &blk = batch[i];
+            const auto *fh = (const file_header *)blk.buf.data();
+            const auto checksum = ((const uint16_t *)blk.buf.data())[255];
+            if (fh->fid.file_num() != num + i || fh->fid.sequence_num == 0 || fh->seg_num != 0 ||
+                block_checksum(blk.buf.data(), 255) != checksum) {
+                LTRACEF("skipping invalid or extension header %u\n", num + i);
+                continue;
+            }
+
+            auto f = std::make_shared<File>(fs);
+            if (f->Open(fh->fid, blk) < 0) {
+                continue;
+            }
+            callback(f);
+        }
+    };
+
+    // skip over stretches of the bitmap with nothing in use
+    auto next_batch = [&](uint32_t num) {
+        for (; num <= maxfiles; num += scan_batch_headers) {
+            const uint32_t n = std::min(scan_batch_headers, maxfiles - num + 1);
+            for (uint32_t i = 0; i < n; i++) {
+                if (in_use(num + i)) {
+                    return num;
+                }
+            }
+        }
+        return num;
+    };
+
+    if (!io) {
+        std::vector<Disk::Block> batch(scan_batch_headers);
+        for (uint32_t num = next_batch(1); num <= maxfiles;
+             num = next_batch(num + scan_batch_headers)) {
+            const uint32_t n = std::min(scan_batch_headers, maxfiles - num + 1);
+            if (index->ReadVbns(first_vbn + num - 1, n, batch.data()) < 0) {
+                fprintf(stderr, "error reading file headers at %u\n", num);
+                return -1;
+            }
+            parse_batch(num, n, batch);
+        }
+        return 0;
+    }
+
+    // keep a window of batches in flight, parsing them in order as they land
+    struct Batch {
+        uint32_t num;
+        uint32_t n;
+        std::vector<Disk::Block> blocks;
+        bool done = false;
+        int err = 0;
+    };
+    const size_t window = std::clamp<size_t>(io->queue_depth(), 2, scan_batch_window);
+    std::deque<Batch> inflight;
+    uint32_t next = next_batch(1);
+    int result = 0;
+    while (result == 0 && (next <= maxfiles || !inflight.empty())) {
+        while (inflight.size() < window && next <= maxfiles) {
+            const uint32_t n = std::min(scan_batch_headers, maxfiles - next + 1);
+            auto &b = inflight.emplace_back(next, n, std::vector<Disk::Block>(n));
+            if (index->ReadVbnsAsync(*io, first_vbn + next - 1, n, b.blocks.data(), [&b](int err) {
+                    b.err = err;
+                    b.done = true;
+                }) < 0) {
+                b.err = -1;
+                b.done = true;
+            }
+            next = next_batch(next + scan_batch_headers);
+        }
+
+        auto &b = inflight.front();
+        io->WaitUntil([&b]() { return b.done; });
+        if (b.err < 0) {
+            fprintf(stderr, "error reading file headers at %u\n", b.num);
+            result = -1;
+        } else {
+            parse_batch(b.num, b.n, b.blocks);
+        }
+        inflight.pop_front();
+    }
+
+    // the rest of the window still points into inflight
+    io->Drain();
+
+    return result;
+}
+
+} // namespace ods2
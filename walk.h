@@ -0,0 +1,62 @@
+// Copyright (c) 2024 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "file.h"
+
+namespace ods2 {
+
+class Filesystem;
+
+// Called for every directory entry found while walking a volume. spec is the
+// full file specification of the entry, in the form [DIR.SUBDIR]NAME.EXT;VERSION
+using WalkCallback = std::function<void(const std::string &spec, const DirEntry &entry,
+                                        const std::shared_ptr<File> &file)>;
+
+// Recursively walk every directory on the volume starting at the MFD, opening
+// each entry by its file id. With an engine, the headers of all the entries of
+// a directory are read at once, keeping up to its queue depth reads in flight.
+int WalkVolume(const Filesystem &fs, const WalkCallback &callback, IoEngine *io = nullptr);
+
+// The parts of a file spec, [DIR.SUBDIR]NAME.EXT;VERSION, upper cased. dirs
+// names the directory files to descend through from the MFD, 'SUBDIR.DIR',
+// and a missing version is 0.
+struct SpecParts {
+    std::vector<std::string> dirs;
+    std::string name;
+    uint32_t version = 0;
+};
+
+// Fails only if the directory part is not closed
+bool ParseSpec(const std::string &spec, SpecParts *parts);
+
+// Directory name within a path, 'FOO.DIR' -> 'FOO'
+std::string DirStem(const std::string &name);
+
+// VMS style wildcards: * matches any run of characters and % any one
+bool WildcardMatch(std::string_view pattern, std::string_view s);
+
+// Open a file by its spec, [DIR.SUBDIR]NAME.EXT;VERSION. The directory part
+// defaults to the MFD and a missing version selects the highest one. Returns
+// nullptr if any part of the spec is not found.
+std::shared_ptr<File> LookupSpec(const Filesystem &fs, const std::string &spec);
+
+// Called for every valid primary file header found while scanning the index file
+using ScanCallback = std::function<void(const std::shared_ptr<File> &file)>;
+
+// Visit every file header marked in use in the index file bitmap, reading the
+// headers in large batches. Does not touch the directory tree, so it also finds
+// files that are not entered in any directory. With an engine, the following
+// batches are read while the current one is being parsed.
+int ScanIndexFile(const Filesystem &fs, const ScanCallback &callback, IoEngine *io = nullptr);
+
+} // namespace ods2